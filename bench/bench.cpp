@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "bufferpool.h"
+#include "channel.h"
+#include "filesocket.h"
+#include "filesystem.h"
+#include "globals.h"
+#include "iothread.h"
+#include "manifest.h"
+#include "readahead.h"
+#include "stats.h"
+
+// Drives the redirection code against a client.py serving the files
+// run.sh generates, and prints one line per measurement
+
+#define BENCH_TITLE "0005000010101D00"
+#define SMALL_FILE  "/vol/content/bench/4k.bin"
+#define MISSING     "/vol/content/bench/missing.bin"
+
+typedef struct SizedFile {
+	const char *path;
+	uint32_t size;
+} SizedFile;
+
+static const SizedFile sizedFiles[] = {
+	{ "/vol/content/bench/64k.bin", 0x10000 },
+	{ "/vol/content/bench/1m.bin",  0x100000 },
+	{ "/vol/content/bench/16m.bin", 0x1000000 },
+};
+
+static const uint32_t chunkSizes[]     = { 0x1000, 0x10000, 0x100000 };
+static const uint32_t readAheadSizes[] = { 0x4000, 0x10000, 0x40000 };
+
+static uint32_t iterations = 1000;
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static double percentile(std::vector<double> &samples, double p) {
+	size_t index = (size_t)(p * (samples.size() - 1) + 0.5);
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+static bool open(const char *path, FSFileHandle *handle) {
+	return openFile(NULL, NULL, path, "r", handle, 0) == 0;
+}
+
+static void close(FSFileHandle handle) {
+	closeFile(NULL, NULL, handle, 0);
+}
+
+static void benchLookups() {
+	double start = now();
+	for (uint32_t i = 0; i < iterations; i++) {
+		isServerFile(SMALL_FILE);
+		isServerFile(MISSING);
+	}
+	double elapsed = now() - start;
+
+	printf("isServerFile        %10.2f us/call (%s)\n", elapsed / (iterations * 2) * 1e6,
+	       hasManifest() ? "manifest" : "over the wire");
+}
+
+static void benchOpens() {
+	double start = now();
+	for (uint32_t i = 0; i < iterations; i++) {
+		FSFileHandle handle;
+		if (!open(SMALL_FILE, &handle)) {
+			fprintf(stderr, "Could not open %s\n", SMALL_FILE);
+			exit(1);
+		}
+		close(handle);
+	}
+	double elapsed = now() - start;
+
+	printf("open/close          %10.0f opens/s\n", iterations / elapsed);
+}
+
+// Latency of 512 byte reads, sequential ones mostly served by read-ahead and
+// random ones that all go to the host
+static void benchSmallReads(bool random) {
+	const SizedFile *file = &sizedFiles[1];
+	FSFileHandle handle;
+	if (!open(file->path, &handle))
+		return;
+
+	std::vector<double> samples;
+	samples.reserve(iterations);
+	char buffer[512];
+	uint32_t pos = 0;
+	srand(1);
+
+	for (uint32_t i = 0; i < iterations; i++) {
+		if (random) {
+			pos = (rand() % (file->size / sizeof(buffer))) * sizeof(buffer);
+			setPosFile(NULL, NULL, handle, pos, 0);
+		} else if (pos + sizeof(buffer) > file->size) {
+			pos = 0;
+			setPosFile(NULL, NULL, handle, pos, 0);
+		}
+
+		double start = now();
+		readFile(NULL, NULL, buffer, 1, sizeof(buffer), handle, 0, 0);
+		samples.push_back((now() - start) * 1e6);
+		pos += sizeof(buffer);
+	}
+	close(handle);
+
+	printf("512B reads %-8s  p50 %7.1f us  p90 %7.1f us  p99 %7.1f us  max %7.1f us\n", random ? "random" : "seq",
+	       percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99), percentile(samples, 1));
+}
+
+static void benchLargeReads() {
+	std::vector<char> buffer(0x100000);
+
+	for (const SizedFile &file : sizedFiles) {
+		for (uint32_t chunkSize : chunkSizes) {
+			for (uint32_t blockSize : readAheadSizes) {
+				readAheadBlockSize = blockSize;
+
+				FSFileHandle handle;
+				if (!open(file.path, &handle))
+					continue;
+
+				double start = now();
+				uint32_t total = 0;
+				while (true) {
+					int read = readFile(NULL, NULL, buffer.data(), 1, chunkSize, handle, 0, 0);
+					if (read <= 0)
+						break;
+					total += read;
+				}
+				double elapsed = now() - start;
+				close(handle);
+
+				if (total != file.size)
+					fprintf(stderr, "Short read of %s: %u of %u bytes\n", file.path, total, file.size);
+
+				printf("read %8u B  chunk %7u  read-ahead %6u  %8.1f MB/s\n", file.size, chunkSize, blockSize,
+				       total / elapsed / (1024 * 1024));
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *host = "127.0.0.1";
+
+	int option;
+	while ((option = getopt(argc, argv, "h:n:")) != -1) {
+		if (option == 'h')
+			host = optarg;
+		else if (option == 'n')
+			iterations = strtoul(optarg, NULL, 0);
+		else {
+			fprintf(stderr, "Usage: %s [-h host] [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// Slabs fit the largest read-ahead block benchmarked
+	readAheadBlockSize = readAheadSizes[sizeof(readAheadSizes) / sizeof(readAheadSizes[0]) - 1];
+	initBufferPool();
+	initChannel();
+	initIoThread();
+	initRedirectedFiles();
+	initStats();
+
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	configureSocket(fd);
+
+	struct sockaddr_in serverAddr = {};
+	serverAddr.sin_family = AF_INET;
+	serverAddr.sin_port = htons(2557);
+	inet_pton(AF_INET, host, &serverAddr.sin_addr);
+
+	if (connect(fd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0 || !handshake(BENCH_TITLE)) {
+		fprintf(stderr, "Could not connect to client.py at %s\n", host);
+		return 1;
+	}
+
+	clientEnabled = true;
+	startChannel();
+	startIoThread();
+	printf("protocol v%u, capabilities %08X\n", protocolVersion, capabilities);
+
+	benchLookups();
+	benchOpens();
+	benchSmallReads(false);
+	benchSmallReads(true);
+	benchLargeReads();
+
+	printf("read-ahead hits %u misses %u\n", readAheadStats.hits, readAheadStats.misses);
+
+	// Also saved by client.py, under DebugFiles/
+	sendStats();
+
+	stopIoThread();
+	stopChannel();
+	::close(fd);
+	return 0;
+}
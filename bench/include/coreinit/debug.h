@@ -0,0 +1,14 @@
+#pragma once
+
+#include <wut.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+void OSReport(const char *fmt, ...);
+void OSFatal(const char *message);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <wut.h>
+#include <coreinit/time.h>
+
+// Backed by a pthread mutex and condition variable, see stubs.cpp
+typedef struct OSEvent {
+	void *host;
+} OSEvent;
+
+typedef enum OSEventMode {
+	OS_EVENT_MODE_MANUAL = 0,
+	OS_EVENT_MODE_AUTO   = 1,
+} OSEventMode;
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+void OSInitEvent(OSEvent *event, BOOL value, OSEventMode mode);
+void OSSignalEvent(OSEvent *event);
+void OSWaitEvent(OSEvent *event);
+BOOL OSWaitEventWithTimeout(OSEvent *event, OSTime timeout);
+void OSResetEvent(OSEvent *event);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
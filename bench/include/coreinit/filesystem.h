@@ -0,0 +1,72 @@
+#pragma once
+
+#include <wut.h>
+#include <coreinit/messagequeue.h>
+
+// The FS types the hooks pass around, laid out as in wut where it matters
+
+#define FS_MAX_LOCALPATH_SIZE 511
+#define FS_MAX_MOUNTPATH_SIZE 128
+#define FS_MAX_FULLPATH_SIZE  (FS_MAX_LOCALPATH_SIZE + FS_MAX_MOUNTPATH_SIZE)
+
+typedef uint32_t FSFileHandle;
+typedef uint32_t FSDirectoryHandle;
+typedef int32_t FSStatus;
+typedef int64_t FSTime;
+
+typedef struct FSClient {
+	uint8_t buffer[0x1700];
+} FSClient;
+
+typedef struct FSCmdBlock {
+	uint8_t buffer[0xA80];
+} FSCmdBlock;
+
+#define FS_STATUS_OK           0
+#define FS_STATUS_END          -2
+#define FS_STATUS_NOT_FOUND    -6
+#define FS_STATUS_ACCESS_ERROR -9
+#define FS_STATUS_FATAL_ERROR  -0x400
+
+typedef enum FSErrorFlag {
+	FS_ERROR_FLAG_NONE = 0,
+	FS_ERROR_FLAG_ALL  = -1,
+} FSErrorFlag;
+
+typedef enum FSStatFlags {
+	FS_STAT_DIRECTORY = 0x80000000,
+} FSStatFlags;
+
+typedef enum FSMode {
+	FS_MODE_READ_OWNER = 0x400,
+} FSMode;
+
+typedef struct WUT_PACKED FSStat {
+	FSStatFlags flags;
+	FSMode mode;
+	uint32_t owner;
+	uint32_t group;
+	uint32_t size;
+	uint32_t allocSize;
+	uint64_t quotaSize;
+	uint32_t entryId;
+	FSTime created;
+	FSTime modified;
+	uint8_t unknown[0x30];
+} FSStat;
+
+typedef void (*FSAsyncCallback)(FSClient *client, FSCmdBlock *block, FSStatus status, uint32_t context);
+
+typedef struct FSAsyncData {
+	FSAsyncCallback callback;
+	uint32_t param;
+	OSMessageQueue *ioMsgQueue;
+} FSAsyncData;
+
+typedef struct FSAsyncResult {
+	FSAsyncData asyncData;
+	OSMessage ioMsg;
+	FSClient *client;
+	FSCmdBlock *block;
+	FSStatus status;
+} FSAsyncResult;
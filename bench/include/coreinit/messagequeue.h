@@ -0,0 +1,33 @@
+#pragma once
+
+#include <wut.h>
+
+typedef struct OSMessage {
+	void *message;
+	uint32_t args[3];
+} OSMessage;
+
+// Backed by a bounded std::deque, see stubs.cpp
+typedef struct OSMessageQueue {
+	void *host;
+} OSMessageQueue;
+
+typedef enum OSMessageFlags {
+	OS_MESSAGE_FLAGS_NONE          = 0,
+	OS_MESSAGE_FLAGS_BLOCKING      = 1 << 0,
+	OS_MESSAGE_FLAGS_HIGH_PRIORITY = 1 << 1,
+} OSMessageFlags;
+
+#define OS_FUNCTION_TYPE_FS_CMD_ASYNC 10
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+void OSInitMessageQueue(OSMessageQueue *queue, OSMessage *messages, int32_t size);
+BOOL OSSendMessage(OSMessageQueue *queue, OSMessage *message, OSMessageFlags flags);
+BOOL OSReceiveMessage(OSMessageQueue *queue, OSMessage *message, OSMessageFlags flags);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
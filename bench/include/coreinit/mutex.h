@@ -0,0 +1,21 @@
+#pragma once
+
+#include <wut.h>
+
+// Backed by a recursive pthread mutex, see stubs.cpp
+typedef struct OSMutex {
+	void *host;
+} OSMutex;
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+void OSInitMutex(OSMutex *mutex);
+void OSLockMutex(OSMutex *mutex);
+void OSUnlockMutex(OSMutex *mutex);
+BOOL OSTryLockMutex(OSMutex *mutex);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <wut.h>
+#include <coreinit/time.h>
+
+// Backed by a pthread, see stubs.cpp
+typedef struct OSThread {
+	void *host;
+} OSThread;
+
+typedef int (*OSThreadEntryPointFn)(int argc, const char **argv);
+
+typedef enum OSThreadAttributes {
+	OS_THREAD_ATTRIB_AFFINITY_CPU0 = 1 << 0,
+	OS_THREAD_ATTRIB_AFFINITY_CPU1 = 1 << 1,
+	OS_THREAD_ATTRIB_AFFINITY_CPU2 = 1 << 2,
+	OS_THREAD_ATTRIB_AFFINITY_ANY  = 7,
+	OS_THREAD_ATTRIB_DETACHED      = 1 << 3,
+} OSThreadAttributes;
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+BOOL OSCreateThread(OSThread *thread, OSThreadEntryPointFn entry, int32_t argc, char *argv,
+                    void *stack, uint32_t stackSize, int32_t priority, OSThreadAttributes attributes);
+int32_t OSResumeThread(OSThread *thread);
+BOOL OSJoinThread(OSThread *thread, int *result);
+void OSSetThreadName(OSThread *thread, const char *name);
+void OSSleepTicks(OSTime ticks);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
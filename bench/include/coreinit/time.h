@@ -0,0 +1,22 @@
+#pragma once
+
+#include <wut.h>
+
+typedef int64_t OSTime;
+
+// Ticks run at the console's timer rate so code converting them keeps working
+#define OS_TIMER_CLOCK 62156250
+
+#define OSTicksToMicroseconds(ticks) ((ticks) * 1000000 / OS_TIMER_CLOCK)
+#define OSTicksToMilliseconds(ticks) ((ticks) * 1000 / OS_TIMER_CLOCK)
+#define OSMillisecondsToTicks(ms)    ((ms) * OS_TIMER_CLOCK / 1000)
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+OSTime OSGetTime(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <wut.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+uint64_t OSGetTitleID(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <wut.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+BOOL WHBLogPrintf(const char *fmt, ...);
+BOOL WHBLogWritef(const char *fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,16 @@
+#pragma once
+
+// Just enough of wut for the redirection code to build on Linux
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int32_t BOOL;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#define WUT_PACKED __attribute__((__packed__))
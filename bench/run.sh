@@ -0,0 +1,40 @@
+#!/bin/sh
+# Usage: run.sh <work directory> [python]
+#
+# Generates the files bench reads under <work directory>, serves them with
+# client.py on loopback and runs bench against it. Extra client.py options
+# can be passed in CLIENT_ARGS, e.g. CLIENT_ARGS=--no-compression.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+WORKDIR=${1:-work}
+PYTHON=${2:-python3}
+TITLE=0005000010101D00
+
+mkdir -p "$WORKDIR/vol/$TITLE/content/bench"
+cd "$WORKDIR"
+
+# Random contents so compression does not flatter the numbers
+for file in 4k:4096 64k:65536 1m:1048576 16m:16777216; do
+	path=vol/$TITLE/content/bench/${file%%:*}.bin
+	[ -f "$path" ] || head -c "${file#*:}" /dev/urandom > "$path"
+done
+
+$PYTHON -u "$BENCH_DIR/../client.py" --ip 127.0.0.1 $CLIENT_ARGS < /dev/null > client.log 2>&1 &
+CLIENT=$!
+trap 'kill $CLIENT 2>/dev/null' EXIT
+
+# Wait for the server to listen
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	grep -q "Server has been started" client.log && break
+	sleep 0.5
+done
+
+"$BENCH_DIR/bench" $BENCH_ARGS
+
+# Let client.py save the statistics bench sends on its way out
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	grep -q "Finish" client.log && break
+	sleep 0.5
+done
@@ -0,0 +1,293 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <deque>
+
+#include <coreinit/debug.h>
+#include <coreinit/event.h>
+#include <coreinit/messagequeue.h>
+#include <coreinit/mutex.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+#include <coreinit/title.h>
+#include <whb/log.h>
+
+#include "globals.h"
+#include "loader.h"
+
+// The coreinit primitives the redirection code uses, on top of pthreads.
+// Each coreinit object holds a pointer to its host counterpart, which is
+// never freed: the plugin creates a handful of them per run.
+
+// Settings that main.cpp normally loads from storage
+bool clientEnabled;
+bool overlayEnabled;
+int fd = -1;
+uint32_t protocolVersion;
+uint32_t capabilities;
+
+uint32_t readAheadBlockSize = 0x10000;
+uint32_t readAheadBudget    = 0x100000;
+uint32_t sdCacheLimit       = 0;
+uint32_t prefetchBudget     = 0;
+uint32_t loaderMemoryLimit  = 0x40000;
+
+// loader.cpp is console only, its counters stay zero and nothing was
+// loaded that could be reloaded
+LoaderStats loaderStats;
+
+bool applyPatches(const char *buffer, uint32_t length) {
+	return false;
+}
+
+LoadedImage *findLoadedImage(uint32_t type) {
+	return NULL;
+}
+
+bool resizeLoadedImage(LoadedImage *image, uint32_t size) {
+	return false;
+}
+
+uint32_t updateImageBlocks(LoadedImage *image, const uint32_t *indices, const char *blocks, uint32_t count) {
+	return 0;
+}
+
+extern "C" {
+
+void OSReport(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+void OSFatal(const char *message) {
+	fprintf(stderr, "OSFatal: %s\n", message);
+	abort();
+}
+
+BOOL WHBLogPrintf(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	return TRUE;
+}
+
+BOOL WHBLogWritef(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	return TRUE;
+}
+
+uint64_t OSGetTitleID(void) {
+	return 0x0005000010101D00;
+}
+
+OSTime OSGetTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (OSTime)now.tv_sec * OS_TIMER_CLOCK + (OSTime)now.tv_nsec * OS_TIMER_CLOCK / 1000000000;
+}
+
+void OSInitMutex(OSMutex *mutex) {
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+
+	pthread_mutex_t *host = new pthread_mutex_t;
+	pthread_mutex_init(host, &attributes);
+	mutex->host = host;
+}
+
+void OSLockMutex(OSMutex *mutex) {
+	pthread_mutex_lock((pthread_mutex_t *)mutex->host);
+}
+
+void OSUnlockMutex(OSMutex *mutex) {
+	pthread_mutex_unlock((pthread_mutex_t *)mutex->host);
+}
+
+BOOL OSTryLockMutex(OSMutex *mutex) {
+	return pthread_mutex_trylock((pthread_mutex_t *)mutex->host) == 0;
+}
+
+typedef struct HostEvent {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool value;
+	bool autoReset;
+} HostEvent;
+
+void OSInitEvent(OSEvent *event, BOOL value, OSEventMode mode) {
+	HostEvent *host = new HostEvent;
+	pthread_mutex_init(&host->mutex, NULL);
+	pthread_cond_init(&host->cond, NULL);
+	host->value = value;
+	host->autoReset = mode == OS_EVENT_MODE_AUTO;
+	event->host = host;
+}
+
+void OSSignalEvent(OSEvent *event) {
+	HostEvent *host = (HostEvent *)event->host;
+	pthread_mutex_lock(&host->mutex);
+	host->value = true;
+	pthread_cond_broadcast(&host->cond);
+	pthread_mutex_unlock(&host->mutex);
+}
+
+void OSWaitEvent(OSEvent *event) {
+	HostEvent *host = (HostEvent *)event->host;
+	pthread_mutex_lock(&host->mutex);
+	while (!host->value)
+		pthread_cond_wait(&host->cond, &host->mutex);
+	if (host->autoReset)
+		host->value = false;
+	pthread_mutex_unlock(&host->mutex);
+}
+
+// The timeout is in nanoseconds, like on the console
+BOOL OSWaitEventWithTimeout(OSEvent *event, OSTime timeout) {
+	HostEvent *host = (HostEvent *)event->host;
+	timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000000000;
+	deadline.tv_nsec += timeout % 1000000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&host->mutex);
+	while (!host->value && pthread_cond_timedwait(&host->cond, &host->mutex, &deadline) == 0)
+		;
+	bool signalled = host->value;
+	if (signalled && host->autoReset)
+		host->value = false;
+	pthread_mutex_unlock(&host->mutex);
+	return signalled;
+}
+
+void OSResetEvent(OSEvent *event) {
+	HostEvent *host = (HostEvent *)event->host;
+	pthread_mutex_lock(&host->mutex);
+	host->value = false;
+	pthread_mutex_unlock(&host->mutex);
+}
+
+typedef struct HostQueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	std::deque<OSMessage> messages;
+	size_t size;
+} HostQueue;
+
+void OSInitMessageQueue(OSMessageQueue *queue, OSMessage *messages, int32_t size) {
+	HostQueue *host = new HostQueue;
+	pthread_mutex_init(&host->mutex, NULL);
+	pthread_cond_init(&host->cond, NULL);
+	host->size = size;
+	queue->host = host;
+}
+
+BOOL OSSendMessage(OSMessageQueue *queue, OSMessage *message, OSMessageFlags flags) {
+	HostQueue *host = (HostQueue *)queue->host;
+	pthread_mutex_lock(&host->mutex);
+
+	while (host->messages.size() >= host->size) {
+		if (!(flags & OS_MESSAGE_FLAGS_BLOCKING)) {
+			pthread_mutex_unlock(&host->mutex);
+			return FALSE;
+		}
+		pthread_cond_wait(&host->cond, &host->mutex);
+	}
+
+	if (flags & OS_MESSAGE_FLAGS_HIGH_PRIORITY)
+		host->messages.push_front(*message);
+	else
+		host->messages.push_back(*message);
+
+	pthread_cond_broadcast(&host->cond);
+	pthread_mutex_unlock(&host->mutex);
+	return TRUE;
+}
+
+BOOL OSReceiveMessage(OSMessageQueue *queue, OSMessage *message, OSMessageFlags flags) {
+	HostQueue *host = (HostQueue *)queue->host;
+	pthread_mutex_lock(&host->mutex);
+
+	while (host->messages.empty()) {
+		if (!(flags & OS_MESSAGE_FLAGS_BLOCKING)) {
+			pthread_mutex_unlock(&host->mutex);
+			return FALSE;
+		}
+		pthread_cond_wait(&host->cond, &host->mutex);
+	}
+
+	*message = host->messages.front();
+	host->messages.pop_front();
+
+	pthread_cond_broadcast(&host->cond);
+	pthread_mutex_unlock(&host->mutex);
+	return TRUE;
+}
+
+typedef struct HostThread {
+	pthread_t thread;
+	OSThreadEntryPointFn entry;
+	int argc;
+	const char **argv;
+	int result;
+	char name[16];
+} HostThread;
+
+static void *runThread(void *argument) {
+	HostThread *host = (HostThread *)argument;
+	pthread_setname_np(pthread_self(), host->name);
+	host->result = host->entry(host->argc, host->argv);
+	return NULL;
+}
+
+// Threads start suspended, as on the console
+BOOL OSCreateThread(OSThread *thread, OSThreadEntryPointFn entry, int32_t argc, char *argv,
+                    void *stack, uint32_t stackSize, int32_t priority, OSThreadAttributes attributes) {
+	HostThread *host = new HostThread();
+	host->entry  = entry;
+	host->argc   = argc;
+	host->argv   = (const char **)argv;
+	host->result = 0;
+	thread->host = host;
+	return TRUE;
+}
+
+int32_t OSResumeThread(OSThread *thread) {
+	HostThread *host = (HostThread *)thread->host;
+	return pthread_create(&host->thread, NULL, runThread, host) == 0;
+}
+
+BOOL OSJoinThread(OSThread *thread, int *result) {
+	HostThread *host = (HostThread *)thread->host;
+	pthread_join(host->thread, NULL);
+	if (result)
+		*result = host->result;
+	return TRUE;
+}
+
+void OSSetThreadName(OSThread *thread, const char *name) {
+	// Linux limits names to 15 characters
+	HostThread *host = (HostThread *)thread->host;
+	snprintf(host->name, sizeof(host->name), "%s", name);
+}
+
+void OSSleepTicks(OSTime ticks) {
+	struct timespec duration = { (time_t)(ticks / OS_TIMER_CLOCK), (long)(ticks % OS_TIMER_CLOCK * 1000000000 / OS_TIMER_CLOCK) };
+	nanosleep(&duration, NULL);
+}
+
+}
@@ -0,0 +1,84 @@
+# CafeLoader Package Builder
+# Packs Addr.bin, Code.bin, Data.bin and Patches.hax into a single .cafepkg,
+# see src/loader.h for the layout
+
+import os
+import struct
+import sys
+import zlib
+
+PACKAGE_MAGIC = b'CPKG'
+PACKAGE_VERSION = 1
+PACKAGE_ALIGN = 0x40
+
+SECTION_CODE = 1
+SECTION_DATA = 2
+SECTION_PATCHES = 3
+SECTION_CTORS = 4
+
+HEADER = struct.Struct('>4sHH8x')
+SECTION = struct.Struct('>IIIII12x')
+
+
+def align(offset):
+    return (offset + PACKAGE_ALIGN - 1) & ~(PACKAGE_ALIGN - 1)
+
+
+def readFile(folder, name, required=True):
+    path = os.path.join(folder, name)
+    if not os.path.isfile(path):
+        if required:
+            sys.exit('%s is missing' % path)
+        return None
+
+    with open(path, 'rb') as inf:
+        return inf.read()
+
+
+def pack(folder, withCtors):
+    addr = readFile(folder, 'Addr.bin')
+    if len(addr) < 8:
+        sys.exit('Addr.bin is too short')
+    codeAddr, dataAddr = struct.unpack_from('>II', addr)
+
+    # type, address, data
+    sections = [
+        (SECTION_CODE, codeAddr, readFile(folder, 'Code.bin')),
+        (SECTION_DATA, dataAddr, readFile(folder, 'Data.bin')),
+    ]
+
+    patches = readFile(folder, 'Patches.hax', False)
+    if patches is not None:
+        sections.append((SECTION_PATCHES, 0, patches))
+
+    if withCtors:
+        sections.append((SECTION_CTORS, 0, readFile(folder, 'Ctors.bin')))
+
+    offset = align(HEADER.size + SECTION.size * len(sections))
+    table = HEADER.pack(PACKAGE_MAGIC, PACKAGE_VERSION, len(sections))
+    body = b''
+
+    for kind, address, data in sections:
+        table += SECTION.pack(kind, offset, len(data), address, zlib.crc32(data))
+        body += data + b'\0' * (align(len(data)) - len(data))
+        offset += align(len(data))
+
+    return table + b'\0' * (align(len(table)) - len(table)) + body
+
+
+def main():
+    args = [arg for arg in sys.argv[1:] if not arg.startswith('--')]
+    if len(args) != 2:
+        print('Usage: cafepkg.py [--ctors] <TITLE_ID folder> <TITLE_ID.cafepkg>')
+        print('  --ctors  also pack Ctors.bin, the loader calls each address in it')
+        sys.exit(1)
+
+    package = pack(args[0], '--ctors' in sys.argv)
+    with open(args[1], 'wb') as out:
+        out.write(package)
+
+    print('Wrote %s (%d bytes)' % (args[1], len(package)))
+
+
+if __name__ == '__main__':
+    main()
@@ -2,170 +2,975 @@
 # Originally by Kinnay
 # with small edits by AboodXD
 
+import ctypes
+import ctypes.util
+import mmap
 import os
+import re
+import select
 import socketserver
 import struct
 import sys
+import threading
+import time
+import zlib
+from collections import OrderedDict
+
+try:
+    import lz4.block
+except ImportError:
+    lz4 = None
 
 titleID = b''
 
+# Files we serve, see buildIndex()
+index = {}
+
+VERBOSE = '--verbose' in sys.argv
+
+# Connected consoles, for the commands typed into the server's console
+handlers = set()
+
+PROTOCOL_VERSION = 2
+
+# Capabilities negotiated during the v2 handshake, see src/protocol.h
+CAP_MANIFEST = 1 << 0
+CAP_COMPRESSION = 1 << 1
+CAP_DELTA = 1 << 2
+CAP_INVALIDATE = 1 << 3
+CAP_RELOAD = 1 << 4
+CAP_SAVES = 1 << 5
+CAP_READ_AT = 1 << 6
+CAPABILITIES = CAP_MANIFEST | CAP_DELTA | CAP_RELOAD | CAP_SAVES | CAP_READ_AT
+if '--no-watch' not in sys.argv:
+    CAPABILITIES |= CAP_INVALIDATE
+if lz4 and '--no-compression' not in sys.argv:
+    CAPABILITIES |= CAP_COMPRESSION
+
+# Framed request/reply header: opcode, flags, reserved, request ID, payload length
+HEADER = struct.Struct('>BBxxII')
+FLAG_COMPRESSED = 1 << 0
+FLAG_REMOVED = 1 << 1
+
+OP_INVALIDATE = 14
+OP_RELOAD = 15
+
+# Sections of a .cafepkg, see cafepkg.py
+SECTION_CODE = 1
+SECTION_DATA = 2
+SECTION_PATCHES = 3
+PACKAGE_HEADER = struct.Struct('>4sHH8x')
+PACKAGE_SECTION = struct.Struct('>IIIII12x')
+
+# Unit in which live reloads compare and send code and data, see src/reload.cpp
+IMAGE_BLOCK_SIZE = 0x100
+
+# Compressed read replies are made of chunks of at most this size, see src/compression.h
+COMPRESSION_CHUNK_SIZE = 0x10000
+COMPRESSION_MIN_SIZE = 0x1000  # Smaller reads are not worth it
+COMPRESSION_MAX_MISSES = 4  # Reads of a file that did not compress before giving up on it
+
+# Uncompressed reads this large go straight from the file to the socket
+SENDFILE_MIN_SIZE = 0x10000
+
+# RAM kept for the compressed form of recently read blocks
+HOT_CACHE_SIZE = 32 * 1024 * 1024
+if '--cache-size' in sys.argv:
+    HOT_CACHE_SIZE = int(sys.argv[sys.argv.index('--cache-size') + 1]) * 1024 * 1024
+
+FNV_OFFSET_BASIS = 0xCBF29CE484222325
+FNV_PRIME = 0x100000001B3
+
+
+def hashPath(path):
+    # Must match hashPath() in src/manifest.cpp
+    h = FNV_OFFSET_BASIS
+    for c in path:
+        h = ((h ^ c) * FNV_PRIME) & 0xFFFFFFFFFFFFFFFF
+
+    return h or 1
+
+
+def log(*args):
+    # Per request messages, which slow the server down a lot when printed
+    if VERBOSE:
+        print(*args)
+
+
+def titleRoots(titleID):
+    # Local folders served to the title, with the game path each stands for
+    roots = [(os.path.join('vol', titleID.decode('ascii')), 'vol')]
+    if os.path.isdir('vol'):
+        for name in os.listdir('vol'):
+            if len(name) != 16 and name != 'save':  # Skip the other title IDs and the saves
+                roots.append((os.path.join('vol', name), 'vol/' + name))
+
+    return roots
+
+
+def indexKey(localPath):
+    return localPath.replace(os.sep, '/').encode('utf-8')
+
+
+def indexEntry(localPath, root, prefix):
+    # None if the file is gone
+    try:
+        st = os.stat(localPath)
+    except OSError:
+        return None
+
+    gamePath = prefix + '/' + os.path.relpath(localPath, root).replace(os.sep, '/')
+    return (gamePath.encode('utf-8'), st.st_size, int(st.st_mtime))
+
+
+def buildIndex(titleID):
+    # Every file the Wii U may open from us, keyed by the local path
+    # resolvePath() gives, with the path the game uses, size and mtime
+    files = {}
+    for root, prefix in titleRoots(titleID):
+        for dirpath, _, filenames in os.walk(root):
+            for filename in filenames:
+                localPath = os.path.join(dirpath, filename)
+                entry = indexEntry(localPath, root, prefix)
+                if entry:
+                    files[indexKey(localPath)] = entry
+
+    return files
+
+
+def buildManifest(files):
+    entries = [struct.pack('>QII', hashPath(gamePath), size & 0xFFFFFFFF, mtime & 0xFFFFFFFF)
+               for gamePath, size, mtime in files.values()]
+    return struct.pack('>I', len(entries)) + b''.join(entries)
+
+
+def loadBuild(path):
+    # The code, data and patches of a build to reload, from a .cafepkg or a
+    # folder laid out like the one on the SD card. Returns {type: (address, data)}.
+    if os.path.isdir(path):
+        import cafepkg
+        try:
+            package = cafepkg.pack(path, False)
+        except SystemExit as e:
+            print(e)
+            return None
+
+    else:
+        with open(path, 'rb') as f:
+            package = f.read()
+
+    magic, _, count = PACKAGE_HEADER.unpack_from(package)
+    if magic != b'CPKG':
+        print('%s is not a package' % path)
+        return None
+
+    sections = {}
+    for i in range(count):
+        kind, offset, size, address, _ = PACKAGE_SECTION.unpack_from(package, PACKAGE_HEADER.size + i * PACKAGE_SECTION.size)
+        if kind in (SECTION_CODE, SECTION_DATA, SECTION_PATCHES):
+            sections[kind] = (address, package[offset:offset + size])
+
+    return sections
+
+
+class HotCache:
+    # Compressed read replies by (path, mtime, offset, length), so blocks the
+    # game reads again are not compressed again. None is kept for data that
+    # did not compress. Uncompressed data is not kept, the page cache has it.
+    def __init__(self, limit):
+        self.limit = limit
+        self.size = 0
+        self.entries = OrderedDict()
+        self.lock = threading.Lock()
+
+    def get(self, key):
+        with self.lock:
+            if key not in self.entries:
+                return False, None
+
+            self.entries.move_to_end(key)
+            return True, self.entries[key]
+
+    def put(self, key, body):
+        size = len(body) if body is not None else 0
+        if size > self.limit:
+            return
+
+        with self.lock:
+            if key in self.entries:
+                return
+
+            self.entries[key] = body
+            self.size += size
+            while self.size > self.limit:
+                _, old = self.entries.popitem(last=False)
+                self.size -= len(old) if old is not None else 0
+
+
+hotCache = HotCache(HOT_CACHE_SIZE)
+
+
+class OpenFile:
+    # A file opened by the console. Reads are slices of a read only mapping,
+    # so serving them does not copy the data.
+    def __init__(self, path, file):
+        st = os.fstat(file.fileno())
+        self.path = path
+        self.file = file
+        self.size = st.st_size
+        self.mtime = st.st_mtime_ns
+        self.pos = 0
+        self.misses = 0  # Reads that did not compress
+        self.stale = False  # Changed on disk, see refresh()
+        self.map = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ) if self.size else None
+
+    def refresh(self):
+        # Maps the file again after it was changed in place, reading past
+        # the end of a file that was truncated would crash us
+        if not self.stale:
+            return
+
+        self.stale = False
+        if self.map:
+            self.map.close()
+
+        st = os.fstat(self.file.fileno())
+        self.size = st.st_size
+        self.mtime = st.st_mtime_ns
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ) if self.size else None
+
+    def view(self, offset, length):
+        if not self.map or offset >= self.size:
+            return memoryview(b'')
+
+        return memoryview(self.map)[offset:offset + length]
+
+    def write(self, data):
+        # Game files are only ever served read only
+        return False
+
+    def close(self):
+        if self.map:
+            self.map.close()
+        self.file.close()
+        return True
+
+
+class SaveFile:
+    # A save the console opened with SAVEOpenFile. It is written to, so it
+    # is read through the file instead of a mapping, and kept out of the
+    # hot cache.
+    def __init__(self, path, file):
+        self.path = path
+        self.file = file
+        self.mtime = 0
+        self.pos = 0
+        self.misses = COMPRESSION_MAX_MISSES
+        self.failed = False
+
+    @property
+    def size(self):
+        return os.fstat(self.file.fileno()).st_size
+
+    def refresh(self):
+        pass
+
+    def view(self, offset, length):
+        self.file.seek(offset)
+        return memoryview(self.file.read(length))
+
+    def write(self, data):
+        try:
+            self.file.seek(self.pos)
+            self.file.write(data)
+            self.pos += len(data)
+        except OSError:
+            self.failed = True
+        return not self.failed
+
+    def close(self):
+        # The console waits for this before its FSCloseFile returns
+        try:
+            os.fsync(self.file.fileno())
+        except OSError:
+            self.failed = True
+        self.file.close()
+        return not self.failed
+
+
+def compressChunks(data):
+    # Returns the chunked body of a compressed read reply, or None if the
+    # data does not compress
+    chunks = []
+    for offset in range(0, len(data), COMPRESSION_CHUNK_SIZE):
+        raw = data[offset:offset + COMPRESSION_CHUNK_SIZE]
+        packed = lz4.block.compress(raw, store_size=False)
+        if len(packed) >= len(raw):
+            if offset == 0:
+                return None  # Already compressed, don't waste time on the rest
+
+            packed = raw  # Stored as is
+
+        chunks.append(struct.pack('>II', len(raw), len(packed)))
+        chunks.append(packed)
+
+    body = b''.join(chunks)
+    return body if len(body) < len(data) else None
+
+
+DELTA_LITERAL = 0xFFFFFFFF
+
+# Seconds spent rolling checksums for shifted data per delta. The console
+# waits for the reply with a 10 s receive timeout, past this only blocks at
+# their old offsets are matched.
+DELTA_SEARCH_TIME = 4
+
+
+def deltaRuns(data, blockSize, blocks):
+    # blocks maps the adler32 of each block of the console's copy to a list of
+    # (crc32, index). Returns the runs making up data: (index, length) to copy
+    # from the old copy, or (DELTA_LITERAL, length) for bytes to send.
+    runs = []
+    deadline = time.monotonic() + DELTA_SEARCH_TIME
+
+    def add(block, length):
+        if runs:
+            last, lastLength = runs[-1]
+            if block == last == DELTA_LITERAL or (DELTA_LITERAL not in (block, last) and
+                                                  last * blockSize + lastLength == block * blockSize):
+                runs[-1] = (last, lastLength + length)
+                return
+
+        runs.append((block, length))
+
+    def lookup(weak, start):
+        for strong, index in blocks.get(weak, ()):
+            if zlib.crc32(data[start:start + blockSize]) == strong:
+                return index
+
+    def search(pos):
+        # Rolls the weak checksum over the next block's worth of offsets to
+        # find data that was shifted by an insertion or deletion
+        a = zlib.adler32(data[pos:pos + blockSize])
+        low, high = a & 0xFFFF, a >> 16
+        for start in range(pos + 1, min(pos + blockSize, len(data) - blockSize + 1)):
+            out, new = data[start - 1], data[start + blockSize - 1]
+            low = (low - out + new) % 65521
+            high = (high - blockSize * out + low - 1) % 65521
+            weak = (high << 16) | low
+            if weak in blocks:
+                index = lookup(weak, start)
+                if index is not None:
+                    return start, index
+
+        return None, None
+
+    pos = 0
+    misses = 0
+    while pos + blockSize <= len(data):
+        index = lookup(zlib.adler32(data[pos:pos + blockSize]), pos)
+        if index is None:
+            # Rolling in Python is slow, so only the start of a changed region
+            # is searched thoroughly, after that it is just sampled
+            if (misses < 2 or misses % 16 == 0) and time.monotonic() < deadline:
+                start, index = search(pos)
+                if index is not None:
+                    add(DELTA_LITERAL, start - pos)
+                    pos = start
+
+            misses += 1
+
+        if index is None:
+            add(DELTA_LITERAL, blockSize)
+        else:
+            add(index, blockSize)
+            misses = 0
+
+        pos += blockSize
+
+    if pos < len(data):
+        add(DELTA_LITERAL, len(data) - pos)
+
+    return runs
+
+
+# inotify(7)
+IN_ATTRIB = 0x4
+IN_CLOSE_WRITE = 0x8
+IN_MOVED_FROM = 0x40
+IN_MOVED_TO = 0x80
+IN_CREATE = 0x100
+IN_DELETE = 0x200
+IN_Q_OVERFLOW = 0x4000
+IN_ISDIR = 0x40000000
+IN_CLOEXEC = 0o2000000
+IN_WATCH_MASK = IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE
+INOTIFY_EVENT = struct.Struct('iIII')
+
+WATCH_DELAY = 0.2  # Editors save in several steps, wait for them to settle
+POLL_INTERVAL = 1.0  # Without inotify
+
+
+def loadInotify():
+    try:
+        libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+        libc.inotify_init1, libc.inotify_add_watch
+        return libc
+
+    except (AttributeError, OSError, TypeError):
+        return None
+
+
+class Watcher:
+    # Keeps the index up to date with the served folders and calls
+    # notify(changed, removed) with the index entries of the files that
+    # changed or were deleted, by key. Uses inotify where there is one,
+    # polling elsewhere.
+    def __init__(self, titleID, notify):
+        self.roots = titleRoots(titleID)
+        self.notify = notify
+        self.running = True
+        self.libc = loadInotify()
+        self.fd = -1
+        self.dirs = {}  # Watch descriptor to (folder, root, prefix)
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.running = False
+
+    def run(self):
+        if self.libc:
+            self.fd = self.libc.inotify_init1(IN_CLOEXEC)
+
+        try:
+            if self.fd >= 0:
+                self.watchInotify()
+            else:
+                self.poll()
+
+        finally:
+            if self.fd >= 0:
+                os.close(self.fd)
+
+    def rootOf(self, localPath):
+        for root, prefix in self.roots:
+            if localPath == root or localPath.startswith(root + os.sep):
+                return root, prefix
+
+    def watchTree(self, top, pending):
+        # Watches every folder under top and marks the files in it
+        root, prefix = self.rootOf(top)
+        for dirpath, _, filenames in os.walk(top):
+            wd = self.libc.inotify_add_watch(self.fd, dirpath.encode('utf-8'), IN_WATCH_MASK)
+            if wd >= 0:
+                self.dirs[wd] = (dirpath, root, prefix)
+
+            for filename in filenames:
+                pending.add(os.path.join(dirpath, filename))
+
+    def watchInotify(self):
+        for root, _ in self.roots:
+            self.watchTree(root, set())  # Already in the index
+
+        pending = set()
+        while self.running:
+            ready, _, _ = select.select([self.fd], [], [], WATCH_DELAY if pending else 1.0)
+            if not ready:
+                if pending:
+                    self.update(pending)
+                    pending = set()
+                continue
+
+            data = os.read(self.fd, 0x10000)
+            offset = 0
+            while offset < len(data):
+                wd, mask, _, length = INOTIFY_EVENT.unpack_from(data, offset)
+                name = data[offset + INOTIFY_EVENT.size:offset + INOTIFY_EVENT.size + length].rstrip(b'\0')
+                offset += INOTIFY_EVENT.size + length
+
+                if mask & IN_Q_OVERFLOW:
+                    pending.update(self.scan())
+                    continue
+
+                if wd not in self.dirs or not name:
+                    continue
+
+                localPath = os.path.join(self.dirs[wd][0], name.decode('utf-8', 'replace'))
+                if not mask & IN_ISDIR:
+                    pending.add(localPath)
+
+                elif mask & (IN_CREATE | IN_MOVED_TO):
+                    self.watchTree(localPath, pending)
+
+                elif mask & (IN_DELETE | IN_MOVED_FROM):
+                    key = indexKey(localPath + os.sep)
+                    pending.update(path.decode('utf-8') for path in list(index) if path.startswith(key))
+
+    def scan(self):
+        # Every file that is or was in the served folders
+        found = {path.decode('utf-8') for path in index}
+        for root, _ in self.roots:
+            for dirpath, _, filenames in os.walk(root):
+                found.update(os.path.join(dirpath, filename) for filename in filenames)
+
+        return found
+
+    def poll(self):
+        while self.running:
+            time.sleep(POLL_INTERVAL)
+            self.update(self.scan())
+
+    def update(self, localPaths):
+        changed, removed = {}, {}
+        for localPath in localPaths:
+            key = indexKey(localPath)
+            roots = self.rootOf(localPath)
+            entry = indexEntry(localPath, *roots) if roots and os.path.isfile(localPath) else None
+            if entry is None:
+                if key in index:
+                    removed[key] = index.pop(key)
+
+            elif index.get(key) != entry:
+                index[key] = entry
+                changed[key] = entry
+
+        if changed or removed:
+            self.notify(changed, removed)
+
 
 class TCPHandler(socketserver.BaseRequestHandler):
     def setup(self):
         print('Connection')
+        handlers.add(self)
+        self.sendLock = threading.Lock()
         self.files = {}
         self.fhandle = 0x12345678
+        self.version = 1
+        self.capabilities = 0
+        self.watcher = None
+        self.build = {}  # Being reloaded, see startReload()
 
     def handle(self):
+        self.commands = {
+            1: self.hello,
+            2: self.openFile,
+            3: self.readFile,
+            4: self.writeFile,
+            5: self.closeFile,
+            6: self.openSave,
+            7: self.debugMessage,
+            8: self.getStatFile,
+            9: self.setPosFile,
+            10: self.crashReport,
+            11: self.debugFile,
+            12: self.fileCheck,
+            13: self.delta,
+            15: self.reload,
+            16: self.readFileAt,
+        }
+
         while True:
             try:
-                rawcmd = self.request.recv(1)
+                if self.version >= 2:
+                    header = self.recvall(HEADER.size)
+                    if len(header) < HEADER.size:
+                        return
+
+                    cmd, _, self.requestID, length = HEADER.unpack(header)
+                    self.payload = memoryview(self.recvall(length))
+
+                else:
+                    rawcmd = self.request.recv(1)
+                    if not rawcmd:
+                        return
+
+                    cmd = ord(rawcmd)
+                    self.requestID = 0  # v1 has no IDs, and none of its closes are acknowledged
 
             except:
                 return
-	    
-            if not rawcmd:
-                return
-            
-            cmd = ord(rawcmd)
-            if cmd == 1:
-                global titleID
-                titleID = self.request.recv(639)[:16]
-
-                print('Connected to Wii U!. Title ID: %s' % titleID)
-                self.request.sendall(struct.pack('>H', 0xCAFE))  # OK
-                
-            elif cmd == 2:  # Open file
-                length = struct.unpack('>I', self.request.recv(4))[0]
-                path = self.request.recv(length).lstrip(b'/')
-
-                if path[:4] != b'vol/':
-                    path = b''.join([b'vol/content/', path])
-
-                if path[:12] == b'vol/content/':
-                    if not titleID:
-                        self.request.sendall(struct.pack('>H', 0))
-
-                    path = b''.join([b'vol/', titleID, path[3:]])
-
-                print('FSOpenFile(%s)' %path)
-                self.files[self.fhandle] = open(path, 'rb')
-                self.request.sendall(struct.pack('>I', self.fhandle))
-                self.fhandle += 1
-
-            elif cmd == 3:  # Read file
-                print(' - Read')
-                handle = struct.unpack('>I', self.request.recv(4))[0]
-                size = struct.unpack('>I', self.request.recv(4))[0]
-                count = struct.unpack('>I', self.request.recv(4))[0]
-
-                data = self.files[handle].read(size * count)
-                self.request.sendall(struct.pack('>I', len(data) // size))
-                self.request.sendall(struct.pack('>I', len(data)))
-                self.request.sendall(data)
-
-            elif cmd == 4:  # Write file
-                print(' - Write')
-                handle = struct.unpack('>I', self.request.recv(4))[0]
-                length = struct.unpack('>I', self.request.recv(4))[0]
-
-                data = self.recvall(length)
-                self.files[handle].write(data)
-
-            elif cmd == 5:  # Close file
-                print(' - Close')
-                handle = struct.unpack('>I', self.request.recv(4))[0]
-                self.files.pop(handle).close()
-
-            elif cmd == 6:  # Save open file
-                """
-                length = struct.unpack('>I', self.request.recv(4))[0]
-                path = self.request.recv(length)
-                mode = chr(self.request.recv(1)[0])
-                print('SAVEOpenFile(%s, %s)' %(path, mode))
-                savepath = b'vol/save/' + path
-                if os.path.isfile(savepath) or mode == 'w':
-                    self.files[self.fhandle] = open(savepath, mode+'b')
-                    self.request.sendall(struct.pack('>I', self.fhandle))
-                    self.fhandle += 1
-                else:
-                    self.request.sendall(b'\x00\x00\x00\x00')
-                """
-                pass  # TODO
-
-            elif cmd == 7:  # Debug message
-                """
-                length = struct.unpack('>I', self.request.recv(4))[0]
-                message = self.request.recv(length)
-                print('DEBUG:', message)
-                """
-                pass  # do not use this
-
-            elif cmd == 8:  # Get stat file
-                print(' - GetStatFile')
-                handle = struct.unpack('>I', self.request.recv(4))[0]
-                file = self.files[handle]
-                pos = file.tell()
-                file.seek(0, 2)
-                size = file.tell()
-                file.seek(pos)
-                self.request.sendall(struct.pack('>I', size))
-
-            elif cmd == 9:  # Set pos file
-                handle = struct.unpack('>I', self.request.recv(4))[0]
-                pos = struct.unpack('>I', self.request.recv(4))[0]
-                print(' - SetPosFile(%i)' %pos)
-                self.files[handle].seek(pos)
-
-            elif cmd == 10: # Crash report (never actually used by CafeLoader)
-                length = struct.unpack('>I', self.request.recv(4))[0]
-                report = self.request.recv(length).decode('ascii', 'ignore')
-                print(report)
-
-                length = struct.unpack('>I', self.request.recv(4))[0]
-                stackTrace = struct.unpack('>' + 'I' * length, self.request.recv(length * 4))
-                print('Stack trace:')
-                for address in stackTrace:
-                    print('\t' + hex(address))
-
-            elif cmd == 11:  # Debug file
-                fnlength, length = struct.unpack('>II', self.request.recv(8))
-                filename = self.request.recv(fnlength).decode('ascii')
-                data = self.recvall(length)
-
-                if not os.path.isdir('DebugFiles'):
-                    os.mkdir('DebugFiles')
-
-                with open('DebugFiles/' + filename, 'wb') as f:
-                    f.write(data)
-            
-            elif cmd == 12:  # File check
-                length = struct.unpack('>I', self.request.recv(4))[0]
-                path = self.request.recv(length).lstrip(b'/')
-
-                if path[:4] != b'vol/':
-                    path = b''.join([b'vol/content/', path])  # Fix for NSMBU
-
-                if path[:12] == b'vol/content/':
-                    if not titleID:
-                        self.request.sendall(struct.pack('>H', 0))
-
-                    path = b''.join([b'vol/', titleID, path[3:]])
-
-                #print("Search for path: %s" % path)
-                if os.path.isfile(path):
-                    self.request.sendall(struct.pack('>H', 0xCAFE))  # OK
 
-                else:
-                    self.request.sendall(struct.pack('>H', 0))
-                    
+            self.cmd = cmd
+            if cmd in self.commands:
+                self.commands[cmd]()
+
             else:
                 print('Invalid command: %i' %cmd)
 
+    def read(self, length):
+        # Arguments of framed requests come from the payload, v1 reads them off the socket
+        if self.version >= 2:
+            data, self.payload = self.payload[:length].tobytes(), self.payload[length:]
+            return data
+
+        return self.recvall(length)
+
+    def unpack(self, fmt):
+        return struct.unpack(fmt, self.read(struct.calcsize(fmt)))
+
+    def sendParts(self, parts):
+        # Gathers the parts into one send without joining them first
+        if not hasattr(self.request, 'sendmsg'):  # Windows
+            self.request.sendall(b''.join(parts))
+            return
+
+        parts = [part for part in parts if len(part)]
+        while parts:
+            sent = self.request.sendmsg(parts)
+            while parts and sent >= len(parts[0]):
+                sent -= len(parts[0])
+                parts.pop(0)
+
+            if sent:
+                parts[0] = memoryview(parts[0])[sent:]
+
+    def reply(self, *parts, flags=0):
+        # Framed replies carry the request ID and are written with one call
+        with self.sendLock:
+            if self.version >= 2:
+                length = sum(len(part) for part in parts)
+                self.sendParts([HEADER.pack(self.cmd, flags, self.requestID, length), *parts])
+
+            else:
+                self.sendParts(parts)
+
+    def replyFile(self, head, file, offset, length):
+        # Like reply(head, data), with the data sent by the kernel from the file
+        with self.sendLock:
+            if self.version >= 2:
+                self.sendParts([HEADER.pack(self.cmd, 0, self.requestID, len(head) + length), head])
+
+            else:
+                self.sendParts([head])
+
+            self.request.sendfile(file.file, offset, length)
+
+    def requestStats(self):
+        # An unsolicited debug file message asks the console for its statistics,
+        # which come back as a debug file. v1 consoles only send them on exit.
+        if self.version < 2:
+            return False
+
+        with self.sendLock:
+            self.request.sendall(HEADER.pack(11, 0, 0, 0))
+        return True
+
+    def invalidate(self, changed, removed):
+        # Called by the watcher. Files the console has open are only mapped
+        # again, it keeps reading them, the next open gets the new version.
+        for file in list(self.files.values()):
+            if file.path in changed or file.path in removed:
+                file.stale = True
+
+        for path in changed:
+            log('Changed: %s' % path)
+        for path in removed:
+            log('Removed: %s' % path)
+        print('%i files changed, %i removed' % (len(changed), len(removed)))
+
+        if not self.capabilities & CAP_INVALIDATE:
+            return
+
+        for files, flags in ((changed, 0), (removed, FLAG_REMOVED)):
+            if not files:
+                continue
+
+            entries = [struct.pack('>QII', hashPath(gamePath), size & 0xFFFFFFFF, mtime & 0xFFFFFFFF)
+                       for gamePath, size, mtime in files.values()]
+            payload = struct.pack('>I', len(entries)) + b''.join(entries)
+            with self.sendLock:
+                self.sendParts([HEADER.pack(OP_INVALIDATE, flags, 0, len(payload)), payload])
+
+    def startReload(self, build):
+        # Offers a new build to the console, which then fetches the blocks
+        # that differ from what it runs, see src/reload.cpp
+        if not self.capabilities & CAP_RELOAD:
+            return False
+
+        self.build = build
+        table = [struct.pack('>IIII', kind, address, len(data), zlib.crc32(data))
+                 for kind, (address, data) in sorted(build.items())]
+        payload = struct.pack('>I', len(table)) + b''.join(table)
+        with self.sendLock:
+            self.sendParts([HEADER.pack(OP_RELOAD, 0, 0, len(payload)), payload])
+        return True
+
+    def reload(self):
+        if self.requestID == 0:  # How it went
+            ok, written = self.unpack('>II')
+            if ok:
+                print('Reload applied, %i bytes written' % written)
+            else:
+                print('Reload failed, relaunch the title')
+            self.build = {}
+            return
+
+        kind, first, count = self.unpack('>III')
+        address, data = self.build.get(kind, (0, b''))
+
+        if kind == SECTION_PATCHES:
+            self.reply(struct.pack('>I', len(data)), data)
+            return
+
+        crcs = self.unpack('>%iI' % count)
+        indices, blocks = [], []
+        for index in range(first, first + count):
+            block = data[index * IMAGE_BLOCK_SIZE:(index + 1) * IMAGE_BLOCK_SIZE]
+            if block and zlib.crc32(block) != crcs[index - first]:
+                indices.append(index)
+                blocks.append(block.ljust(IMAGE_BLOCK_SIZE, b'\0'))
+
+        log(' - Reload: %i of %i blocks of section %i changed' % (len(indices), count, kind))
+        head = struct.pack('>I', len(indices))
+        body = struct.pack('>%iI' % len(indices), *indices) + b''.join(blocks)
+        if self.capabilities & CAP_COMPRESSION and len(body) >= COMPRESSION_MIN_SIZE:
+            compressed = compressChunks(body)
+            if compressed is not None:
+                self.reply(head, compressed, flags=FLAG_COMPRESSED)
+                return
+
+        self.reply(head, body)
+
+    def resolvePath(self, path):
+        path = path.lstrip(b'/')
+
+        if path[:4] != b'vol/':
+            path = b''.join([b'vol/content/', path])  # Fix for NSMBU
+
+        if path[:12] == b'vol/content/':
+            path = b''.join([b'vol/', titleID, path[3:]])
+
+        return path
+
+    def hello(self):
+        global titleID, index
+        titleID = self.recvall(16)
+        magic = self.recvall(4)
+        index = buildIndex(titleID)
+        if '--no-watch' not in sys.argv:
+            self.watcher = Watcher(titleID, self.invalidate)
+
+        if magic == b'CLv2':
+            version, _, capabilities = struct.unpack('>HHI', self.recvall(8))
+            self.version = min(version, PROTOCOL_VERSION)
+            self.capabilities = capabilities & CAPABILITIES
+
+            print('Connected to Wii U!. Title ID: %s (protocol v%i)' % (titleID, self.version))
+            response = [struct.pack('>HHI', 0xCAF2, self.version, self.capabilities)]
+            if self.capabilities & CAP_MANIFEST:
+                manifest = buildManifest(index)
+                print('Sending manifest (%i files)' % (len(manifest) // 16))
+                response.append(manifest)
+
+            with self.sendLock:
+                self.request.sendall(b''.join(response))
+            return
+
+        # v1 sends the title ID padded to 639 bytes
+        hello = titleID + magic + self.recvall(639 - 20)
+
+        print('Connected to Wii U!. Title ID: %s' % titleID)
+        if hello[32:36] == b'MNFT':
+            manifest = buildManifest(index)
+            print('Sending manifest (%i files)' % (len(manifest) // 16))
+            self.request.sendall(struct.pack('>H', 0xCAF1) + manifest)  # OK, manifest follows
+
+        else:
+            self.request.sendall(struct.pack('>H', 0xCAFE))  # OK
+
+    def openFile(self):
+        length = self.unpack('>I')[0]
+        path = self.resolvePath(self.read(length))
+
+        log('FSOpenFile(%s)' %path)
+        try:
+            self.files[self.fhandle] = OpenFile(path, open(path, 'rb'))
+
+        except OSError:
+            self.reply(struct.pack('>I', 0))
+            return
+
+        self.reply(struct.pack('>I', self.fhandle))
+        self.fhandle += 1
+
+    def readFile(self):
+        log(' - Read')
+        handle, size, count = self.unpack('>III')
+
+        file = self.files[handle]
+        file.refresh()
+        file.pos += self.sendRead(file, file.pos, size, count)
+
+    def readFileAt(self):
+        handle, size, count, offset = self.unpack('>IIII')
+        log(' - ReadAt(%i)' %offset)
+
+        # Leaves the position of the file alone, the console keeps its own
+        file = self.files[handle]
+        file.refresh()
+        self.sendRead(file, offset, size, count)
+
+    def sendRead(self, file, offset, size, count):
+        length = max(0, min(size * count, file.size - offset))
+        head = struct.pack('>II', length // size if size else 0, length)
+
+        if (self.capabilities & CAP_COMPRESSION and length >= COMPRESSION_MIN_SIZE and
+                file.misses < COMPRESSION_MAX_MISSES):
+            key = (file.path, file.mtime, offset, length)
+            cached, body = hotCache.get(key)
+            if not cached:
+                body = compressChunks(file.view(offset, length))
+                hotCache.put(key, body)
+
+            if body is not None:
+                self.reply(head, body, flags=FLAG_COMPRESSED)
+                return length
+
+            file.misses += 1
+
+        if length >= SENDFILE_MIN_SIZE:
+            self.replyFile(head, file, offset, length)
+
+        else:
+            self.reply(head, file.view(offset, length))
+
+        return length
+
+    def writeFile(self):
+        log(' - Write')
+        handle, length = self.unpack('>II')
+
+        data = self.read(length)
+        if not self.files[handle].write(data):
+            print('Could not write to %s' % self.files[handle].path)
+
+    def closeFile(self):
+        log(' - Close')
+        handle = self.unpack('>I')[0]
+        ok = self.files.pop(handle).close()
+
+        # Closes of written files are requests, the console waits until the data is on disk
+        if self.requestID:
+            self.reply(struct.pack('>I', int(ok)))
+
+    def openSave(self):
+        account, length = self.unpack('>II')
+        path = self.read(length).decode('utf-8', 'replace')
+        mode = self.read(8).rstrip(b'\0').decode('ascii', 'replace').replace('b', '')
+
+        # Laid out like the console's save folder, 0xFF is the common save
+        folder = 'common' if account == 0xFF else '%08x' % (0x80000000 | account)
+        savePath = os.path.join('vol', 'save', titleID.decode('ascii'), 'user', folder, path.lstrip('/'))
+        log('SAVEOpenFile(%s, %s)' % (savePath, mode))
+
+        if not mode or (mode[0] == 'r' and not os.path.isfile(savePath)):
+            self.reply(struct.pack('>I', 0))  # The console opens its own save
+            return
+
+        try:
+            if mode[0] != 'r':
+                os.makedirs(os.path.dirname(savePath), exist_ok=True)
+            self.files[self.fhandle] = SaveFile(savePath, open(savePath, mode + 'b', buffering=0))
+
+        except (OSError, ValueError):
+            self.reply(struct.pack('>I', 0))
+            return
+
+        print('Redirected save %s' % savePath)
+        self.reply(struct.pack('>I', self.fhandle))
+        self.fhandle += 1
+
+    def debugMessage(self):
+        """
+        length = struct.unpack('>I', self.request.recv(4))[0]
+        message = self.request.recv(length)
+        print('DEBUG:', message)
+        """
+        pass  # do not use this
+
+    def getStatFile(self):
+        log(' - GetStatFile')
+        handle = self.unpack('>I')[0]
+        file = self.files[handle]
+        file.refresh()
+        self.reply(struct.pack('>I', file.size))
+
+    def setPosFile(self):
+        handle, pos = self.unpack('>II')
+        log(' - SetPosFile(%i)' %pos)
+        self.files[handle].pos = pos
+
+    def crashReport(self):
+        length = self.unpack('>I')[0]
+        report = self.read(length).decode('ascii', 'ignore')
+
+        # The last file system calls name files by the hash of their path
+        paths = {'%016X' % hashPath(gamePath): gamePath.decode('utf-8') for gamePath, _, _ in list(index.values())}
+        report = re.sub(r'\b[0-9A-F]{16}\b', lambda m: paths.get(m.group(0), m.group(0)), report)
+
+        length = self.unpack('>I')[0]
+        stackTrace = self.unpack('>' + 'I' * length)
+        report += '\nStack trace:\n' + ''.join('\t%08X\n' % address for address in stackTrace)
+        print(report)
+
+        if not os.path.isdir('DebugFiles'):
+            os.mkdir('DebugFiles')
+
+        filename = 'DebugFiles/%s-crash.txt' % titleID.decode('ascii')
+        with open(filename, 'w') as f:
+            f.write(report)
+
+        print('Saved %s' % filename)
+
+    def debugFile(self):
+        fnlength, length = self.unpack('>II')
+        filename = self.read(fnlength).decode('ascii')
+        data = self.read(length)
+
+        if not os.path.isdir('DebugFiles'):
+            os.mkdir('DebugFiles')
+
+        with open('DebugFiles/' + filename, 'wb') as f:
+            f.write(data)
+
+        print('Saved DebugFiles/%s' % filename)
+
+    def fileCheck(self):
+        length = self.unpack('>I')[0]
+        path = self.resolvePath(self.read(length))
+
+        log('Search for path: %s' % path)
+        if path in index:
+            self.reply(struct.pack('>H', 0xCAFE))  # OK
+
+        else:
+            self.reply(struct.pack('>H', 0))
+
+    def delta(self):
+        handle, blockSize, count = self.unpack('>III')
+        checksums = self.read(count * 8)
+
+        blocks = {}
+        for index, (weak, strong) in enumerate(struct.iter_unpack('>II', checksums)):
+            blocks.setdefault(weak, []).append((strong, index))
+
+        file = self.files[handle]
+        file.refresh()
+        data = file.map if file.map else b''
+
+        runs = deltaRuns(data, blockSize, blocks)
+        literal = sum(length for block, length in runs if block == DELTA_LITERAL)
+        log(' - Delta: sending %i of %i bytes' % (literal, len(data)))
+        self.reply(struct.pack('>I', len(runs)), b''.join(struct.pack('>II', *run) for run in runs))
+
     def recvall(self, length):
         data = self.request.recv(length)
         while len(data) < length:
-            data += self.request.recv(length - len(data))
+            chunk = self.request.recv(length - len(data))
+            if not chunk:
+                break
+            data += chunk
 
         return data
 
@@ -179,6 +984,11 @@ class TCPHandler(socketserver.BaseRequestHandler):
 
     def finish(self):
         print('Finish')
+        handlers.discard(self)
+        if self.watcher:
+            self.watcher.stop()
+        for file in self.files.values():
+            file.close()
         global titleID
         titleID = b''
 
@@ -200,11 +1010,42 @@ def generateIPBin(ip):
 
 # ip stores local IP of the computer that has the 
 # files by which the game's files should be patched.
-ip = input('Enter your PC\'s local IP (e.g. 192.168.1.1): ')
+if '--ip' in sys.argv:
+    ip = sys.argv[sys.argv.index('--ip') + 1]
+else:
+    ip = input('Enter your PC\'s local IP (e.g. 192.168.1.1): ')
 if '--bin' in sys.argv:
     generateIPBin(ip)
 
+def readCommands():
+    while True:
+        try:
+            command = input().strip()
+        except EOFError:
+            return
+
+        if command == 'stats':
+            requested = [handler for handler in list(handlers) if handler.requestStats()]
+            print('Requested statistics from %i console(s)' % len(requested))
+
+        elif command.startswith('reload'):
+            path = command[6:].strip() or titleID.decode('ascii')
+            if not path or not os.path.exists(path):
+                print('Nothing to reload at "%s"' % path)
+                continue
+
+            build = loadBuild(path)
+            if build:
+                started = [handler for handler in list(handlers) if handler.startReload(build)]
+                print('Reloading %s on %i console(s)' % (path, len(started)))
+
+        elif command:
+            print('Commands: stats, reload [folder or .cafepkg]')
+
+
 server = TCPServer((ip, 2557), TCPHandler)
 print('Server has been started')
 print('Listening at (%s, 2557)' %ip)
+print('Type "stats" to fetch statistics from the console, "reload [folder or .cafepkg]" to load new code into it')
+threading.Thread(target=readCommands, daemon=True).start()
 server.serve_forever()
@@ -0,0 +1,134 @@
+#include <malloc.h>
+#include <string.h>
+
+#include <coreinit/mutex.h>
+#include <utils/logger.h>
+
+#include "bufferpool.h"
+#include "globals.h"
+#include "prefetch.h"
+#include "writebehind.h"
+
+// All of CafeLoader's large buffers come from here. Every class is taken
+// from the heap in one piece when the plugin is loaded and kept for good,
+// so opening and closing files while the game runs never touches the heap
+// and how much memory CafeLoader uses does not depend on the game.
+
+// Loader chunks are never smaller than this, whatever loaderMemoryLimit says
+#define LOADER_MIN_CHUNK 0x1000
+
+// Code.bin and Data.bin are streamed through two chunks, see streamImage()
+#define LOADER_CHUNKS 2
+
+#define SLAB_ALIGNMENT 0x40
+
+typedef struct Pool {
+	char *base;
+	uint16_t *freeSlabs; // Stack of the indices of free slabs
+	uint32_t freeCount;
+} Pool;
+
+PoolStats poolStats[POOL_CLASS_COUNT];
+
+static Pool pools[POOL_CLASS_COUNT];
+static OSMutex mutex;
+
+static void reservePool(PoolClass pool, uint32_t slabSize, uint32_t slabs) {
+	PoolStats *stats = &poolStats[pool];
+	memset(stats, 0, sizeof(PoolStats));
+
+	// Keeps the slabs of a class aligned, and their indices in a u16
+	slabSize = (slabSize + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1);
+	if (slabs > 0xFFFF)
+		slabs = 0xFFFF;
+	stats->slabSize = slabSize;
+
+	if (!slabs)
+		return;
+
+	pools[pool].base      = (char *)memalign(SLAB_ALIGNMENT, slabSize * slabs);
+	pools[pool].freeSlabs = (uint16_t *)malloc(slabs * sizeof(uint16_t));
+	if (!pools[pool].base || !pools[pool].freeSlabs) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to reserve %u slabs of %u bytes", slabs, slabSize);
+		free(pools[pool].base);
+		free(pools[pool].freeSlabs);
+		pools[pool].base = NULL;
+		pools[pool].freeSlabs = NULL;
+		return;
+	}
+
+	// Lowest first, so a class that is barely used stays in a few pages
+	for (uint32_t i = 0; i < slabs; i++)
+		pools[pool].freeSlabs[i] = slabs - 1 - i;
+	pools[pool].freeCount = slabs;
+	stats->slabs = slabs;
+}
+
+// Sizes the classes from the settings, which are loaded by then
+void initBufferPool() {
+	OSInitMutex(&mutex);
+
+	uint32_t chunkSize = (loaderMemoryLimit / LOADER_CHUNKS) & ~(SLAB_ALIGNMENT - 1);
+	if (chunkSize < LOADER_MIN_CHUNK)
+		chunkSize = LOADER_MIN_CHUNK;
+
+	reservePool(POOL_LOADER, chunkSize, LOADER_CHUNKS);
+	reservePool(POOL_READ_AHEAD, readAheadBlockSize, readAheadBudget / readAheadBlockSize);
+	reservePool(POOL_WRITE_BEHIND, WRITE_BEHIND_SIZE, WRITE_BEHIND_BUDGET / WRITE_BEHIND_SIZE);
+	reservePool(POOL_PREFETCH, PREFETCH_RANGE_MAX, prefetchBudget / PREFETCH_RANGE_MAX);
+}
+
+// Returns NULL once every slab of the class is taken
+void *allocPoolSlab(PoolClass pool) {
+	PoolStats *stats = &poolStats[pool];
+	void *slab = NULL;
+
+	OSLockMutex(&mutex);
+	if (pools[pool].freeCount) {
+		uint16_t index = pools[pool].freeSlabs[--pools[pool].freeCount];
+		slab = pools[pool].base + index * stats->slabSize;
+
+		if (++stats->used > stats->highWater)
+			stats->highWater = stats->used;
+	} else {
+		stats->failures++;
+	}
+	OSUnlockMutex(&mutex);
+
+	return slab;
+}
+
+// For buffers whose size depends on a file. Those that fit are given a
+// slab, others (and any when all are taken) come from the heap after all.
+void *allocPoolBuffer(PoolClass pool, uint32_t size) {
+	if (size <= poolStats[pool].slabSize) {
+		void *slab = allocPoolSlab(pool);
+		if (slab)
+			return slab;
+	}
+
+	__atomic_fetch_add(&poolStats[pool].overflows, 1, __ATOMIC_RELAXED);
+	return memalign(SLAB_ALIGNMENT, size ? size : 1);
+}
+
+// Takes slabs of any class and buffers allocPoolBuffer() got from the heap
+void freePoolBuffer(void *buffer) {
+	if (!buffer)
+		return;
+
+	for (uint32_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		Pool *pool = &pools[i];
+		PoolStats *stats = &poolStats[i];
+		char *slab = (char *)buffer;
+		if (!pool->base || slab < pool->base || slab >= pool->base + stats->slabs * stats->slabSize)
+			continue;
+
+		OSLockMutex(&mutex);
+		pool->freeSlabs[pool->freeCount++] = (slab - pool->base) / stats->slabSize;
+		stats->used--;
+		OSUnlockMutex(&mutex);
+		return;
+	}
+
+	free(buffer);
+}
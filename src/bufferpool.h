@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Each class is one aligned block of equally sized slabs, sized from the
+// settings once when the plugin is loaded
+typedef enum PoolClass {
+	POOL_LOADER,       // Chunks Code.bin and Data.bin are streamed through, the files read at boot, reloads and delta updates
+	POOL_READ_AHEAD,   // A block per redirected file, see readahead.h
+	POOL_WRITE_BEHIND, // See writebehind.h
+	POOL_PREFETCH,     // A range of the last run's trace each, see prefetch.h
+	POOL_CLASS_COUNT,
+} PoolClass;
+
+typedef struct PoolStats {
+	uint32_t slabSize;
+	uint32_t slabs;
+	uint32_t used;
+	uint32_t highWater;
+	uint32_t failures;  // Requests that found every slab taken
+	uint32_t overflows; // Buffers too large for a slab, taken from the heap instead
+} PoolStats;
+
+extern PoolStats poolStats[POOL_CLASS_COUNT];
+
+void initBufferPool();
+
+void *allocPoolSlab(PoolClass pool);
+void *allocPoolBuffer(PoolClass pool, uint32_t size);
+void freePoolBuffer(void *buffer);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
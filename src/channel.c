@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+
+#include <coreinit/event.h>
+#include <coreinit/messagequeue.h>
+#include <coreinit/mutex.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <utils/logger.h>
+
+#include "channel.h"
+#include "compression.h"
+#include "filesocket.h"
+#include "filesystem.h"
+#include "globals.h"
+#include "protocol.h"
+#include "reload.h"
+#include "stats.h"
+
+// Requests waiting for a reply. The low bits of a request ID select its
+// slot, so the reader finds the waiting caller without searching.
+#define MAX_PENDING_REPLIES 64
+#define SLOT_MASK           (MAX_PENDING_REPLIES - 1)
+#define SLOT_BITS           6
+
+#define READER_STACK_SIZE 0x4000
+#define READER_PRIORITY   14 // Above the I/O thread, replies unblock everyone else
+
+#define TRY_SEND_ATTEMPTS 100 // A millisecond apart
+
+typedef struct PendingReply {
+	uint32_t id;
+	bool waiting;
+
+	char *head;
+	uint32_t headLength;
+	char *body;
+	uint32_t bodyLength;
+	uint32_t received;
+
+	OSEvent done;
+} PendingReply;
+
+static PendingReply pending[MAX_PENDING_REPLIES];
+static OSMessage freeMessages[MAX_PENDING_REPLIES];
+static OSMessageQueue freeQueue;
+
+// Held while a single request is written, and for the whole round trip when
+// there is no reader to hand replies out (v1 has no request IDs at all)
+static OSMutex sendMutex;
+static uint32_t nextSequence = 1;
+
+static OSThread readerThread __attribute__((aligned(8)));
+static void *readerStack = NULL;
+static volatile bool readerRunning = false;
+
+void initChannel() {
+	OSInitMutex(&sendMutex);
+	OSInitMessageQueue(&freeQueue, freeMessages, MAX_PENDING_REPLIES);
+
+	for (uint32_t i = 0; i < MAX_PENDING_REPLIES; i++) {
+		OSInitEvent(&pending[i].done, FALSE, OS_EVENT_MODE_AUTO);
+
+		OSMessage message = {0};
+		message.message = &pending[i];
+		OSSendMessage(&freeQueue, &message, OS_MESSAGE_FLAGS_NONE);
+	}
+}
+
+// Caller holds sendMutex. Small requests are assembled and written with a
+// single send(), `extra` is streamed right behind them.
+static void writeRequest(uint8_t opcode, uint32_t id,
+                         const void *args, uint32_t argsLength,
+                         const void *extra, uint32_t extraLength) {
+	char buffer[MAX_REQUEST_SIZE];
+	uint32_t offset;
+
+	if (protocolVersion >= 2) {
+		MessageHeader *header = (MessageHeader *)buffer;
+		header->opcode   = opcode;
+		header->flags    = 0;
+		header->reserved = 0;
+		header->id       = htonl(id);
+		header->length   = htonl(argsLength + extraLength);
+		offset = sizeof(MessageHeader);
+	} else {
+		buffer[0] = opcode;
+		offset = 1;
+	}
+
+	if (offset + argsLength <= sizeof(buffer)) {
+		memcpy(buffer + offset, args, argsLength);
+		sendFile(buffer, offset + argsLength);
+	} else {
+		sendFile(buffer, offset);
+		sendFile((char *)args, argsLength);
+	}
+
+	if (extraLength)
+		sendFile((char *)extra, extraLength);
+}
+
+static void drain(uint32_t length) {
+	char scratch[0x200];
+	while (length) {
+		uint32_t n = length < sizeof(scratch) ? length : sizeof(scratch);
+		if (!receiveFile(scratch, n))
+			return;
+		length -= n;
+	}
+}
+
+// Splits `length` bytes of reply payload into head and body and returns the
+// number of body bytes. v1 replies carry no length, there a body's size is
+// the last word of the head. Compressed bodies are decoded on the way.
+static uint32_t receivePayload(uint8_t flags, uint32_t length, char *head, uint32_t headLength,
+                               char *body, uint32_t bodyLength) {
+	if (protocolVersion < 2) {
+		receiveFile(head, headLength);
+		length = headLength;
+		if (body)
+			length += ntohl(*(uint32_t *)(head + headLength - 4));
+	} else {
+		uint32_t n = length < headLength ? length : headLength;
+		receiveFile(head, n);
+		memset(head + n, 0, headLength - n);
+	}
+	length = length > headLength ? length - headLength : 0;
+
+	uint32_t received = 0;
+	if (body && (flags & MSG_FLAG_COMPRESSED)) {
+		received = receiveCompressed(body, bodyLength, &length);
+	} else if (body) {
+		received = length < bodyLength ? length : bodyLength;
+		receiveFile(body, received);
+		length -= received;
+	}
+
+	drain(length);
+	return received;
+}
+
+static bool receiveHeader(MessageHeader *header) {
+	// The next message may well take longer than the socket timeout to come
+	int num;
+	do {
+		num = recv(fd, header, 1, 0);
+	} while (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && readerRunning);
+
+	if (num <= 0) {
+		if (readerRunning)
+			connectionLost("recv", num);
+		return false;
+	}
+
+	return receiveFile((char *)header + 1, sizeof(MessageHeader) - 1);
+}
+
+static int readerMain(int argc, const char **argv) {
+	MessageHeader header;
+	while (readerRunning && receiveHeader(&header)) {
+		uint32_t id = ntohl(header.id);
+		uint32_t length = ntohl(header.length);
+
+		// The host asking for the statistics report
+		if (id == 0 && header.opcode == OP_DEBUG_FILE) {
+			drain(length);
+			sendStats();
+			continue;
+		}
+
+		// The host's files changed while the game runs
+		if (id == 0 && header.opcode == OP_INVALIDATE) {
+			drain(length - receiveInvalidation(header.flags, length));
+			continue;
+		}
+
+		// A new build of the code to apply in place
+		if (id == 0 && header.opcode == OP_RELOAD) {
+			drain(length - receiveReload(length));
+			continue;
+		}
+
+		PendingReply *reply = &pending[id & SLOT_MASK];
+		if (id == 0 || !reply->waiting || reply->id != id) {
+			DEBUG_FUNCTION_LINE_WARN("Dropping unexpected message %u (0x%02X)", id, header.opcode);
+			drain(length);
+			continue;
+		}
+
+		reply->received = receivePayload(header.flags, length, reply->head, reply->headLength, reply->body, reply->bodyLength);
+		reply->waiting = false;
+		OSSignalEvent(&reply->done);
+	}
+
+	// Nothing more will arrive, release everyone still waiting
+	OSLockMutex(&sendMutex);
+	readerRunning = false;
+	for (uint32_t i = 0; i < MAX_PENDING_REPLIES; i++) {
+		if (pending[i].waiting) {
+			memset(pending[i].head, 0, pending[i].headLength);
+			pending[i].received = 0;
+			pending[i].waiting = false;
+			OSSignalEvent(&pending[i].done);
+		}
+	}
+	OSUnlockMutex(&sendMutex);
+
+	return 0;
+}
+
+// Replies are only tagged with request IDs from v2 on, v1 stays serialized
+void startChannel() {
+	if (readerRunning || protocolVersion < 2)
+		return;
+
+	readerStack = memalign(0x20, READER_STACK_SIZE);
+	if (!readerStack)
+		return;
+
+	if (!OSCreateThread(&readerThread, readerMain, 0, NULL, (char *)readerStack + READER_STACK_SIZE,
+	                    READER_STACK_SIZE, READER_PRIORITY, OS_THREAD_ATTRIB_AFFINITY_ANY)) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to create the reader thread");
+		free(readerStack);
+		readerStack = NULL;
+		return;
+	}
+
+	readerRunning = true;
+	OSSetThreadName(&readerThread, "CafeLoader Reader");
+	OSResumeThread(&readerThread);
+}
+
+void stopChannel() {
+	if (!readerStack)
+		return;
+
+	// Wakes the reader out of recv()
+	readerRunning = false;
+	shutdown(fd, SHUT_RDWR);
+
+	int result;
+	OSJoinThread(&readerThread, &result);
+	free(readerStack);
+	readerStack = NULL;
+}
+
+// Requests without a reply are tagged 0 and never wait for anything
+void sendRequest(uint8_t opcode, const void *args, uint32_t argsLength,
+                 const void *extra, uint32_t extraLength) {
+	recordRequest(opcode, false);
+
+	OSLockMutex(&sendMutex);
+	writeRequest(opcode, 0, args, argsLength, extra, extraLength);
+	OSUnlockMutex(&sendMutex);
+}
+
+// For the crash handler, which must not wait on a thread that may never let
+// go of the socket again. The mutex is recursive, so a thread that crashed
+// while sending still gets through. Returns whether the request was sent.
+bool trySendRequest(uint8_t opcode, const void *args, uint32_t argsLength,
+                    const void *extra, uint32_t extraLength) {
+	for (uint32_t i = 0; i < TRY_SEND_ATTEMPTS; i++) {
+		if (OSTryLockMutex(&sendMutex)) {
+			recordRequest(opcode, false);
+			writeRequest(opcode, 0, args, argsLength, extra, extraLength);
+			OSUnlockMutex(&sendMutex);
+			return true;
+		}
+		OSSleepTicks(OSMillisecondsToTicks(1));
+	}
+
+	return false;
+}
+
+// Sends a request and waits for its reply. The first `headLength` bytes of
+// the reply go to `head`, the rest to `body` (if any) up to `bodyLength`.
+// Returns the number of body bytes received. Only the caller waits on the
+// round trip, other threads keep sending and receiving in the meantime.
+uint32_t requestReply(uint8_t opcode, const void *args, uint32_t argsLength,
+                      void *head, uint32_t headLength,
+                      void *body, uint32_t bodyLength) {
+
+	recordRequest(opcode, true);
+
+	OSLockMutex(&sendMutex);
+	uint32_t id = nextSequence << SLOT_BITS;
+
+	// Wraps before the shift drops bits, and skips 0 so no request gets the
+	// ID of one-way messages
+	if (++nextSequence > (0xFFFFFFFF >> SLOT_BITS))
+		nextSequence = 1;
+
+	if (!readerRunning) {
+		// Nobody else reads from the socket, so we hold it for the round trip
+		uint32_t received = 0;
+		writeRequest(opcode, id, args, argsLength, NULL, 0);
+
+		MessageHeader header;
+		if (protocolVersion < 2) {
+			received = receivePayload(0, 0, (char *)head, headLength, (char *)body, bodyLength);
+		} else if (receiveFile((char *)&header, sizeof(MessageHeader))) {
+			if (ntohl(header.id) == id) {
+				received = receivePayload(header.flags, ntohl(header.length), (char *)head, headLength, (char *)body, bodyLength);
+			} else {
+				connectionLost("requestReply", -1);
+				memset(head, 0, headLength);
+			}
+		}
+
+		OSUnlockMutex(&sendMutex);
+		return received;
+	}
+	OSUnlockMutex(&sendMutex);
+
+	OSMessage message;
+	OSReceiveMessage(&freeQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+	PendingReply *reply = (PendingReply *)message.message;
+
+	reply->head       = (char *)head;
+	reply->headLength = headLength;
+	reply->body       = (char *)body;
+	reply->bodyLength = bodyLength;
+	reply->received   = 0;
+
+	// The reader only gives up while holding sendMutex, so once the request
+	// is out under it we are guaranteed to be woken up
+	OSLockMutex(&sendMutex);
+	bool sent = readerRunning;
+	if (sent) {
+		reply->id = id | (reply - pending);
+		reply->waiting = true;
+		writeRequest(opcode, reply->id, args, argsLength, NULL, 0);
+	} else {
+		memset(head, 0, headLength);
+	}
+	OSUnlockMutex(&sendMutex);
+
+	if (sent)
+		OSWaitEvent(&reply->done);
+
+	uint32_t received = reply->received;
+	OSSendMessage(&freeQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+	return received;
+}
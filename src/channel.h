@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+void initChannel();
+void startChannel();
+void stopChannel();
+
+void sendRequest(uint8_t opcode, const void *args, uint32_t argsLength,
+                 const void *extra, uint32_t extraLength);
+bool trySendRequest(uint8_t opcode, const void *args, uint32_t argsLength,
+                    const void *extra, uint32_t extraLength);
+
+uint32_t requestReply(uint8_t opcode, const void *args, uint32_t argsLength,
+                      void *head, uint32_t headLength,
+                      void *body, uint32_t bodyLength);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
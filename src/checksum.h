@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Both match zlib, so client.py and the packer can use Python's zlib module
+uint32_t adler32(const void *data, uint32_t length);
+uint32_t crc32(uint32_t crc, const void *data, uint32_t length);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
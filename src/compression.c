@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include <netinet/in.h>
+#include <utils/logger.h>
+
+#include "compression.h"
+#include "filesocket.h"
+
+CompressionStats compressionStats;
+
+// Compressed chunks are staged here and decoded straight into the caller's
+// buffer. Only the thread reading replies off the socket ever uses it.
+static char chunkBuffer[LZ4_COMPRESS_BOUND(COMPRESSION_CHUNK_SIZE)] __attribute__((aligned(0x40)));
+
+// Decodes one LZ4 block, returns the number of bytes written to dest or -1
+// if the block is malformed or does not fit
+static int decompressLZ4(const uint8_t *source, uint32_t sourceLength, uint8_t *dest, uint32_t destLength) {
+	const uint8_t *sourceEnd = source + sourceLength;
+	uint8_t *destStart = dest;
+	uint8_t *destEnd = dest + destLength;
+
+	while (source < sourceEnd) {
+		uint8_t token = *source++;
+
+		uint32_t literals = token >> 4;
+		if (literals == 15) {
+			uint8_t byte;
+			do {
+				if (source >= sourceEnd)
+					return -1;
+				byte = *source++;
+				literals += byte;
+			} while (byte == 255);
+		}
+
+		if (literals > (uint32_t)(sourceEnd - source) || literals > (uint32_t)(destEnd - dest))
+			return -1;
+
+		memcpy(dest, source, literals);
+		source += literals;
+		dest += literals;
+
+		// The last sequence has no match
+		if (source == sourceEnd)
+			break;
+
+		if (sourceEnd - source < 2)
+			return -1;
+
+		uint32_t offset = source[0] | (source[1] << 8);
+		source += 2;
+		if (offset == 0 || offset > (uint32_t)(dest - destStart))
+			return -1;
+
+		uint32_t match = (token & 15) + 4;
+		if ((token & 15) == 15) {
+			uint8_t byte;
+			do {
+				if (source >= sourceEnd)
+					return -1;
+				byte = *source++;
+				match += byte;
+			} while (byte == 255);
+		}
+
+		if (match > (uint32_t)(destEnd - dest))
+			return -1;
+
+		// Matches may overlap what they produce, so copy forwards bytewise
+		const uint8_t *from = dest - offset;
+		while (match--)
+			*dest++ = *from++;
+	}
+
+	return dest - destStart;
+}
+
+// Receives the chunks making up `*length` bytes of reply payload into dest
+// and returns the number of bytes decoded. Whatever does not fit, or
+// follows a malformed chunk, is left in `*length` for the caller to drain.
+uint32_t receiveCompressed(char *dest, uint32_t destLength, uint32_t *length) {
+	uint32_t decoded = 0;
+
+	while (*length >= 8) {
+		uint32_t chunk[2];
+		receiveFile((char *)chunk, sizeof(chunk));
+		*length -= sizeof(chunk);
+
+		uint32_t rawLength    = ntohl(chunk[0]);
+		uint32_t storedLength = ntohl(chunk[1]);
+		if (rawLength > destLength - decoded || storedLength > *length || storedLength > sizeof(chunkBuffer)) {
+			__atomic_fetch_add(&compressionStats.errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+
+		addCounter(&compressionStats.bytesReceived, sizeof(chunk) + storedLength);
+		*length -= storedLength;
+
+		if (storedLength == rawLength) {
+			receiveFile(dest + decoded, rawLength);
+			__atomic_fetch_add(&compressionStats.chunksStored, 1, __ATOMIC_RELAXED);
+		} else {
+			receiveFile(chunkBuffer, storedLength);
+
+			OSTime start = OSGetTime();
+			int result = decompressLZ4((uint8_t *)chunkBuffer, storedLength, (uint8_t *)dest + decoded, rawLength);
+			addCounter(&compressionStats.decodeTime, (uint32_t)(OSGetTime() - start));
+
+			if (result != (int)rawLength) {
+				DEBUG_FUNCTION_LINE_ERR("Malformed compressed chunk (%u -> %u bytes)", storedLength, rawLength);
+				__atomic_fetch_add(&compressionStats.errors, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			__atomic_fetch_add(&compressionStats.chunksCompressed, 1, __ATOMIC_RELAXED);
+			addCounter(&compressionStats.bytesUnpacked, rawLength);
+		}
+
+		decoded += rawLength;
+		addCounter(&compressionStats.bytesDecoded, rawLength);
+	}
+
+	return decoded;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Compressed read replies are split into chunks of at most this many bytes,
+// each preceded by u32 raw length and u32 stored length. Chunks the host
+// could not shrink are stored as they are (stored length == raw length),
+// everything else is a single LZ4 block.
+#define COMPRESSION_CHUNK_SIZE 0x10000
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+typedef struct CompressionStats {
+	uint32_t chunksCompressed;
+	uint32_t chunksStored;
+	uint32_t errors;
+	Counter64 bytesReceived; // As they came over the wire, chunk headers included
+	Counter64 bytesDecoded;
+	Counter64 bytesUnpacked; // The part of bytesDecoded LZ4 produced, in decodeTime
+	Counter64 decodeTime;
+} CompressionStats;
+
+extern CompressionStats compressionStats;
+
+uint32_t receiveCompressed(char *dest, uint32_t destLength, uint32_t *length);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <utils/logger.h>
+
+#include "bufferpool.h"
+#include "channel.h"
+#include "checksum.h"
+#include "delta.h"
+#include "filesystem.h"
+#include "protocol.h"
+
+// Block sizes start here and double until the old copy has at most
+// DELTA_MAX_BLOCKS of them, which keeps the request within a few hundred KiB
+#define DELTA_MIN_BLOCK  0x2000
+#define DELTA_MAX_BLOCKS 0x8000
+
+// Unit in which data is copied from the old copy or fetched from the host
+#define DELTA_CHUNK_SIZE 0x10000
+
+// Marks a run of the reply that has to be fetched from the host
+#define DELTA_LITERAL 0xFFFFFFFF
+
+DeltaStats deltaStats;
+
+static bool writeAll(int fd, const char *data, uint32_t length) {
+	while (length) {
+		int num = write(fd, data, length);
+		if (num <= 0)
+			return false;
+		data += num;
+		length -= num;
+	}
+	return true;
+}
+
+static bool readAll(int fd, char *data, uint32_t length) {
+	while (length) {
+		int num = read(fd, data, length);
+		if (num <= 0)
+			return false;
+		data += num;
+		length -= num;
+	}
+	return true;
+}
+
+// Sends the checksums of every full block of the old copy and receives the
+// runs making up the new file, each u32 old block (or DELTA_LITERAL) and
+// u32 length. Returns the number of runs or 0 on failure.
+static uint32_t requestRuns(uint32_t handle, int oldFd, uint32_t blockSize, uint32_t blocks,
+                            char *buffer, uint32_t *runs, uint32_t maxRuns) {
+	uint32_t argsLength = 12 + blocks * 8;
+	uint32_t *args = (uint32_t *)allocPoolBuffer(POOL_LOADER, argsLength);
+	if (!args)
+		return 0;
+
+	args[0] = htonl(handle);
+	args[1] = htonl(blockSize);
+	args[2] = htonl(blocks);
+
+	lseek(oldFd, 0, SEEK_SET);
+	for (uint32_t i = 0; i < blocks; i++) {
+		if (!readAll(oldFd, buffer, blockSize)) {
+			freePoolBuffer(args);
+			return 0;
+		}
+
+		args[3 + i * 2] = htonl(adler32(buffer, blockSize));
+		args[4 + i * 2] = htonl(crc32(0, buffer, blockSize));
+	}
+
+	uint32_t count = 0;
+	uint32_t received = requestReply(OP_DELTA, args, argsLength, &count, 4, runs, maxRuns * 8);
+	freePoolBuffer(args);
+
+	count = ntohl(count);
+	return received == count * 8 ? count : 0;
+}
+
+static bool copyRun(int oldFd, int newFd, uint32_t offset, uint32_t length, char *buffer) {
+	if (lseek(oldFd, offset, SEEK_SET) < 0)
+		return false;
+
+	while (length) {
+		uint32_t n = length < DELTA_CHUNK_SIZE ? length : DELTA_CHUNK_SIZE;
+		if (!readAll(oldFd, buffer, n) || !writeAll(newFd, buffer, n))
+			return false;
+		length -= n;
+		addCounter(&deltaStats.bytesCopied, n);
+	}
+	return true;
+}
+
+static bool fetchRun(uint32_t handle, uint32_t *serverPos, uint32_t offset, uint32_t length,
+                     int newFd, char *buffer) {
+	if (*serverPos != offset) {
+		uint32_t args[2] = { htonl(handle), htonl(offset) };
+		sendRequest(OP_SET_POS, args, sizeof(args), NULL, 0);
+		*serverPos = offset;
+	}
+
+	while (length) {
+		uint32_t n = length < DELTA_CHUNK_SIZE ? length : DELTA_CHUNK_SIZE;
+		uint32_t args[3] = { htonl(handle), htonl(1), htonl(n) };
+		uint32_t reply[2];
+		uint32_t received = requestReply(OP_READ, args, sizeof(args), reply, sizeof(reply), buffer, n);
+
+		*serverPos += received;
+		if (received != n || !writeAll(newFd, buffer, n))
+			return false;
+
+		length -= n;
+		addCounter(&deltaStats.bytesFetched, n);
+	}
+	return true;
+}
+
+// Writes the host's current version of `path` to newFd, reusing every block
+// of the stale copy in oldFd that client.py still finds in it
+bool rebuildFromDelta(const char *path, int oldFd, uint32_t oldSize, int newFd, uint32_t newSize) {
+	uint32_t blockSize = DELTA_MIN_BLOCK;
+	while (oldSize / blockSize > DELTA_MAX_BLOCKS)
+		blockSize <<= 1;
+
+	uint32_t blocks = oldSize / blockSize;
+	uint32_t maxRuns = 2 * (newSize / blockSize) + 3;
+
+	uint32_t handle;
+	pathRequest(OP_OPEN, path, &handle, 4);
+	handle = ntohl(handle);
+	if (handle == 0)
+		return false;
+
+	char *buffer = (char *)allocPoolBuffer(POOL_LOADER, blockSize > DELTA_CHUNK_SIZE ? blockSize : DELTA_CHUNK_SIZE);
+	uint32_t *runs = (uint32_t *)allocPoolBuffer(POOL_LOADER, maxRuns * 8);
+
+	bool ok = false;
+	uint32_t count = buffer && runs ? requestRuns(handle, oldFd, blockSize, blocks, buffer, runs, maxRuns) : 0;
+	if (count) {
+		uint32_t offset = 0, serverPos = 0;
+		ok = true;
+
+		for (uint32_t i = 0; ok && i < count; i++) {
+			uint32_t block  = ntohl(runs[i * 2]);
+			uint32_t length = ntohl(runs[i * 2 + 1]);
+			if (length > newSize - offset) {
+				ok = false;
+				break;
+			}
+
+			if (block == DELTA_LITERAL)
+				ok = fetchRun(handle, &serverPos, offset, length, newFd, buffer);
+			else if (block < blocks && length <= (blocks - block) * blockSize)
+				ok = copyRun(oldFd, newFd, block * blockSize, length, buffer);
+			else
+				ok = false;
+
+			offset += length;
+		}
+
+		ok = ok && offset == newSize;
+	}
+
+	uint32_t args = htonl(handle);
+	sendRequest(OP_CLOSE, &args, 4, NULL, 0);
+
+	freePoolBuffer(runs);
+	freePoolBuffer(buffer);
+
+	if (ok)
+		__atomic_fetch_add(&deltaStats.updates, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&deltaStats.failures, 1, __ATOMIC_RELAXED);
+
+	DEBUG_FUNCTION_LINE("Delta update of %s %s", path, ok ? "done" : "failed");
+	return ok;
+}
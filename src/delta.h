@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Files whose cached copy is smaller than this are simply fetched again
+#define DELTA_MIN_SIZE 0x100000
+
+typedef struct DeltaStats {
+	uint32_t updates;  // Cached copies brought up to date from a delta
+	uint32_t failures;
+	Counter64 bytesCopied;  // Reused from the old copy
+	Counter64 bytesFetched; // Sent by the host
+} DeltaStats;
+
+extern DeltaStats deltaStats;
+
+bool rebuildFromDelta(const char *path, int oldFd, uint32_t oldSize, int newFd, uint32_t newSize);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
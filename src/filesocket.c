@@ -1,61 +1,127 @@
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 
 #include <coreinit/internal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <utils/logger.h>
 
 #include "filesocket.h"
 #include "globals.h"
+#include "manifest.h"
+#include "protocol.h"
 
-void receiveFile(char *dest, uint32_t filesize) {
-    /*
-	send(fd, "\x07", 1, 0);
-	send(fd, "\x00\x00\x00\x0A", 4, 0);
-	char buffer2[10];
-	__os_snprintf(buffer2, 10, "%i", filesize);
-	send(fd, buffer2, 10, 0);
-    */
+// Socket buffers sized for multi-megabyte transfers over Wi-Fi
+#define SOCKET_BUFFER_SIZE 0x40000
+// A transfer that makes no progress for this long is treated as dead
+#define SOCKET_TIMEOUT_MS  10000
 
+void configureSocket(int socket) {
+	int size = SOCKET_BUFFER_SIZE;
+	setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	// Requests are small and latency bound, don't let Nagle hold them back
+	int noDelay = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	struct timeval timeout;
+	timeout.tv_sec  = SOCKET_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (SOCKET_TIMEOUT_MS % 1000) * 1000;
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Once the stream is out of sync there is no way to recover it, so stop
+// redirecting and let every hook fall through to the real filesystem. The
+// socket stays open, other threads may still be in a call on it, and is
+// closed when the title ends.
+void connectionLost(const char *what, int result) {
+	if (clientEnabled)
+		DEBUG_FUNCTION_LINE_ERR("%s failed (%d, errno %d), disabling the client", what, result, errno);
+
+	clientEnabled = false;
+}
+
+// Blocks until `filesize` bytes have arrived, asking for everything that is
+// still missing at once so large transfers take as few calls as possible
+bool receiveFile(char *dest, uint32_t filesize) {
 	uint32_t bytes = 0;
 	while (bytes < filesize) {
-		uint32_t blarg;
-		if ((filesize - bytes) < 0x400) {
-			blarg = filesize - bytes;
-		} else {
-			blarg = 0x400;
-		}
-        /*
-		send(fd, "\x07", 1, 0);
-		send(fd, "\x00\x00\x00\x0A", 4, 0);
-		char buffer3[10];
-		snprintf(buffer3, 10, "%i", blarg);
-		send(fd, buffer3, 10, 0);
-		*/
-
-		uint32_t num = recv(fd, dest, blarg, MSG_DONTWAIT);
-
-        /*
-		send(fd, "\x07", 1, 0);
-		send(fd, "\x00\x00\x00\x0A", 4, 0);
-		char buffer4[10];
-		snprintf(buffer4, 10, "%i", num);
-		send(fd, buffer4, 10, 0);
-		*/
-
-		if (num == 0xFFFFFFFF) {
-			//DEBUG_FUNCTION_LINE("TODO: insert SOLastError() output here");
-		} else {
-			bytes += num;
-			dest += num;
+		int num = recv(fd, dest, filesize - bytes, 0);
+		if (num < 0 && errno == EINTR)
+			continue;
+
+		if (num <= 0) {
+			connectionLost("recv", num);
+			memset(dest, 0, filesize - bytes);
+			return false;
 		}
+
+		bytes += num;
+		dest += num;
 	}
+
+	return true;
 }
 
-void sendFile(char *source, uint32_t filesize) {
+bool sendFile(char *source, uint32_t filesize) {
 	uint32_t bytes = 0;
 	while (bytes < filesize) {
-		uint32_t num = send(fd, source, filesize - bytes, 0);
+		int num = send(fd, source, filesize - bytes, 0);
+		if (num < 0 && errno == EINTR)
+			continue;
+
+		if (num <= 0) {
+			connectionLost("send", num);
+			return false;
+		}
+
 		bytes += num;
 		source += num;
 	}
+
+	return true;
+}
+
+// Negotiates the protocol version and capabilities with the host. The hello
+// carries the title ID, magic, protocol version and wanted capabilities;
+// v1 hosts only look at the title ID and reply with a plain 0xCAFE.
+bool handshake(const char *titleID) {
+	char hello[1 + 16 + 4 + 2 + 2 + 4] = {0};
+	uint16_t version = htons(PROTOCOL_VERSION);
+	uint32_t wanted  = htonl(CAP_MANIFEST | CAP_COMPRESSION | CAP_DELTA | CAP_INVALIDATE | CAP_RELOAD | CAP_SAVES | CAP_READ_AT);
+
+	hello[0] = OP_HELLO;
+	memcpy(hello + 1, titleID, 16);
+	memcpy(hello + 17, HELLO_MAGIC, 4);
+	memcpy(hello + 21, &version, 2);
+	memcpy(hello + 25, &wanted, 4);
+
+	protocolVersion = 1;
+	capabilities = 0;
+
+	uint16_t reply = 0;
+	sendFile(hello, sizeof(hello));
+	receiveFile((char *)&reply, 2);
+	reply = ntohs(reply);
+
+	if (reply == REPLY_V2) {
+		// Followed by the version and capabilities the host settled on
+		char negotiated[2 + 4];
+		receiveFile(negotiated, sizeof(negotiated));
+		memcpy(&version, negotiated, 2);
+		memcpy(&wanted, negotiated + 2, 4);
+
+		protocolVersion = ntohs(version);
+		capabilities = ntohl(wanted);
+
+		if ((capabilities & CAP_MANIFEST) && !receiveManifest())
+			return false;
+	}
+
+	return reply == REPLY_V1 || reply == REPLY_V2;
 }
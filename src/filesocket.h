@@ -1,13 +1,20 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
 
-void receiveFile(char *out, uint32_t length);
-void sendFile(char *src, uint32_t length);
+void configureSocket(int socket);
+void connectionLost(const char *what, int result);
+
+bool receiveFile(char *out, uint32_t length);
+bool sendFile(char *src, uint32_t length);
+
+bool handshake(const char *titleID);
 
 #ifdef __cplusplus
 }
@@ -2,95 +2,259 @@
 
 #include <coreinit/debug.h>
 #include <coreinit/filesystem.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
+#include <utils/logger.h>
 
+#include "channel.h"
 #include "globals.h"
 #include "filesocket.h"
 #include "filesystem.h"
+#include "handles.h"
+#include "manifest.h"
+#include "overlay.h"
+#include "prefetch.h"
+#include "protocol.h"
+#include "readahead.h"
+#include "recorder.h"
+#include "sdcache.h"
+#include "writebehind.h"
+
+// Keeps the state of a redirected file consistent when several threads use
+// it. Different files never wait on each other, not even across round trips.
+struct FileLock {
+	RedirectedFile *file;
+	FileLock(RedirectedFile *file) : file(file) { OSLockMutex(&file->mutex); }
+	~FileLock() { OSUnlockMutex(&file->mutex); }
+};
+
+// Requests that carry a path: u32 length followed by the path itself
+uint32_t pathRequest(uint8_t opcode, const char *path, void *reply, uint32_t replyLength) {
+	char args[4 + MAX_PATH_LENGTH];
+	uint32_t length = strnlen(path, MAX_PATH_LENGTH);
+
+	*(uint32_t *)args = htonl(length);
+	memcpy(args + 4, path, length);
+	return requestReply(opcode, args, 4 + length, reply, replyLength, NULL, 0);
+}
 
 bool isServerFile(const char *path) {
-	uint32_t pathLength = strlen(path);
+	// Hosts that sent a manifest are never asked over the wire
+	if (hasManifest())
+		return findManifestEntry(path) != NULL;
+
 	uint16_t reply = 0;
+	pathRequest(OP_FILE_CHECK, path, &reply, 2);
+
+	return ntohs(reply) == 0xCAFE;
+}
+
+// Applies an OP_INVALIDATE on the reader thread: u32 count, followed by
+// count entries laid out like the manifest's. Files already open keep
+// reading what they have, the next open sees the new version. Returns the
+// number of payload bytes consumed.
+uint32_t receiveInvalidation(uint8_t flags, uint32_t length) {
+	uint32_t count;
+	if (length < 4 || !receiveFile((char *)&count, 4))
+		return 0;
+
+	count = ntohl(count);
+	if (count > (length - 4) / 16)
+		count = (length - 4) / 16;
 
-	send(fd, "\x0C", 1, 0);
-	send(fd, &pathLength, 4, 0);
-	send(fd, path, pathLength, 0);
-	recv(fd, &reply, 2, 0);
+	uint8_t data[16];
+	for (uint32_t i = 0; i < count; i++) {
+		if (!receiveFile((char *)data, sizeof(data)))
+			return 4 + i * 16;
 
-	return reply == 0xCAFE;
+		ManifestEntry entry;
+		entry.hash    = ((uint64_t)ntohl(*(uint32_t *)data) << 32) | ntohl(*(uint32_t *)(data + 4));
+		entry.size    = ntohl(*(uint32_t *)(data + 8));
+		entry.mtime   = ntohl(*(uint32_t *)(data + 12));
+		entry.removed = false;
+
+		if (flags & MSG_FLAG_REMOVED)
+			removeManifestEntry(entry.hash);
+		else if (!updateManifestEntry(&entry))
+			DEBUG_FUNCTION_LINE_WARN("No room for new file %016llX in the manifest", entry.hash);
+
+		invalidateCachedFile(entry.hash);
+		dropPrefetched(entry.hash);
+	}
+
+	DEBUG_FUNCTION_LINE("Host %s %u files", (flags & MSG_FLAG_REMOVED) ? "removed" : "changed", count);
+	return 4 + count * 16;
 }
 
 bool getStat(FSClient *client, FSCmdBlock *block,
              const char *path, FSStat *returnedStat,
              int errHandling) {
 
+	if (hasManifest()) {
+		const ManifestEntry *entry = findManifestEntry(path);
+		if (!entry)
+			return 1;
+
+		memset(returnedStat, 0, sizeof(FSStat));
+		returnedStat->size      = entry->size;
+		returnedStat->allocSize = entry->size;
+		return 0;
+	}
+
 	returnedStat->flags = (FSStatFlags)0;
 	return !isServerFile(path);
 }
 
-void checkFileHandle() {
-	if (file != 0) {
-		send(fd, "\xFF", 1, 0);
-		OSFatal("Blarg");
-	}
-}
+static void flushWrites(RedirectedFile *file);
 
 bool getStatFile(FSClient *client, FSCmdBlock *block,
 				 FSFileHandle fileHandle, FSStat *returnedStat,
 				 int errHandling) {
 
-	if (file == fileHandle) {
-		send(fd, "\x08", 1, 0);
-		send(fd, &fileHandle, 4, 0);
+	RedirectedFile *file = findRedirectedFile(fileHandle);
+	if (!file)
+		return 1;
+
+	FileLock lock(file);
+	RecordedEvent event(EVENT_STAT, file->hash, file->pos, file->size);
+	flushWrites(file);
 
-		recv(fd, &returnedStat->size, 4, 0);
+	// Files read from the SD card know their size, even when it is 0
+	if (file->size != 0 || file->localFd >= 0) {
+		memset(returnedStat, 0, sizeof(FSStat));
+		returnedStat->size      = file->size;
+		returnedStat->allocSize = file->size;
 		return 0;
 	}
 
-	return 1;
+	uint32_t args = htonl(fileHandle);
+	requestReply(OP_STAT_FILE, &args, 4, &returnedStat->size, 4, NULL, 0);
+	returnedStat->size = ntohl(returnedStat->size);
+	return 0;
+}
+
+// Seeks are deferred until the next transfer, which lets sequential
+// read-ahead and seeks within a cached block skip them entirely
+void syncPosition(RedirectedFile *file, uint32_t pos) {
+	if (file->serverPos == pos)
+		return;
+
+	uint32_t args[2] = { htonl(file->handle), htonl(pos) };
+	sendRequest(OP_SET_POS, args, sizeof(args), NULL, 0);
+	file->serverPos = pos;
+}
+
+// Sends what the write-behind buffer holds as one OP_WRITE. It is one-way,
+// the game does not wait for the host until the file is closed. It is sent
+// from the calling thread, so it is on the socket ahead of the read, stat or
+// close that made the flush necessary.
+static void flushWrites(RedirectedFile *file) {
+	if (!file->writeLength)
+		return;
+
+	syncPosition(file, file->writeStart);
+
+	uint32_t args[2] = { htonl(file->handle), htonl(file->writeLength) };
+	sendRequest(OP_WRITE, args, sizeof(args), file->writeBuffer, file->writeLength);
+
+	file->serverPos += file->writeLength;
+	file->written = true;
+	__atomic_fetch_add(&writeBehindStats.flushes, 1, __ATOMIC_RELAXED);
+	addCounter(&writeBehindStats.bytesWritten, file->writeLength);
+	file->writeLength = 0;
+}
+
+// Hosts that know OP_READ_AT are told the offset with the read, so a seek
+// costs nothing and their position of the file is left where it was
+uint32_t requestRead(RedirectedFile *file, uint32_t pos, char *dest,
+                     uint32_t size, uint32_t count,
+                     uint32_t *elementsRead) {
+
+	uint32_t reply[2];
+	uint32_t filesize;
+	if (capabilities & CAP_READ_AT) {
+		uint32_t args[4] = { htonl(file->handle), htonl(size), htonl(count), htonl(pos) };
+		filesize = requestReply(OP_READ_AT, args, sizeof(args), reply, sizeof(reply), dest, size * count);
+	} else {
+		syncPosition(file, pos);
+
+		uint32_t args[3] = { htonl(file->handle), htonl(size), htonl(count) };
+		filesize = requestReply(OP_READ, args, sizeof(args), reply, sizeof(reply), dest, size * count);
+		file->serverPos += ntohl(reply[1]); // Where the host is, even if less arrived
+	}
+	*elementsRead = ntohl(reply[0]);
+
+	// A chunk that failed to decode leaves the rest of dest unfilled, the
+	// game must only be told about what actually arrived
+	if (filesize < ntohl(reply[1]))
+		*elementsRead = filesize / size;
+
+	writeCacheFill(file, pos, dest, filesize);
+	return filesize;
+}
+
+// Only moves our own position, see syncPosition()
+static void seekFile(RedirectedFile *file, uint32_t pos) {
+	file->pos = pos;
+	if (pos < file->blockStart || pos >= file->blockStart + file->blockLength)
+		invalidateReadAhead(file);
 }
 
 bool setPosFile(FSClient *client, FSCmdBlock *block,
 				FSFileHandle fileHandle, uint32_t fpos,
 				int errHandling) {
 
-	if (fileHandle != file)
+	RedirectedFile *file = findRedirectedFile(fileHandle);
+	if (!file)
 		return 1;
 
-	send(fd, "\x09", 1, 0);
-	send(fd, &fileHandle, 4, 0);
-	send(fd, &fpos, 4, 0);
+	FileLock lock(file);
+	RecordedEvent event(EVENT_SEEK, file->hash, fpos, 0);
+	seekFile(file, fpos);
 	return 0;
 }
 
-/* TODO: while the code is finished, I will re-enable this later one
+// Saves the host has are redirected, others are left to the real save.
+// Args: u32 account slot, u32 path length, the path, then the mode padded
+// to 8 bytes. The reply is the handle, 0 if the host has no such save.
 bool openSave(FSClient *client, FSCmdBlock *block,
-			  uint8_t accountSlotNo, const char *path,
-			  const char *mode,
-			  FSFileHandle *fileHandle,
-			  int errHandling) {
+              uint8_t accountSlotNo, const char *path,
+              const char *mode,
+              FSFileHandle *fileHandle,
+              int errHandling) {
 
-	checkFileHandle();
+	// Older hosts would never reply
+	if (!(capabilities & CAP_SAVES) || !canRedirectFile())
+		return 1;
 
-	send(fd, "\x06", 1, 0);
+	RecordedEvent event(EVENT_OPEN_SAVE, hashPath(path), accountSlotNo, 0);
 
-	uint32_t length = strlen(path);
-	send(fd, &length, 4, 0);
-	send(fd, path, length, 0);
-	send(fd, mode, 1, 0);
+	char args[8 + MAX_PATH_LENGTH + 8] = {};
+	uint32_t length = strnlen(path, MAX_PATH_LENGTH);
 
-	uint32_t handle;
-	recv(fd, &handle, 4, 0);
+	*(uint32_t *)(args + 0) = htonl(accountSlotNo);
+	*(uint32_t *)(args + 4) = htonl(length);
+	memcpy(args + 8, path, length);
+	strncpy(args + 8 + length, mode, 7);
 
-	if (handle != 0) {
-		file = handle;
-		*fileHandle = handle;
-		return 0;
+	uint32_t handle = 0;
+	requestReply(OP_OPEN_SAVE, args, 8 + length + 8, &handle, 4, NULL, 0);
+	handle = ntohl(handle);
+
+	if (handle == 0)
+		return 1;
+
+	RedirectedFile *file = addRedirectedFile(handle);
+	if (!file) {
+		uint32_t args = htonl(handle);
+		sendRequest(OP_CLOSE, &args, 4, NULL, 0);
+		return 1;
 	}
 
-	return 1;
+	// Saves are small and written to, they get no read-ahead block
+	*fileHandle = handle;
+	return 0;
 }
-*/
 
 bool openFile(FSClient *client, FSCmdBlock *block,
               const char *path, const char *mode,
@@ -100,71 +264,229 @@ bool openFile(FSClient *client, FSCmdBlock *block,
 	if (!isServerFile(path))
 		return 1;
 
-	checkFileHandle();
+	// Leave the open to the real filesystem rather than crashing
+	if (!canRedirectFile()) {
+		DEBUG_FUNCTION_LINE_WARN("Too many redirected files open, not redirecting %s", path);
+		return 1;
+	}
+
+	const ManifestEntry *entry = findManifestEntry(path);
+	RecordedEvent event(EVENT_OPEN, entry ? entry->hash : hashPath(path), 0, entry ? entry->size : 0);
 
-	send(fd, "\x02", 1, 0);
+	// Without a host the manifest only holds the SD overlay's files
+	if (!clientEnabled)
+		return entry && openOverlayFile(path, entry, mode, fileHandle) ? 0 : 1;
 
-	uint32_t length = strlen(path);
-	send(fd, &length, 4, 0);
-	send(fd, path, length, 0);
+	if (entry)
+		recordTraceOpen(path, entry->hash, mode);
+
+	if (entry && openCachedFile(path, entry, mode, fileHandle))
+		return 0;
 
 	uint32_t handle;
-	recv(fd, &handle, 4, 0);
+	pathRequest(OP_OPEN, path, &handle, 4);
+	handle = ntohl(handle);
+
+	// The host could not open it after all
+	if (handle == 0)
+		return 1;
+
+	RedirectedFile *file = addRedirectedFile(handle);
+	if (!file) {
+		// Another thread took the last slot in the meantime
+		uint32_t args = htonl(handle);
+		sendRequest(OP_CLOSE, &args, 4, NULL, 0);
+		return 1;
+	}
+
+	if (entry) {
+		file->size = entry->size;
+		file->hash = entry->hash;
+		beginCacheFill(file, entry, mode);
+	}
+
+	allocReadAhead(file);
 
-	file = handle;
 	*fileHandle = handle;
 	return 0;
 }
 
+// Reads at file->pos and moves it past what was read. The file lock is held.
+static int readLocked(RedirectedFile *file, char *dest, int size, int count) {
+	if (size <= 0 || count <= 0)
+		return 0;
+
+	uint32_t length = size * count;
+	uint32_t elementsRead;
+	RecordedEvent event(EVENT_READ, file->hash, file->pos, length);
+
+	if (file->overlay)
+		return readOverlayFile(file, dest, length) / size;
+
+	recordTraceRead(file, length);
+
+	if (file->localFd >= 0)
+		return readCachedFile(file, dest, length) / size;
+
+	flushWrites(file);
+
+	uint32_t done = copyFromPrefetch(file, dest, length);
+	if (done == length)
+		return count;
+
+	// Large reads gain nothing from the cache
+	if (!file->block || length - done >= readAheadBlockSize) {
+		if (done == 0) {
+			file->pos += requestRead(file, file->pos, dest, size, count, &elementsRead);
+			return elementsRead;
+		}
+
+		uint32_t received = requestRead(file, file->pos, dest + done, 1, length - done, &elementsRead);
+		file->pos += received;
+		return (done + received) / size;
+	}
+
+	done += copyFromReadAhead(file, dest + done, length - done);
+	if (done == length) {
+		__atomic_fetch_add(&readAheadStats.hits, 1, __ATOMIC_RELAXED);
+		return count;
+	}
+
+	while (done < length) {
+		// The cached block is used up, fetch the aligned one holding pos
+		uint32_t blockStart = file->pos & ~(readAheadBlockSize - 1);
+
+		file->blockStart  = blockStart;
+		file->blockLength = requestRead(file, blockStart, file->block, 1, readAheadBlockSize, &elementsRead);
+		__atomic_fetch_add(&readAheadStats.misses, 1, __ATOMIC_RELAXED);
+		addCounter(&readAheadStats.bytesFetched, file->blockLength);
+
+		uint32_t copied = copyFromReadAhead(file, dest + done, length - done);
+		done += copied;
+
+		// A short block means the end of the file was reached
+		if (copied == 0 || file->blockLength < readAheadBlockSize)
+			break;
+	}
+
+	return done / size;
+}
+
 int readFile(FSClient *client, FSCmdBlock *block,
              char *dest, int size, int count,
              FSFileHandle fileHandle, int flag,
              int errHandling) {
 
-	if (fileHandle != file)
+	RedirectedFile *file = findRedirectedFile(fileHandle);
+	if (!file)
 		return -1;
 
-	send(fd, "\x03", 1, 0);
-	send(fd, &fileHandle, 4, 0);
-	send(fd, &size, 4, 0);
-	send(fd, &count, 4, 0);
+	FileLock lock(file);
+	return readLocked(file, dest, size, count);
+}
 
-	uint32_t filesize;
-	uint32_t elementsRead;
-	recv(fd, &elementsRead, 4, 0);
-	recv(fd, &filesize, 4, 0);
-	receiveFile(dest, filesize);
+// The seek and the read happen under one lock, so no other thread can move
+// the position in between, and the host is sent a single OP_READ_AT
+int readFileWithPos(FSClient *client, FSCmdBlock *block,
+                    char *dest, int size, int count, uint32_t pos,
+                    FSFileHandle fileHandle, int flag,
+                    int errHandling) {
 
-	return elementsRead;
+	RedirectedFile *file = findRedirectedFile(fileHandle);
+	if (!file)
+		return -1;
+
+	FileLock lock(file);
+	seekFile(file, pos);
+	return readLocked(file, dest, size, count);
 }
 
-bool writeFile(FSClient *client, FSCmdBlock *block,
+// Returns the number of elements written like FSWriteFile, or -1 if the
+// file isn't redirected
+int writeFile(FSClient *client, FSCmdBlock *block,
 			   char *source, int size, int count,
 			   FSFileHandle fileHandle, int flag,
 			   int errHandling) {
 
-	if (fileHandle != file)
-		return 1;
+	RedirectedFile *file = findRedirectedFile(fileHandle);
+	if (!file)
+		return -1;
+
+	FileLock lock(file);
+	RecordedEvent event(EVENT_WRITE, file->hash, file->pos, size * count);
+
+	// Only read-only opens are served from the SD card, the real file would
+	// refuse the write as well
+	if (file->localFd >= 0)
+		return FS_STATUS_ACCESS_ERROR;
+
+	invalidateReadAhead(file);
+	if (file->hash)
+		dropPrefetched(file->hash);
 
 	uint32_t length = size * count;
-	send(fd, "\x04", 1, 0);
-	send(fd, &fileHandle, 4, 0);
-	send(fd, &length, 4, 0);
+	if (!appendWriteBehind(file, source, length)) {
+		flushWrites(file);
+
+		// Large writes are sent as they are
+		if (!appendWriteBehind(file, source, length)) {
+			syncPosition(file, file->pos);
+
+			uint32_t args[2] = { htonl(fileHandle), htonl(length) };
+			sendRequest(OP_WRITE, args, sizeof(args), source, length);
+			file->serverPos += length;
+			file->written = true;
+		}
+	}
+
+	file->pos += length;
+	return count;
+}
 
-	sendFile(source, length);
+// Files that were written to are only closed once the host says the data
+// reached its disk
+static void closeOnHost(RedirectedFile *file) {
+	uint32_t args = htonl(file->handle);
+	if (!file->written || !(capabilities & CAP_SAVES)) {
+		sendRequest(OP_CLOSE, &args, 4, NULL, 0);
+		return;
+	}
 
-	return 0;
+	uint32_t status = 0;
+	requestReply(OP_CLOSE, &args, 4, &status, 4, NULL, 0);
+	if (ntohl(status) == 1) {
+		__atomic_fetch_add(&writeBehindStats.acks, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&writeBehindStats.failures, 1, __ATOMIC_RELAXED);
+		DEBUG_FUNCTION_LINE_WARN("The host could not write file %08X", file->handle);
+	}
 }
 
 bool closeFile(FSClient *client, FSCmdBlock *block,
 			   FSFileHandle fileHandle,
 			   int errHandling) {
 
-	if (fileHandle != file)
+	RedirectedFile *file = findRedirectedFile(fileHandle);
+	if (!file)
 		return 1;
 
-	send(fd, "\x05", 1, 0);
-	send(fd, &fileHandle, 4, 0);
-	file = 0;
+	// The lock lives in the file, so it is released before the slot is
+	{
+		FileLock lock(file);
+		RecordedEvent event(EVENT_CLOSE, file->hash, file->pos, file->size);
+
+		if (file->overlay) {
+			closeOverlayFile(file);
+		} else if (file->localFd >= 0) {
+			closeCachedFile(file);
+		} else if (!finishCacheFill(file)) {
+			flushWrites(file);
+			closeOnHost(file);
+		}
+		freeReadAhead(file);
+		freeWriteBehind(file);
+	}
+
+	removeRedirectedFile(file);
 	return 0;
 }
@@ -7,11 +7,21 @@
 extern "C" {
 #endif // __cplusplus
 
+uint32_t pathRequest(uint8_t opcode, const char *path, void *reply, uint32_t replyLength);
+bool isServerFile(const char *path);
+uint32_t receiveInvalidation(uint8_t flags, uint32_t length);
+
 bool openFile(FSClient *client, FSCmdBlock *block,
               const char *path, const char *mode,
               FSFileHandle *fileHandle,
               int errHandling);
 
+bool openSave(FSClient *client, FSCmdBlock *block,
+              uint8_t accountSlotNo, const char *path,
+              const char *mode,
+              FSFileHandle *fileHandle,
+              int errHandling);
+
 bool closeFile(FSClient *client, FSCmdBlock *block,
 			   FSFileHandle fileHandle,
 			   int errHandling);
@@ -21,7 +31,12 @@ int readFile(FSClient *client, FSCmdBlock *block,
              FSFileHandle fileHandle, int flag,
              int errHandling);
 
-bool writeFile(FSClient *client, FSCmdBlock *block,
+int readFileWithPos(FSClient *client, FSCmdBlock *block,
+                    char *dest, int size, int count, uint32_t pos,
+                    FSFileHandle fileHandle, int flag,
+                    int errHandling);
+
+int writeFile(FSClient *client, FSCmdBlock *block,
 			   char *source, int size, int count,
 			   FSFileHandle fileHandle, int flag,
 			   int errHandling);
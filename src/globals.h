@@ -8,8 +8,16 @@ extern "C" {
 #endif // __cplusplus
 
 extern bool clientEnabled;
-extern FSFileHandle file;
+extern bool overlayEnabled;
 extern int fd;
+extern uint32_t protocolVersion;
+extern uint32_t capabilities;
+
+extern uint32_t readAheadBlockSize;
+extern uint32_t readAheadBudget;
+extern uint32_t sdCacheLimit;
+extern uint32_t prefetchBudget;
+extern uint32_t loaderMemoryLimit;
 
 #ifdef __cplusplus
 }
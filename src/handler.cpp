@@ -3,9 +3,15 @@
 
 #include <coreinit/debug.h>
 #include <coreinit/exception.h>
+#include <coreinit/memorymap.h>
+#include <netinet/in.h>
 #include <utils/logger.h>
 
+#include "channel.h"
+#include "globals.h"
 #include "handler.h"
+#include "protocol.h"
+#include "recorder.h"
 
 // From DiiBuggerWUPS:
 // https://github.com/Maschell/DiiBuggerWUPS
@@ -13,6 +19,9 @@
 OSContext crashContext;
 uint32_t crashType;
 
+#define MAX_STACK_DEPTH   32
+#define CRASH_REPORT_SIZE 0x3000
+
 bool handle_crash(uint32_t type, void *handler, OSContext *context) {
     memcpy((char *)&crashContext, (const char *)context, sizeof(OSContext));
     crashType = type;
@@ -20,6 +29,64 @@ bool handle_crash(uint32_t type, void *handler, OSContext *context) {
     return true;
 }
 
+// Return addresses, innermost first. Every frame starts with the back
+// chain to its caller's, and a function saves its LR in the word after
+// that, in its caller's frame.
+static uint32_t walkStack(uint32_t *addresses) {
+    uint32_t depth = 0;
+    addresses[depth++] = crashContext.srr0;
+    addresses[depth++] = crashContext.lr; // Leaf functions never save it
+
+    uint32_t frame = crashContext.gpr[1];
+    while (depth < MAX_STACK_DEPTH) {
+        if ((frame & 3) || !OSIsAddressValid(frame))
+            break;
+
+        // The stack grows down, so the chain must go up
+        uint32_t caller = *(uint32_t *)frame;
+        if (caller <= frame || (caller & 3) || !OSIsAddressValid(caller + 4))
+            break;
+
+        uint32_t address = *(uint32_t *)(caller + 4);
+        if (!address)
+            break;
+
+        addresses[depth++] = address;
+        frame = caller;
+    }
+
+    return depth;
+}
+
+// Payload of OP_CRASH: u32 report length, the report, u32 stack depth, then
+// the return addresses. The report is the registers and the last file
+// system calls, which tell a lot more than the registers alone when a
+// replaced file is what the game choked on.
+static void sendCrashReport(const char *registers) {
+    // Static, the crashed thread's stack may be nearly used up
+    static char payload[4 + CRASH_REPORT_SIZE + 4 + MAX_STACK_DEPTH * 4];
+    char *report = payload + 4;
+
+    uint32_t length = snprintf(report, CRASH_REPORT_SIZE, "%s\nLast file system calls, oldest first:\n", registers);
+    if (length >= CRASH_REPORT_SIZE)
+        length = CRASH_REPORT_SIZE - 1;
+    length += formatEvents(report + length, CRASH_REPORT_SIZE - length);
+    uint32_t header = htonl(length);
+    memcpy(payload, &header, 4);
+
+    // Depth, then the addresses. Built here and copied, the report leaves
+    // them at any alignment in the payload.
+    uint32_t stack[1 + MAX_STACK_DEPTH];
+    uint32_t depth = walkStack(stack + 1);
+    stack[0] = htonl(depth);
+    for (uint32_t i = 1; i <= depth; i++)
+        stack[i] = htonl(stack[i]);
+    memcpy(report + length, stack, 4 + depth * 4);
+
+    if (!trySendRequest(OP_CRASH, payload, 4 + length + 4 + depth * 4, NULL, 0))
+        DEBUG_FUNCTION_LINE_ERR("Could not send the crash report");
+}
+
 void FatalCrashHandler() {
     char buffer[0x400];
     snprintf(buffer, 0x400,
@@ -77,6 +144,8 @@ void FatalCrashHandler() {
             );
 
     DEBUG_FUNCTION_LINE("%s", buffer);
+    if (clientEnabled)
+        sendCrashReport(buffer);
     OSFatal(buffer);
 }
 
@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include <coreinit/mutex.h>
+
+#include "handles.h"
+
+// Maps handles to entries of a fixed pool so that pointers handed out stay
+// valid while the hash table is rearranged. The table has twice as many
+// slots as the pool and uses linear probing with backward shift deletion.
+#define TABLE_SIZE (MAX_REDIRECTED_FILES * 2)
+#define TABLE_MASK (TABLE_SIZE - 1)
+#define EMPTY_SLOT 0xFF
+
+static RedirectedFile files[MAX_REDIRECTED_FILES];
+static bool used[MAX_REDIRECTED_FILES];
+static uint8_t table[TABLE_SIZE];
+static uint32_t openCount = 0;
+static OSMutex mutex;
+
+static inline uint32_t idealSlot(FSFileHandle handle) {
+	// Host handles are sequential, so the low bits already spread well
+	return (handle ^ (handle >> 16)) & TABLE_MASK;
+}
+
+void initRedirectedFiles() {
+	OSInitMutex(&mutex);
+	clearRedirectedFiles();
+}
+
+void clearRedirectedFiles() {
+	OSLockMutex(&mutex);
+	memset(used, 0, sizeof(used));
+	memset(table, EMPTY_SLOT, sizeof(table));
+	openCount = 0;
+	OSUnlockMutex(&mutex);
+}
+
+bool canRedirectFile() {
+	return openCount < MAX_REDIRECTED_FILES;
+}
+
+RedirectedFile *addRedirectedFile(FSFileHandle handle) {
+	OSLockMutex(&mutex);
+
+	uint32_t index = 0;
+	while (index < MAX_REDIRECTED_FILES && used[index])
+		index++;
+
+	if (index == MAX_REDIRECTED_FILES) {
+		OSUnlockMutex(&mutex);
+		return NULL;
+	}
+
+	uint32_t slot = idealSlot(handle);
+	while (table[slot] != EMPTY_SLOT)
+		slot = (slot + 1) & TABLE_MASK;
+
+	used[index] = true;
+	table[slot] = index;
+	memset(&files[index], 0, sizeof(RedirectedFile));
+	files[index].handle = handle;
+	files[index].localFd = -1;
+	OSInitMutex(&files[index].mutex);
+	openCount++;
+
+	OSUnlockMutex(&mutex);
+	return &files[index];
+}
+
+RedirectedFile *findRedirectedFile(FSFileHandle handle) {
+	// Every hooked call on a game file ends up here, keep that path cheap
+	if (openCount == 0)
+		return NULL;
+
+	RedirectedFile *file = NULL;
+	OSLockMutex(&mutex);
+
+	uint32_t slot = idealSlot(handle);
+	while (table[slot] != EMPTY_SLOT) {
+		if (files[table[slot]].handle == handle) {
+			file = &files[table[slot]];
+			break;
+		}
+		slot = (slot + 1) & TABLE_MASK;
+	}
+
+	OSUnlockMutex(&mutex);
+	return file;
+}
+
+void removeRedirectedFile(RedirectedFile *file) {
+	OSLockMutex(&mutex);
+
+	uint32_t index = file - files;
+	uint32_t slot = idealSlot(file->handle);
+	while (table[slot] != index)
+		slot = (slot + 1) & TABLE_MASK;
+
+	// Shift following entries back so lookups never hit a hole
+	uint32_t next = slot;
+	while (true) {
+		next = (next + 1) & TABLE_MASK;
+		if (table[next] == EMPTY_SLOT)
+			break;
+
+		uint32_t ideal = idealSlot(files[table[next]].handle);
+		bool between = slot <= next ? (slot < ideal && ideal <= next)
+		                            : (slot < ideal || ideal <= next);
+		if (between)
+			continue;
+
+		table[slot] = table[next];
+		slot = next;
+	}
+
+	table[slot] = EMPTY_SLOT;
+	used[index] = false;
+	openCount--;
+
+	OSUnlockMutex(&mutex);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <coreinit/filesystem.h>
+#include <coreinit/mutex.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#define MAX_REDIRECTED_FILES 32
+
+typedef struct RedirectedFile {
+	FSFileHandle handle;
+	uint32_t size; // 0 if the manifest did not announce it
+	uint64_t hash; // Manifest hash of the path, 0 without a manifest
+
+	uint32_t pos;       // Position as seen by the game
+	uint32_t serverPos; // Position of the host's file object
+
+	// Read-ahead block, see readahead.h
+	char *block;
+	uint32_t blockStart;
+	uint32_t blockLength;
+
+	// SD cache, see sdcache.h. Files found in the cache are read from
+	// localFd and never reach the host, others may fill it as they go.
+	int localFd;
+	struct CacheFill *fill;
+	bool overlay; // localFd is a file of the SD overlay instead, see overlay.h
+
+	// Write-behind buffer, see writebehind.h. Holds writeLength bytes the
+	// game wrote at writeStart that were not sent yet.
+	char *writeBuffer;
+	uint32_t writeStart;
+	uint32_t writeLength;
+	bool written; // Writes were sent, closing waits for the host to confirm them
+
+	// Serializes the game's threads and the I/O thread on this file
+	OSMutex mutex;
+} RedirectedFile;
+
+void initRedirectedFiles();
+void clearRedirectedFiles();
+
+bool canRedirectFile();
+RedirectedFile *addRedirectedFile(FSFileHandle handle);
+RedirectedFile *findRedirectedFile(FSFileHandle handle);
+void removeRedirectedFile(RedirectedFile *file);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
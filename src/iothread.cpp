@@ -0,0 +1,188 @@
+#include <malloc.h>
+#include <string.h>
+
+#include <atomic>
+
+#include <coreinit/messagequeue.h>
+#include <coreinit/mutex.h>
+#include <coreinit/thread.h>
+#include <utils/logger.h>
+
+#include "iothread.h"
+
+#define MAX_ASYNC_REQUESTS   32
+#define IO_THREAD_STACK_SIZE 0x8000
+#define IO_THREAD_PRIORITY   15 // Just above the default, so queued I/O starts promptly
+
+// Jobs CafeLoader queues from its own static requests (reload.cpp,
+// prefetch.cpp, one per SD cache fill and the SD cache index), each one is
+// queued at most once at a time
+#define MAX_STATIC_REQUESTS (2 + 4 + 1)
+
+// Results handed to a message queue are read by the game some time after we
+// posted them, so they live in a ring larger than the request pool
+#define MAX_ASYNC_RESULTS (MAX_ASYNC_REQUESTS * 2)
+
+// Value coreinit puts in OSMessage::args[2] for FS completions
+#define FS_ASYNC_MESSAGE_TYPE 10
+
+static AsyncRequest requests[MAX_ASYNC_REQUESTS];
+static OSMessage pendingMessages[MAX_ASYNC_REQUESTS + MAX_STATIC_REQUESTS + 1];
+static OSMessage freeMessages[MAX_ASYNC_REQUESTS];
+static OSMessageQueue pendingQueue;
+static OSMessageQueue freeQueue;
+
+static FSAsyncResult results[MAX_ASYNC_RESULTS];
+static std::atomic<uint32_t> nextResult;
+
+// Without the thread, requests are served on the caller's thread from this
+// one, which the mutex hands to one caller at a time
+static AsyncRequest inlineRequest;
+static OSMutex inlineMutex;
+
+static OSThread thread __attribute__((aligned(8)));
+static void *stack = NULL;
+static bool running = false;
+
+static int ioThreadMain(int argc, const char **argv) {
+	OSMessage message;
+	while (true) {
+		OSReceiveMessage(&pendingQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+
+		AsyncRequest *request = (AsyncRequest *)message.message;
+		if (!request)
+			break;
+
+		request->run(request);
+	}
+
+	return 0;
+}
+
+void initIoThread() {
+	OSInitMutex(&inlineMutex);
+}
+
+void startIoThread() {
+	if (running)
+		return;
+
+	OSInitMessageQueue(&pendingQueue, pendingMessages, MAX_ASYNC_REQUESTS + MAX_STATIC_REQUESTS + 1);
+	OSInitMessageQueue(&freeQueue, freeMessages, MAX_ASYNC_REQUESTS);
+	for (uint32_t i = 0; i < MAX_ASYNC_REQUESTS; i++) {
+		OSMessage message = {};
+		message.message = &requests[i];
+		OSSendMessage(&freeQueue, &message, OS_MESSAGE_FLAGS_NONE);
+	}
+
+	stack = memalign(0x20, IO_THREAD_STACK_SIZE);
+	if (!stack)
+		return;
+
+	if (!OSCreateThread(&thread, ioThreadMain, 0, NULL, (char *)stack + IO_THREAD_STACK_SIZE,
+	                    IO_THREAD_STACK_SIZE, IO_THREAD_PRIORITY, OS_THREAD_ATTRIB_AFFINITY_ANY)) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to create the I/O thread");
+		free(stack);
+		stack = NULL;
+		return;
+	}
+
+	OSSetThreadName(&thread, "CafeLoader I/O");
+	OSResumeThread(&thread);
+	running = true;
+}
+
+void stopIoThread() {
+	if (!running)
+		return;
+
+	// Requests still queued are served before the thread sees this
+	OSMessage message = {};
+	OSSendMessage(&pendingQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+
+	int result;
+	OSJoinThread(&thread, &result);
+	free(stack);
+	stack = NULL;
+	running = false;
+}
+
+bool isIoThreadRunning() {
+	return running;
+}
+
+// Blocks while every request is in flight, which throttles the caller the
+// same way running out of command blocks would
+AsyncRequest *allocAsyncRequest(AsyncRequestFn run, FSClient *client, FSCmdBlock *block,
+                                FSErrorFlag errorMask, FSAsyncData *asyncData) {
+	AsyncRequest *request;
+
+	if (running) {
+		OSMessage message;
+		OSReceiveMessage(&freeQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+		request = (AsyncRequest *)message.message;
+	} else {
+		// Released by freeAsyncRequest(), on this thread since it is served inline
+		OSLockMutex(&inlineMutex);
+		request = &inlineRequest;
+	}
+
+	memset(request, 0, sizeof(AsyncRequest));
+	request->run       = run;
+	request->client    = client;
+	request->block     = block;
+	request->errorMask = errorMask;
+	request->asyncData = *asyncData;
+	return request;
+}
+
+void freeAsyncRequest(AsyncRequest *request) {
+	if (request == &inlineRequest) {
+		OSUnlockMutex(&inlineMutex);
+		return;
+	}
+
+	if (request < requests || request >= requests + MAX_ASYNC_REQUESTS)
+		return;
+
+	OSMessage message = {};
+	message.message = request;
+	OSSendMessage(&freeQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+}
+
+void queueAsyncRequest(AsyncRequest *request) {
+	// Without the thread the request is served on the caller's thread
+	if (!running) {
+		request->run(request);
+		return;
+	}
+
+	OSMessage message = {};
+	message.message = request;
+	OSSendMessage(&pendingQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+}
+
+// Delivers the result the way the game asked for it: through its callback,
+// or as a message it passes to FSGetAsyncResult()
+void completeAsyncRequest(AsyncRequest *request, FSStatus status) {
+	FSAsyncData asyncData = request->asyncData;
+	FSClient *client = request->client;
+	FSCmdBlock *block = request->block;
+
+	// Free first so the callback can queue the next request right away
+	freeAsyncRequest(request);
+
+	if (asyncData.callback) {
+		asyncData.callback(client, block, status, asyncData.param);
+	} else if (asyncData.ioMsgQueue) {
+		FSAsyncResult *result = &results[nextResult++ % MAX_ASYNC_RESULTS];
+		memset(result, 0, sizeof(FSAsyncResult));
+		result->asyncData = asyncData;
+		result->client    = client;
+		result->block     = block;
+		result->status    = status;
+		result->ioMsg.message = result;
+		result->ioMsg.args[2] = FS_ASYNC_MESSAGE_TYPE;
+		OSSendMessage(asyncData.ioMsgQueue, &result->ioMsg, OS_MESSAGE_FLAGS_BLOCKING);
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <coreinit/filesystem.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct AsyncRequest AsyncRequest;
+typedef void (*AsyncRequestFn)(AsyncRequest *request);
+
+// An asynchronous FS call waiting to be served by the CafeLoader I/O thread.
+// Everything the caller handed in is copied, except for output pointers.
+struct AsyncRequest {
+	AsyncRequestFn run;
+
+	FSClient *client;
+	FSCmdBlock *block;
+	FSAsyncData asyncData;
+	FSErrorFlag errorMask;
+
+	FSFileHandle handle;
+	FSFileHandle *outHandle;
+	FSStat *stat;
+	uint8_t *buffer;
+	uint32_t size;
+	uint32_t count;
+	uint32_t pos;
+	uint32_t flags;
+
+	char path[MAX_PATH_LENGTH + 1];
+	char mode[8];
+
+	// Jobs CafeLoader queues for itself keep their state here
+	void *context;
+};
+
+void initIoThread();
+void startIoThread();
+void stopIoThread();
+bool isIoThreadRunning();
+
+AsyncRequest *allocAsyncRequest(AsyncRequestFn run, FSClient *client, FSCmdBlock *block,
+                                FSErrorFlag errorMask, FSAsyncData *asyncData);
+void freeAsyncRequest(AsyncRequest *request);
+
+void queueAsyncRequest(AsyncRequest *request);
+void completeAsyncRequest(AsyncRequest *request, FSStatus status);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,690 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <coreinit/cache.h>
+#include <coreinit/memorymap.h>
+#include <coreinit/messagequeue.h>
+#include <coreinit/thread.h>
+#include <kernel/kernel.h>
+#include <utils/logger.h>
+
+#include "bufferpool.h"
+#include "checksum.h"
+#include "globals.h"
+#include "loader.h"
+
+// Runs closer than this share one cache maintenance call, flushing the few
+// untouched lines in between is cheaper than another call
+#define FLUSH_GAP 0x400
+
+// Targets are compared with what is being loaded a cache line at a time, and
+// only the lines that differ are copied
+#define DIFF_BLOCK 0x20
+
+#define STREAM_STACK_SIZE 0x2000
+#define STREAM_PRIORITY   15
+
+LoaderStats loaderStats;
+
+// Only recorded while connected to the host, nothing else reloads them
+static LoadedImage loadedImages[2]; // SECTION_CODE, SECTION_DATA
+
+// The part of a target that was actually written
+typedef struct ChangedRange {
+	uint32_t start;
+	uint32_t end;
+	uint32_t bytes;
+} ChangedRange;
+
+typedef struct PatchEntry {
+	uint32_t addr;
+	uint32_t length;
+	uint32_t order; // Position in the file, later entries win where they overlap
+	const char *data;
+} PatchEntry;
+
+typedef struct PatchRun {
+	uint32_t addr;
+	uint32_t length;
+	uint32_t offset; // Into the staging buffer
+} PatchRun;
+
+static int compareAddress(const void *a, const void *b) {
+	const PatchEntry *left = (const PatchEntry *)a, *right = (const PatchEntry *)b;
+	if (left->addr != right->addr)
+		return left->addr < right->addr ? -1 : 1;
+	return left->order < right->order ? -1 : 1;
+}
+
+static int compareOrder(const void *a, const void *b) {
+	return ((const PatchEntry *)a)->order < ((const PatchEntry *)b)->order ? -1 : 1;
+}
+
+// Patches.hax is u16 count, followed by count entries of u16 length,
+// u32 address and the bytes to write there. Returns the number of entries,
+// or -1 if one of them runs past the end of the buffer.
+static int parsePatches(const char *buffer, uint32_t length, PatchEntry *entries) {
+	uint16_t count = *(uint16_t *)buffer;
+	uint32_t offset = 2;
+	int parsed = 0;
+
+	for (uint16_t i = 0; i < count; i++) {
+		if (length - offset < 6)
+			return -1;
+
+		uint16_t bytes = *(uint16_t *)(buffer + offset);
+		uint32_t addr  = *(uint32_t *)(buffer + offset + 2);
+		offset += 6;
+
+		if (length - offset < bytes || addr + bytes < addr)
+			return -1;
+
+		if (bytes) {
+			entries[parsed].addr   = addr;
+			entries[parsed].length = bytes;
+			entries[parsed].order  = i;
+			entries[parsed].data   = buffer + offset;
+			parsed++;
+		}
+		offset += bytes;
+	}
+
+	return parsed;
+}
+
+// Merges the sorted entries into runs of overlapping or adjacent ranges and
+// returns the number of runs. Each run gets its own part of the staging
+// buffer, `*staged` is set to the total size.
+static uint32_t mergeRuns(const PatchEntry *entries, uint32_t count, PatchRun *runs, uint32_t *staged) {
+	uint32_t runCount = 0;
+	*staged = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t end = entries[i].addr + entries[i].length;
+		PatchRun *run = runCount ? &runs[runCount - 1] : NULL;
+
+		if (run && entries[i].addr <= run->addr + run->length) {
+			if (end > run->addr + run->length) {
+				*staged += end - (run->addr + run->length);
+				run->length = end - run->addr;
+			}
+			continue;
+		}
+
+		run = &runs[runCount++];
+		run->addr   = entries[i].addr;
+		run->length = entries[i].length;
+		run->offset = *staged;
+		*staged += run->length;
+	}
+
+	return runCount;
+}
+
+static void copyRange(uint32_t dest, const char *source, uint32_t length, ChangedRange *changed) {
+	KernelCopyData(OSEffectiveToPhysical(dest), OSEffectiveToPhysical((uint32_t)source), length);
+
+	if (dest < changed->start)
+		changed->start = dest;
+	if (dest + length > changed->end)
+		changed->end = dest + length;
+	changed->bytes += length;
+	loaderStats.bytesWritten += length;
+}
+
+// Copies the lines of `length` bytes at source that differ from what dest
+// already holds, so reloading the same image into the same memory writes
+// nothing. Source has to be flushed already.
+static void copyChanged(uint32_t dest, const char *source, uint32_t length, ChangedRange *changed) {
+	uint32_t offset = 0, spanStart = 0;
+	bool inSpan = false;
+
+	while (offset < length) {
+		uint32_t n = DIFF_BLOCK - ((dest + offset) & (DIFF_BLOCK - 1));
+		if (n > length - offset)
+			n = length - offset;
+
+		bool differs = memcmp((const void *)(dest + offset), source + offset, n) != 0;
+		if (differs && !inSpan) {
+			spanStart = offset;
+			inSpan = true;
+		} else if (!differs && inSpan) {
+			copyRange(dest + spanStart, source + spanStart, offset - spanStart, changed);
+			inSpan = false;
+		}
+		offset += n;
+	}
+
+	if (inSpan)
+		copyRange(dest + spanStart, source + spanStart, length - spanStart, changed);
+
+	loaderStats.bytesCompared += length;
+}
+
+static PatchRun *findRun(PatchRun *runs, uint32_t count, uint32_t addr) {
+	uint32_t low = 0, high = count;
+	while (high - low > 1) {
+		uint32_t mid = (low + high) / 2;
+		if (runs[mid].addr <= addr)
+			low = mid;
+		else
+			high = mid;
+	}
+	return &runs[low];
+}
+
+// Flushes and invalidates the caches over the runs, with runs close to each
+// other handled by a single call
+static void flushRuns(const PatchRun *runs, uint32_t count) {
+	uint32_t start = runs[0].addr;
+	uint32_t end   = runs[0].addr + runs[0].length;
+
+	for (uint32_t i = 1; i <= count; i++) {
+		if (i < count && runs[i].addr - end <= FLUSH_GAP) {
+			end = runs[i].addr + runs[i].length;
+			continue;
+		}
+
+		ICInvalidateRange((void *)start, end - start);
+		DCFlushRange((void *)start, end - start);
+
+		if (i < count) {
+			start = runs[i].addr;
+			end   = runs[i].addr + runs[i].length;
+		}
+	}
+}
+
+// Applies Patches.hax with one kernel copy per contiguous run instead of one
+// per entry, followed by a single cache maintenance pass. Nothing is written
+// if any entry is malformed.
+bool applyPatches(const char *buffer, uint32_t length) {
+	if (length < 2)
+		return false;
+
+	uint16_t count = *(uint16_t *)buffer;
+	if (count == 0)
+		return true;
+
+	PatchEntry *entries = (PatchEntry *)allocPoolBuffer(POOL_LOADER, count * sizeof(PatchEntry));
+	PatchRun *runs = (PatchRun *)allocPoolBuffer(POOL_LOADER, count * sizeof(PatchRun));
+	char *staging = NULL;
+	bool ok = false;
+
+	int parsed = entries && runs ? parsePatches(buffer, length, entries) : -1;
+	ok = parsed == 0;
+	if (parsed < 0) {
+		DEBUG_FUNCTION_LINE_ERR("Patches.hax is malformed, not applying it");
+	} else if (parsed > 0) {
+		uint32_t staged;
+		qsort(entries, parsed, sizeof(PatchEntry), compareAddress);
+		uint32_t runCount = mergeRuns(entries, parsed, runs, &staged);
+
+		// Entries are staged in the order of the file, so overlapping ones
+		// resolve the same way as when they were written one by one
+		qsort(entries, parsed, sizeof(PatchEntry), compareOrder);
+
+		staging = (char *)allocPoolBuffer(POOL_LOADER, staged);
+		if (staging) {
+			for (int i = 0; i < parsed; i++) {
+				PatchRun *run = findRun(runs, runCount, entries[i].addr);
+				memcpy(staging + run->offset + (entries[i].addr - run->addr), entries[i].data, entries[i].length);
+			}
+
+			ChangedRange changed = { 0xFFFFFFFF, 0, 0 };
+			DCFlushRange(staging, staged);
+			for (uint32_t i = 0; i < runCount; i++)
+				copyChanged(runs[i].addr, staging + runs[i].offset, runs[i].length, &changed);
+
+			if (changed.bytes)
+				flushRuns(runs, runCount);
+			DEBUG_FUNCTION_LINE("Applied %d patches in %u runs, %u of %u bytes changed", parsed, runCount, changed.bytes, staged);
+			ok = true;
+		}
+	}
+
+	freePoolBuffer(staging);
+	freePoolBuffer(runs);
+	freePoolBuffer(entries);
+	return ok;
+}
+
+// An image being read from the SD card by a helper thread, one buffer at a
+// time, while the other one is copied into place
+typedef struct ImageStream {
+	int fd;
+	uint32_t remaining;
+	uint32_t chunkSize;
+	uint32_t crc;
+	uint32_t offset;
+	LoadedImage *image; // Gets the CRC of each block, if not NULL
+	ChangedRange changed;
+	bool failed;
+
+	OSMessageQueue freeQueue;
+	OSMessageQueue fullQueue;
+	OSMessage freeMessages[2];
+	OSMessage fullMessages[2];
+} ImageStream;
+
+static bool readAll(int fd, char *data, uint32_t length) {
+	while (length) {
+		int num = read(fd, data, length);
+		if (num <= 0)
+			return false;
+		data += num;
+		length -= num;
+	}
+	return true;
+}
+
+static void recordBlocks(LoadedImage *image, uint32_t offset, const char *source, uint32_t length) {
+	while (length) {
+		uint32_t block = offset / IMAGE_BLOCK_SIZE;
+		uint32_t n = IMAGE_BLOCK_SIZE - offset % IMAGE_BLOCK_SIZE;
+		if (n > length)
+			n = length;
+
+		image->blockCrcs[block] = crc32(image->blockCrcs[block], source, n);
+		offset += n;
+		source += n;
+		length -= n;
+	}
+}
+
+static void copyChunk(ImageStream *stream, uint32_t dest, char *source, uint32_t length) {
+	stream->crc = crc32(stream->crc, source, length);
+	if (stream->image)
+		recordBlocks(stream->image, stream->offset, source, length);
+	stream->offset += length;
+	DCFlushRange(source, length);
+	copyChanged(dest, source, length, &stream->changed);
+}
+
+// Hands back filled buffers with their length in args[0], 0 ends the stream
+static int streamReader(int argc, const char **argv) {
+	ImageStream *stream = (ImageStream *)argv;
+	OSMessage message;
+
+	while (true) {
+		OSReceiveMessage(&stream->freeQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+
+		uint32_t length = stream->remaining < stream->chunkSize ? stream->remaining : stream->chunkSize;
+		if (length && !readAll(stream->fd, (char *)message.message, length)) {
+			stream->failed = true;
+			length = 0;
+		}
+
+		stream->remaining -= length;
+		message.args[0] = length;
+		OSSendMessage(&stream->fullQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+
+		if (length == 0)
+			return 0;
+	}
+}
+
+// Copies `size` bytes of fd to dest with a single buffer
+static uint32_t loadSequential(ImageStream *stream, char *buffer, uint32_t dest) {
+	uint32_t copied = 0;
+	while (stream->remaining) {
+		uint32_t length = stream->remaining < stream->chunkSize ? stream->remaining : stream->chunkSize;
+		if (!readAll(stream->fd, buffer, length))
+			break;
+
+		copyChunk(stream, dest + copied, buffer, length);
+		stream->remaining -= length;
+		copied += length;
+	}
+	return copied;
+}
+
+// Images are loaded one at a time, so a single reader thread is enough
+static OSThread streamThread __attribute__((aligned(8)));
+static char streamStack[STREAM_STACK_SIZE] __attribute__((aligned(0x20)));
+
+// Reads chunk N + 1 on a helper thread while chunk N is copied into place
+static uint32_t loadStreamed(ImageStream *stream, char **buffers, uint32_t dest) {
+	OSInitMessageQueue(&stream->freeQueue, stream->freeMessages, 2);
+	OSInitMessageQueue(&stream->fullQueue, stream->fullMessages, 2);
+
+	if (!OSCreateThread(&streamThread, streamReader, 0, (char *)stream, streamStack + STREAM_STACK_SIZE,
+	                    STREAM_STACK_SIZE, STREAM_PRIORITY, OS_THREAD_ATTRIB_AFFINITY_ANY))
+		return loadSequential(stream, buffers[0], dest);
+
+	for (int i = 0; i < 2; i++) {
+		OSMessage message = {};
+		message.message = buffers[i];
+		OSSendMessage(&stream->freeQueue, &message, OS_MESSAGE_FLAGS_NONE);
+	}
+
+	OSSetThreadName(&streamThread, "CafeLoader Image Reader");
+	OSResumeThread(&streamThread);
+
+	uint32_t copied = 0;
+	OSMessage message;
+	while (true) {
+		OSReceiveMessage(&stream->fullQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+		uint32_t length = message.args[0];
+		if (length == 0)
+			break;
+
+		copyChunk(stream, dest + copied, (char *)message.message, length);
+		copied += length;
+		OSSendMessage(&stream->freeQueue, &message, OS_MESSAGE_FLAGS_BLOCKING);
+	}
+
+	int result;
+	OSJoinThread(&streamThread, &result);
+	return copied;
+}
+
+static LoadedImage *imageForType(uint32_t type) {
+	if (type != SECTION_CODE && type != SECTION_DATA)
+		return NULL;
+	return &loadedImages[type - SECTION_CODE];
+}
+
+// Starts recording the blocks of an image of `type` about to be loaded
+static LoadedImage *beginLoadedImage(uint32_t type, uint32_t address, uint32_t size) {
+	LoadedImage *image = imageForType(type);
+	if (!image || !clientEnabled)
+		return NULL;
+
+	free(image->blockCrcs);
+	image->address    = address;
+	image->size       = size;
+	image->blockCount = (size + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+	image->blockCrcs  = (uint32_t *)calloc(image->blockCount ? image->blockCount : 1, sizeof(uint32_t));
+	if (!image->blockCrcs) {
+		image->size = image->blockCount = 0;
+		return NULL;
+	}
+	return image;
+}
+
+void clearLoadedImages() {
+	for (LoadedImage &image : loadedImages) {
+		free(image.blockCrcs);
+		image = {};
+	}
+}
+
+// NULL if no image of `type` was loaded while connected
+LoadedImage *findLoadedImage(uint32_t type) {
+	LoadedImage *image = imageForType(type);
+	return image && image->blockCrcs ? image : NULL;
+}
+
+// Makes the image `size` bytes long. Blocks it grows by get the CRC of what
+// memory holds there now, so a reload leaves them alone if they match.
+bool resizeLoadedImage(LoadedImage *image, uint32_t size) {
+	uint32_t blockCount = (size + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+	if (blockCount > image->blockCount) {
+		uint32_t *grown = (uint32_t *)realloc(image->blockCrcs, blockCount * sizeof(uint32_t));
+		if (!grown)
+			return false;
+
+		image->blockCrcs = grown;
+		for (uint32_t i = image->blockCount; i < blockCount; i++) {
+			uint32_t offset = i * IMAGE_BLOCK_SIZE;
+			uint32_t n = size - offset < IMAGE_BLOCK_SIZE ? size - offset : IMAGE_BLOCK_SIZE;
+			image->blockCrcs[i] = crc32(0, (const char *)(image->address + offset), n);
+		}
+	}
+
+	image->size = size;
+	image->blockCount = blockCount;
+	return true;
+}
+
+// Writes whole blocks of a new version of the image, `blocks` holds
+// IMAGE_BLOCK_SIZE bytes for each index, the last block of the image is
+// cut to its size. Only lines that differ are written, with one cache
+// maintenance pass at the end. Returns the number of bytes written.
+uint32_t updateImageBlocks(LoadedImage *image, const uint32_t *indices, const char *blocks, uint32_t count) {
+	ChangedRange changed = { 0xFFFFFFFF, 0, 0 };
+	DCFlushRange((void *)blocks, count * IMAGE_BLOCK_SIZE);
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (indices[i] >= image->blockCount)
+			continue;
+
+		uint32_t offset = indices[i] * IMAGE_BLOCK_SIZE;
+		uint32_t n = image->size - offset < IMAGE_BLOCK_SIZE ? image->size - offset : IMAGE_BLOCK_SIZE;
+		const char *source = blocks + i * IMAGE_BLOCK_SIZE;
+
+		copyChanged(image->address + offset, source, n, &changed);
+		image->blockCrcs[indices[i]] = crc32(0, source, n);
+	}
+
+	if (changed.bytes) {
+		ICInvalidateRange((void *)changed.start, changed.end - changed.start);
+		DCFlushRange((void *)changed.start, changed.end - changed.start);
+	}
+	return changed.bytes;
+}
+
+// Streams `size` bytes from the current position of fd to dest and stores
+// their CRC-32 in `*crc`. Goes through the slabs of POOL_LOADER, which
+// share loaderMemoryLimit, however large the image.
+static uint32_t streamImage(int fd, uint32_t size, uint32_t dest, uint32_t type, uint32_t *crc) {
+	ImageStream stream = {};
+	stream.fd = fd;
+	stream.remaining = size;
+	stream.image = beginLoadedImage(type, dest, size);
+	stream.changed.start = 0xFFFFFFFF;
+
+	stream.chunkSize = poolStats[POOL_LOADER].slabSize;
+	bool streamed = size > stream.chunkSize;
+	if (!streamed)
+		stream.chunkSize = size ? size : 1;
+
+	char *buffers[2] = {
+		(char *)allocPoolSlab(POOL_LOADER),
+		streamed ? (char *)allocPoolSlab(POOL_LOADER) : NULL,
+	};
+
+	uint32_t copied = 0;
+	if (buffers[0] && buffers[1])
+		copied = loadStreamed(&stream, buffers, dest);
+	else if (buffers[0])
+		copied = loadSequential(&stream, buffers[0], dest);
+
+	freePoolBuffer(buffers[1]);
+	freePoolBuffer(buffers[0]);
+
+	// One pass over everything that changed rather than one per chunk
+	if (stream.changed.bytes) {
+		ICInvalidateRange((void *)stream.changed.start, stream.changed.end - stream.changed.start);
+		DCFlushRange((void *)stream.changed.start, stream.changed.end - stream.changed.start);
+	}
+
+	DEBUG_FUNCTION_LINE("Loaded %u bytes to %08X, %u of them changed", copied, dest, stream.changed.bytes);
+	*crc = stream.crc;
+	return copied;
+}
+
+// Streams the file at `path` to dest, `type` is SECTION_CODE or SECTION_DATA
+bool loadImage(const char *path, uint32_t dest, uint32_t type) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) < 0) {
+		close(fd);
+		return false;
+	}
+
+	uint32_t crc;
+	uint32_t size = fileStat.st_size;
+	uint32_t copied = streamImage(fd, size, dest, type, &crc);
+	close(fd);
+
+	if (copied != size)
+		DEBUG_FUNCTION_LINE_ERR("Only loaded %u of %u bytes of %s", copied, size, path);
+
+	return copied == size;
+}
+
+// Stores the address of WHBLogPrintf in the word before the data image,
+// which is where the patch code looks for it
+void exportLogger(uint32_t dataAddr) {
+	void *debugPtr = (void *)&WHBLogPrintf;
+	DCFlushRange(&debugPtr, sizeof(debugPtr));
+	KernelCopyData(OSEffectiveToPhysical(dataAddr - 4), OSEffectiveToPhysical((uint32_t)&debugPtr), sizeof(debugPtr));
+
+	ICInvalidateRange((void *)(dataAddr - 4), sizeof(debugPtr));
+	DCFlushRange((void *)(dataAddr - 4), sizeof(debugPtr));
+	DEBUG_FUNCTION_LINE("WHBLogPrintf address: %p", debugPtr);
+}
+
+static const PackageSection *findSection(const PackageHeader *header, uint32_t type) {
+	for (uint16_t i = 0; i < header->sectionCount; i++) {
+		if (header->sections[i].type == type)
+			return &header->sections[i];
+	}
+	return NULL;
+}
+
+// Reads a whole section into memory, checking it against its CRC-32.
+// Release it with freePoolBuffer().
+static char *readSection(int fd, const PackageSection *section) {
+	char *buffer = (char *)allocPoolBuffer(POOL_LOADER, section->size);
+	if (!buffer)
+		return NULL;
+
+	if (lseek(fd, section->offset, SEEK_SET) < 0 || !readAll(fd, buffer, section->size) ||
+	    crc32(0, buffer, section->size) != section->crc) {
+		freePoolBuffer(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+// Reads a section through a loader chunk just for its CRC-32, so nothing is
+// written anywhere until the whole package is known to be intact
+static bool checkSection(int fd, const PackageSection *section) {
+	uint32_t chunkSize = poolStats[POOL_LOADER].slabSize;
+	char *buffer = (char *)allocPoolBuffer(POOL_LOADER, chunkSize);
+	if (!buffer || lseek(fd, section->offset, SEEK_SET) < 0) {
+		freePoolBuffer(buffer);
+		return false;
+	}
+
+	uint32_t crc = 0;
+	uint32_t remaining = section->size;
+	while (remaining) {
+		uint32_t n = remaining < chunkSize ? remaining : chunkSize;
+		if (!readAll(fd, buffer, n))
+			break;
+		crc = crc32(crc, buffer, n);
+		remaining -= n;
+	}
+
+	freePoolBuffer(buffer);
+	return remaining == 0 && crc == section->crc;
+}
+
+static bool loadSection(int fd, const PackageSection *section) {
+	if (lseek(fd, section->offset, SEEK_SET) < 0)
+		return false;
+
+	uint32_t crc;
+	return streamImage(fd, section->size, section->address, section->type, &crc) == section->size && crc == section->crc;
+}
+
+static bool checkHeader(const PackageHeader *header, uint32_t fileSize) {
+	if (header->magic != PACKAGE_MAGIC || header->version != PACKAGE_VERSION ||
+	    header->sectionCount > MAX_PACKAGE_SECTIONS)
+		return false;
+
+	for (uint16_t i = 0; i < header->sectionCount; i++) {
+		const PackageSection *section = &header->sections[i];
+		if (section->offset > fileSize || section->size > fileSize - section->offset)
+			return false;
+	}
+	return true;
+}
+
+// Loads a .cafepkg: code and data are streamed to their addresses, then the
+// patches are applied and the constructors run. Every section is checked
+// against its CRC-32 before any of them is written, so a corrupt package
+// leaves memory as it was. Returns false if there is no valid package, or
+// it could not be loaded after all, in which case the loose files are used
+// instead.
+bool loadPackage(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	// The header and the whole section table in one read
+	PackageHeader header = {};
+	struct stat fileStat;
+	int headerLength = read(fd, &header, sizeof(header));
+	if (fstat(fd, &fileStat) < 0 || headerLength < PACKAGE_HEADER_SIZE ||
+	    (uint32_t)headerLength < PACKAGE_HEADER_SIZE + header.sectionCount * sizeof(PackageSection) ||
+	    !checkHeader(&header, fileStat.st_size)) {
+		DEBUG_FUNCTION_LINE_ERR("%s is not a valid package", path);
+		close(fd);
+		return false;
+	}
+
+	const PackageSection *code    = findSection(&header, SECTION_CODE);
+	const PackageSection *data    = findSection(&header, SECTION_DATA);
+	const PackageSection *patches = findSection(&header, SECTION_PATCHES);
+	const PackageSection *ctors   = findSection(&header, SECTION_CTORS);
+
+	for (uint16_t i = 0; i < header.sectionCount; i++) {
+		if (!checkSection(fd, &header.sections[i])) {
+			DEBUG_FUNCTION_LINE_ERR("Section %u of %s is corrupt", i, path);
+			close(fd);
+			return false;
+		}
+	}
+
+	// Only a read error can still get in the way from here on
+	bool ok = true;
+	if (code && !loadSection(fd, code)) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to load the code section of %s", path);
+		ok = false;
+	}
+
+	if (ok && data) {
+		if (loadSection(fd, data)) {
+			exportLogger(data->address);
+		} else {
+			DEBUG_FUNCTION_LINE_ERR("Failed to load the data section of %s", path);
+			ok = false;
+		}
+	}
+
+	if (ok && patches) {
+		char *buffer = readSection(fd, patches);
+		ok = buffer && applyPatches(buffer, patches->size);
+		if (!buffer)
+			DEBUG_FUNCTION_LINE_ERR("Failed to read the patch section of %s", path);
+		freePoolBuffer(buffer);
+	}
+
+	if (ok && ctors) {
+		uint32_t *table = (uint32_t *)readSection(fd, ctors);
+		if (table) {
+			for (uint32_t i = 0; i < ctors->size / 4; i++)
+				((void (*)())table[i])();
+		} else {
+			DEBUG_FUNCTION_LINE_ERR("Failed to read the constructor section of %s", path);
+			ok = false;
+		}
+		freePoolBuffer(table);
+	}
+
+	close(fd);
+	if (ok)
+		DEBUG_FUNCTION_LINE("Loaded %s with %u sections", path, header.sectionCount);
+	return ok;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// A .cafepkg replaces Addr.bin, Code.bin, Data.bin and Patches.hax with a
+// single file. All fields are big-endian and every section starts on a
+// PACKAGE_ALIGN boundary, cafepkg.py builds them.
+#define PACKAGE_MAGIC        0x43504B47 // "CPKG"
+#define PACKAGE_VERSION      1
+#define PACKAGE_ALIGN        0x40
+#define PACKAGE_HEADER_SIZE  16
+#define MAX_PACKAGE_SECTIONS 8
+
+#define SECTION_CODE    1
+#define SECTION_DATA    2
+#define SECTION_PATCHES 3 // In the Patches.hax format
+#define SECTION_CTORS   4 // u32 addresses of functions to call once everything is in place
+
+typedef struct PackageSection {
+	uint32_t type;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t address; // Where code and data are loaded, unused otherwise
+	uint32_t crc;     // CRC-32 of the section's bytes
+	uint32_t reserved[3];
+} PackageSection;
+
+typedef struct PackageHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sectionCount;
+	uint32_t reserved[2];
+	PackageSection sections[MAX_PACKAGE_SECTIONS];
+} PackageHeader;
+
+// Code and data images keep the CRC-32 of every block of what was loaded,
+// so a live reload only has to fetch the blocks that differ, see reload.cpp
+#define IMAGE_BLOCK_SIZE 0x100
+
+typedef struct LoadedImage {
+	uint32_t address;
+	uint32_t size;
+	uint32_t blockCount;
+	uint32_t *blockCrcs;
+} LoadedImage;
+
+typedef struct LoaderStats {
+	uint32_t bytesCompared; // Loaded bytes checked against their target
+	uint32_t bytesWritten;  // The part of them that differed and was copied
+} LoaderStats;
+
+extern LoaderStats loaderStats;
+
+bool applyPatches(const char *buffer, uint32_t length);
+bool loadImage(const char *path, uint32_t dest, uint32_t type);
+void exportLogger(uint32_t dataAddr);
+bool loadPackage(const char *path);
+
+void clearLoadedImages();
+LoadedImage *findLoadedImage(uint32_t type);
+bool resizeLoadedImage(LoadedImage *image, uint32_t size);
+uint32_t updateImageBlocks(LoadedImage *image, const uint32_t *indices, const char *blocks, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
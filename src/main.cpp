@@ -1,4 +1,5 @@
 #include <string>
+#include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -13,13 +14,27 @@
 #include <whb/crash.h>
 #include <wups.h>
 #include <wups/config/WUPSConfigItemBoolean.h>
+#include <wups/config/WUPSConfigItemIntegerRange.h>
+#include <wups/config/WUPSConfigItemStub.h>
 #include <wups/storage.h>
 #include <notifications/notifications.h>
 
 
 #include "utils/logger.h"
+#include "bufferpool.h"
+#include "channel.h"
 #include "globals.h"
 #include "handler.h"
+#include "handles.h"
+#include "iothread.h"
+#include "loader.h"
+#include "manifest.h"
+#include "overlay.h"
+#include "prefetch.h"
+#include "reload.h"
+#include "sdcache.h"
+#include "stats.h"
+#include "filesocket.h"
 
 #define FS_MAX_LOCALPATH_SIZE           511
 #define FS_MAX_MOUNTPATH_SIZE           128
@@ -27,6 +42,11 @@
 
 #define ENABLED_CONFIG_ID "enabled"
 #define NOTIFICATIONS_CONFIG_ID "notifications"
+#define READ_AHEAD_BLOCK_SIZE_CONFIG_ID "readAheadBlockSize"
+#define READ_AHEAD_BUDGET_CONFIG_ID "readAheadBudget"
+#define SD_CACHE_LIMIT_CONFIG_ID "sdCacheLimit"
+#define PREFETCH_BUDGET_CONFIG_ID "prefetchBudget"
+#define LOADER_MEMORY_LIMIT_CONFIG_ID "loaderMemoryLimit"
 
 WUPS_PLUGIN_NAME("CafeLoader");
 WUPS_PLUGIN_DESCRIPTION("Loader for custom code.");
@@ -38,8 +58,22 @@ WUPS_USE_WUT_DEVOPTAB();
 WUPS_USE_STORAGE("cafeloader");
 
 bool clientEnabled;
-FSFileHandle file;
-int fd;
+bool overlayEnabled;
+int fd = -1; // Open from the handshake to the end of the title, even if the host is lost
+uint32_t protocolVersion;
+uint32_t capabilities;
+
+#define DEFAULT_READ_AHEAD_BLOCK_SIZE 0x10000
+#define DEFAULT_READ_AHEAD_BUDGET     0x100000
+#define DEFAULT_SD_CACHE_LIMIT        0x10000000
+#define DEFAULT_PREFETCH_BUDGET       0x200000
+#define DEFAULT_LOADER_MEMORY_LIMIT   0x40000
+
+uint32_t readAheadBlockSize = DEFAULT_READ_AHEAD_BLOCK_SIZE;
+uint32_t readAheadBudget    = DEFAULT_READ_AHEAD_BUDGET;
+uint32_t sdCacheLimit       = DEFAULT_SD_CACHE_LIMIT;   // 0 disables the SD cache
+uint32_t prefetchBudget     = DEFAULT_PREFETCH_BUDGET;  // 0 disables prefetching
+uint32_t loaderMemoryLimit  = DEFAULT_LOADER_MEMORY_LIMIT; // Buffers for streaming Code.bin and Data.bin
 
 bool enabled = true;
 bool notifications = true;
@@ -63,40 +97,106 @@ int exists(const char *fname) {
 
 uint32_t getFileLength(const char *fname) {
     struct stat fileStat;
-    stat(fname, &fileStat);
+    if (stat(fname, &fileStat) < 0)
+        return 0;
     uint32_t length = fileStat.st_size;
 
     return length;
 }
 
-char * readBuf(const char *fname, int f) {
-    char *buffer = 0;
+// Reads all of the file, which must be at least `minLength` bytes long.
+// Returns NULL if it can't, release the buffer with freePoolBuffer().
+char * readBuf(const char *fname, int f, uint32_t minLength) {
     uint32_t length = getFileLength(fname);
-
-    buffer = (char *)malloc(length);
-    if (buffer)
-        read(f, buffer, length);
+    if (f < 0 || length < minLength)
+        return NULL;
+
+    char *buffer = (char *)allocPoolBuffer(POOL_LOADER, length);
+    if (!buffer)
+        return NULL;
+
+    for (uint32_t done = 0; done < length;) {
+        ssize_t num = read(f, buffer + done, length - done);
+        if (num <= 0) {
+            DEBUG_FUNCTION_LINE_ERR("Failed to read %s", fname);
+            freePoolBuffer(buffer);
+            return NULL;
+        }
+        done += num;
+    }
 
     return buffer;
 }
 
-void KernelCopyDataV(void *dest, void *source, uint32_t len) {
-    ICInvalidateRange(source, len);
-    DCFlushRange(source, len);
-
-    KernelCopyData(OSEffectiveToPhysical((uint32_t)dest), OSEffectiveToPhysical((uint32_t)source), len);
+void LoadSetting(const char *key, uint32_t *value) {
+    WUPSStorageError storageRes;
+    if ((storageRes = WUPSStorageAPI_GetU32(nullptr, key, value)) == WUPS_STORAGE_ERROR_NOT_FOUND) {
+        // Add the value to the storage if it is missing
+        if (WUPSStorageAPI_StoreU32(nullptr, key, *value) != WUPS_STORAGE_ERROR_SUCCESS) {
+            DEBUG_FUNCTION_LINE("Failed to store %s", key);
+        }
+    } else if (storageRes != WUPS_STORAGE_ERROR_SUCCESS) {
+        DEBUG_FUNCTION_LINE("Failed to get %s %s (%d)", key, WUPSStorageAPI_GetStatusStr(storageRes), storageRes);
+    }
+}
 
-    ICInvalidateRange(dest, len);
-    DCFlushRange(dest, len);
+// Memory and cache sizes, shown in the config menu in units of `unit` bytes.
+// The buffers are reserved when the plugin is loaded, so a change is only
+// stored and takes effect the next time the console starts.
+typedef struct SizeSetting {
+    const char *id;
+    const char *name;
+    uint32_t defaultValue;
+    uint32_t unit;
+    int32_t min;
+    int32_t max;
+} SizeSetting;
+
+static const SizeSetting sizeSettings[] = {
+    { READ_AHEAD_BLOCK_SIZE_CONFIG_ID, "Read-ahead block size (KB)",    DEFAULT_READ_AHEAD_BLOCK_SIZE, 0x400,    4, 1024  },
+    { READ_AHEAD_BUDGET_CONFIG_ID,     "Read-ahead memory (KB)",        DEFAULT_READ_AHEAD_BUDGET,     0x400,    0, 16384 },
+    { PREFETCH_BUDGET_CONFIG_ID,       "Prefetch memory (KB, 0 = off)", DEFAULT_PREFETCH_BUDGET,       0x400,    0, 16384 },
+    { LOADER_MEMORY_LIMIT_CONFIG_ID,   "Loader memory (KB)",            DEFAULT_LOADER_MEMORY_LIMIT,   0x400,    8, 4096  },
+    { SD_CACHE_LIMIT_CONFIG_ID,        "SD cache size (MB, 0 = off)",   DEFAULT_SD_CACHE_LIMIT,        0x100000, 0, 4095  },
+};
+
+static void SizeSettingChanged(ConfigItemIntegerRange *item, int32_t value) {
+    for (const SizeSetting &setting : sizeSettings) {
+        if (strcmp(item->identifier, setting.id) == 0) {
+            if (WUPSStorageAPI_StoreU32(nullptr, setting.id, (uint32_t)value * setting.unit) != WUPS_STORAGE_ERROR_SUCCESS)
+                DEBUG_FUNCTION_LINE("Failed to store %s", setting.id);
+            return;
+        }
+    }
 }
 
-void Patch(char *buffer) {
-    uint16_t count = *(uint16_t *)buffer; buffer += 2;
-    for (uint16_t i = 0; i < count; i++) {
-        uint16_t bytes = *(uint16_t *)buffer; buffer += 2;
-        uint32_t addr = *(uint32_t *)buffer; buffer += 4;
-        KernelCopyDataV((void *)addr, buffer, bytes); buffer += bytes;
+// The config menu has the settings, then the statistics of the running title
+#define MAX_STATS_LINES 20
+
+static WUPSConfigAPICallbackStatus ConfigMenuOpenedCallback(WUPSConfigCategoryHandle root) {
+    for (const SizeSetting &setting : sizeSettings) {
+        // What was last chosen, which may not be in use yet
+        uint32_t value = setting.defaultValue;
+        WUPSStorageAPI_GetU32(nullptr, setting.id, &value);
+
+        if (WUPSConfigItemIntegerRange_AddToCategory(root, setting.id, setting.name,
+                                                     setting.defaultValue / setting.unit, value / setting.unit,
+                                                     setting.min, setting.max, SizeSettingChanged) != WUPSCONFIG_API_RESULT_SUCCESS)
+            return WUPSCONFIG_API_CALLBACK_RESULT_ERROR;
     }
+
+    static char lines[MAX_STATS_LINES][STATS_LINE_LENGTH];
+    uint32_t count = summarizeStats(lines, MAX_STATS_LINES);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (WUPSConfigItemStub_AddToCategory(root, lines[i]) != WUPSCONFIG_API_RESULT_SUCCESS)
+            return WUPSCONFIG_API_CALLBACK_RESULT_ERROR;
+    }
+    return WUPSCONFIG_API_CALLBACK_RESULT_SUCCESS;
+}
+
+static void ConfigMenuClosedCallback() {
+    WUPSStorageAPI_SaveStorage(false);
 }
 
 void DeinitModules() {
@@ -109,6 +209,33 @@ INITIALIZE_PLUGIN() {
 
     NotificationModule_InitLibrary();
 
+    initChannel();
+    initIoThread();
+    initRedirectedFiles();
+    initSdCache();
+    initPrefetch();
+    initReload();
+    initStats();
+
+    WUPSConfigAPIOptionsV1 configOptions = { .name = "CafeLoader" };
+    if (WUPSConfigAPI_Init(configOptions, ConfigMenuOpenedCallback, ConfigMenuClosedCallback) != WUPSCONFIG_API_RESULT_SUCCESS)
+        DEBUG_FUNCTION_LINE_ERR("Failed to init the config menu");
+
+    LoadSetting(READ_AHEAD_BLOCK_SIZE_CONFIG_ID, &readAheadBlockSize);
+    LoadSetting(READ_AHEAD_BUDGET_CONFIG_ID, &readAheadBudget);
+    LoadSetting(SD_CACHE_LIMIT_CONFIG_ID, &sdCacheLimit);
+    LoadSetting(PREFETCH_BUDGET_CONFIG_ID, &prefetchBudget);
+    LoadSetting(LOADER_MEMORY_LIMIT_CONFIG_ID, &loaderMemoryLimit);
+
+    // Blocks are aligned to their size, so keep it a power of two
+    while (readAheadBlockSize & (readAheadBlockSize - 1))
+        readAheadBlockSize &= readAheadBlockSize - 1;
+    if (readAheadBlockSize < 0x1000)
+        readAheadBlockSize = 0x1000;
+
+    // Every large buffer CafeLoader needs is reserved here, once
+    initBufferPool();
+
     // Open storage to read values
     /*
     WUPSStorageError storageRes;
@@ -151,19 +278,21 @@ ON_APPLICATION_START() {
     initLogging();
     
     clientEnabled = false;
+    clearManifest();
+    clearRedirectedFiles();
+    clearLoadedImages();
 
-   // DEBUG_FUNCTION_LINE("Setting the ExceptionCallbacks\n");
-   // OSSetExceptionCallbackEx(OS_EXCEPTION_MODE_GLOBAL_ALL_CORES, OS_EXCEPTION_TYPE_DSI, DSIHandler_Fatal);
-   // OSSetExceptionCallbackEx(OS_EXCEPTION_MODE_GLOBAL_ALL_CORES, OS_EXCEPTION_TYPE_ISI, ISIHandler_Fatal);
-   // OSSetExceptionCallbackEx(OS_EXCEPTION_MODE_GLOBAL_ALL_CORES, OS_EXCEPTION_TYPE_PROGRAM, ProgramHandler_Fatal);
+    resetStats();
+    markPhase(PHASE_START);
 
-    char TitleIDString[FS_MAX_FULLPATH_SIZE];
+    char TitleIDString[FS_MAX_FULLPATH_SIZE] = {};
     snprintf(TitleIDString,FS_MAX_FULLPATH_SIZE,"%016llX",OSGetTitleID());
 
     std::string patchTitleIDPath = "fs:/vol/external01/cafeloader/";
     patchTitleIDPath += TitleIDString;
     DEBUG_FUNCTION_LINE("patchTitleIDPath: %s\n", patchTitleIDPath.c_str());
 
+    std::string packagePath = patchTitleIDPath + ".cafepkg";
     std::string patchesPath = patchTitleIDPath + "/Patches.hax";
     std::string addrPath    = patchTitleIDPath + "/Addr.bin";
     std::string codePath    = patchTitleIDPath + "/Code.bin";
@@ -173,92 +302,134 @@ ON_APPLICATION_START() {
     uint32_t CODE_ADDR;
     uint32_t DATA_ADDR;
 
-    uint32_t length = 0;
-    uint16_t reply = 0;
-
     if (clientEnabled == false && exists(ipPath.c_str())) {
         DEBUG_FUNCTION_LINE("IP file found!\n");
       //  Notify("IP file found!");
 
         int   ipFile   = open(ipPath.c_str(), O_RDONLY);
-        char *ipBuffer = readBuf(ipPath.c_str(), ipFile);
-
-        fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        struct sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = 2557;
-        serverAddr.sin_addr.s_addr = *(uint32_t *)ipBuffer;
-        connect(fd, (struct sockaddr *)&serverAddr, 16);
-
+        char *ipBuffer = readBuf(ipPath.c_str(), ipFile, 4);
         close(ipFile);
-        free(ipBuffer);
 
-        send(fd, "\x01", 1, 0);
-        send(fd, TitleIDString, FS_MAX_FULLPATH_SIZE, 0);
-        recv(fd, &reply, 2, 0);
-        if (reply == 0xCAFE) {
-            DEBUG_FUNCTION_LINE("Client connected!\n");
+        if (ipBuffer) {
+            fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            configureSocket(fd);
+            struct sockaddr_in serverAddr;
+            serverAddr.sin_family = AF_INET;
+            serverAddr.sin_port = 2557;
+            serverAddr.sin_addr.s_addr = *(uint32_t *)ipBuffer;
+            connect(fd, (struct sockaddr *)&serverAddr, 16);
+            freePoolBuffer(ipBuffer);
+        } else {
+            DEBUG_FUNCTION_LINE_ERR("ip.bin must hold the host's 4-byte IPv4 address");
+        }
+
+        if (fd >= 0 && handshake(TitleIDString)) {
+            DEBUG_FUNCTION_LINE("Client connected! (protocol v%u, capabilities %08X)\n", protocolVersion, capabilities);
            // Notify("Client connected!");
             clientEnabled = true;
-            file = 0;
+            startChannel();
+            startIoThread();
+            openSdCache(TitleIDString);
+            startPrefetch(TitleIDString);
+
+            // Crashes are only taken over when there is a host to report them to
+            DEBUG_FUNCTION_LINE("Setting the ExceptionCallbacks\n");
+            OSSetExceptionCallbackEx(OS_EXCEPTION_MODE_GLOBAL_ALL_CORES, OS_EXCEPTION_TYPE_DSI, DSIHandler_Fatal);
+            OSSetExceptionCallbackEx(OS_EXCEPTION_MODE_GLOBAL_ALL_CORES, OS_EXCEPTION_TYPE_ISI, ISIHandler_Fatal);
+            OSSetExceptionCallbackEx(OS_EXCEPTION_MODE_GLOBAL_ALL_CORES, OS_EXCEPTION_TYPE_PROGRAM, ProgramHandler_Fatal);
+        } else if (fd >= 0) {
+            close(fd);
+            fd = -1;
         }
+        markPhase(PHASE_CONNECTED);
+    }
+
+    // Without a host, replacement files can still come from the SD card
+    if (clientEnabled == false && openOverlay(TitleIDString)) {
+        Notify("SD overlay found!");
+        startIoThread();
+        markPhase(PHASE_OVERLAY);
     }
 
-    if (exists(patchesPath.c_str())) {
+    // A package holds everything in one file, the loose files are only
+    // looked for without one
+    bool packaged = loadPackage(packagePath.c_str());
+    if (packaged)
+        Notify("Code patches found!");
+    markPhase(PHASE_PACKAGE);
+
+    if (!packaged && exists(patchesPath.c_str())) {
         DEBUG_FUNCTION_LINE("Patches.hax found!\n");
        // Notify("Patches.hax found!");
 
         int   patchesFile   = open(patchesPath.c_str(), O_RDONLY);
-        char *patchesBuffer = readBuf(patchesPath.c_str(), patchesFile);
-        Patch(patchesBuffer);
+        char *patchesBuffer = readBuf(patchesPath.c_str(), patchesFile, 0);
+        if (patchesBuffer)
+            applyPatches(patchesBuffer, getFileLength(patchesPath.c_str()));
 
         close(patchesFile);
-        free(patchesBuffer);
+        freePoolBuffer(patchesBuffer);
 
         DEBUG_FUNCTION_LINE("Loaded Patches.hax!\n");
       //  Notify("Loaded Patches.hax!");
+        markPhase(PHASE_PATCHES);
     }
 
-    if (exists(addrPath.c_str()) && exists(codePath.c_str()) && exists(dataPath.c_str())) {
+    if (!packaged && exists(addrPath.c_str()) && exists(codePath.c_str()) && exists(dataPath.c_str())) {
         DEBUG_FUNCTION_LINE("Code patches found!\n");
         Notify("Code patches found!");
 
         int   addrFile   = open(addrPath.c_str(), O_RDONLY);
-        char *addrBuffer = readBuf(addrPath.c_str(), addrFile);
-        CODE_ADDR = *(uint32_t *)(addrBuffer + 0);
-        DATA_ADDR = *(uint32_t *)(addrBuffer + 4);
-
+        char *addrBuffer = readBuf(addrPath.c_str(), addrFile, 8);
         close(addrFile);
-        free(addrBuffer);
 
-        DEBUG_FUNCTION_LINE("Loaded Addr.bin!\n");
-       // Notify("Loadded Addr.bin!");
+        if (!addrBuffer) {
+            DEBUG_FUNCTION_LINE_ERR("Addr.bin must hold the 4-byte code and data addresses, not loading the code");
+        } else {
+            CODE_ADDR = *(uint32_t *)(addrBuffer + 0);
+            DATA_ADDR = *(uint32_t *)(addrBuffer + 4);
+            freePoolBuffer(addrBuffer);
+
+            DEBUG_FUNCTION_LINE("Loaded Addr.bin!\n");
+           // Notify("Loadded Addr.bin!");
+            markPhase(PHASE_ADDR);
 
-        int   codeFile   = open(codePath.c_str(), O_RDONLY);
-        char *codeBuffer = readBuf(codePath.c_str(), codeFile);
-        length = getFileLength(codePath.c_str());
-        KernelCopyDataV((void *)CODE_ADDR, codeBuffer, length);
+            loadImage(codePath.c_str(), CODE_ADDR, SECTION_CODE);
 
-        close(codeFile);
-        free(codeBuffer);
+            DEBUG_FUNCTION_LINE("Loaded Code.bin!\n");
+           // Notify("Loaded Code.bin!");
+            markPhase(PHASE_CODE);
 
-        DEBUG_FUNCTION_LINE("Loaded Code.bin!\n");
-       // Notify("Loaded Code.bin!");
+            loadImage(dataPath.c_str(), DATA_ADDR, SECTION_DATA);
 
-        int   dataFile   = open(dataPath.c_str(), O_RDONLY);
-        char *dataBuffer = readBuf(dataPath.c_str(), dataFile);
-        length = getFileLength(dataPath.c_str());
-        KernelCopyDataV((void *)DATA_ADDR, dataBuffer, length);
+            DEBUG_FUNCTION_LINE("Loaded Data.bin!\n");
+          //  Notify("Loaded Data.bin!");
 
-        close(dataFile);
-        free(dataBuffer);
+            exportLogger(DATA_ADDR);
+            markPhase(PHASE_DATA);
+        }
+    }
 
-        DEBUG_FUNCTION_LINE("Loaded Data.bin!\n");
-      //  Notify("Loaded Data.bin!");
+    markPhase(PHASE_DONE);
+    setReloadReady(clientEnabled);
+}
 
-        void *debugPtr = (void *)&WHBLogPrintf;
-        KernelCopyDataV((void *)(DATA_ADDR - 4), &debugPtr, sizeof(uint32_t));
-        DEBUG_FUNCTION_LINE("WHBLogPrintf address: %p\n", &debugPtr);
+ON_APPLICATION_ENDS() {
+    setReloadReady(false);
+    stopSdCache();
+    stopPrefetch();
+    stopIoThread();
+    closeOverlay();
+    closeSdCache();
+    closePrefetch();
+    sendStats();
+    stopChannel();
+
+    // A lost connection leaves the socket open, it is only closed here
+    clientEnabled = false;
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
     }
 }
 
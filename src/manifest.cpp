@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <utils/logger.h>
+
+#include "filesocket.h"
+#include "manifest.h"
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME        0x00000100000001B3ULL
+
+// Entries are received in batches of this many to keep the stack small
+#define MANIFEST_BATCH 64
+
+// Room for files the host adds while the game runs, the table never grows
+// because the hooks hold pointers into it
+#define MANIFEST_HEADROOM 256
+
+// Far more files than any title has. Bounds what a broken host can make us
+// allocate, and keeps the capacity from overflowing.
+#define MAX_MANIFEST_ENTRIES 0x40000
+
+// Open addressing table, capacity is always a power of two and at least
+// twice the entry count so probe sequences stay short. Entries are never
+// taken out, removed files are only marked so, which lets the hooks look
+// them up without a lock while the reader thread applies invalidations.
+static ManifestEntry *table = NULL;
+static uint32_t tableMask = 0;
+static uint32_t entryCount = 0;
+static bool loaded = false;
+
+static uint64_t hashBytes(uint64_t hash, const char *data, uint32_t length) {
+	for (uint32_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+// Hashes the path the same way client.py resolves it: leading slashes are
+// dropped and anything outside of vol/ is treated as relative to vol/content/
+uint64_t hashPath(const char *path) {
+	while (*path == '/')
+		path++;
+
+	uint64_t hash = FNV_OFFSET_BASIS;
+	if (strncmp(path, "vol/", 4) != 0)
+		hash = hashBytes(hash, "vol/content/", 12);
+
+	hash = hashBytes(hash, path, strlen(path));
+	return hash ? hash : 1;
+}
+
+static uint64_t readU64(const uint8_t *data) {
+	return ((uint64_t)ntohl(*(uint32_t *)data) << 32) | ntohl(*(uint32_t *)(data + 4));
+}
+
+static ManifestEntry *findSlot(uint64_t hash) {
+	uint32_t slot = (uint32_t)hash & tableMask;
+	while (table[slot].hash != 0 && table[slot].hash != hash)
+		slot = (slot + 1) & tableMask;
+
+	return &table[slot];
+}
+
+static void insertEntry(const ManifestEntry *entry) {
+	ManifestEntry *slot = findSlot(entry->hash);
+	if (slot->hash == 0)
+		entryCount++;
+
+	*slot = *entry;
+}
+
+void clearManifest() {
+	free(table);
+	table = NULL;
+	tableMask = 0;
+	entryCount = 0;
+	loaded = false;
+}
+
+bool hasManifest() {
+	return loaded;
+}
+
+static bool allocTable(uint32_t count) {
+	clearManifest();
+	if (count > MAX_MANIFEST_ENTRIES) {
+		DEBUG_FUNCTION_LINE_ERR("Manifest of %u files is larger than %u", count, MAX_MANIFEST_ENTRIES);
+		return false;
+	}
+
+	uint32_t capacity = 16;
+	while (capacity < (count + MANIFEST_HEADROOM) * 2)
+		capacity <<= 1;
+
+	table = (ManifestEntry *)calloc(capacity, sizeof(ManifestEntry));
+	if (!table)
+		DEBUG_FUNCTION_LINE_ERR("Failed to allocate manifest for %u files", count);
+	tableMask = capacity - 1;
+	return table != NULL;
+}
+
+// Reads the manifest the host sends after acknowledging the handshake:
+// u32 count, followed by count entries of u64 hash, u32 size, u32 mtime.
+// Returns false if the connection can't be used after it.
+bool receiveManifest() {
+	uint32_t count;
+	if (!receiveFile((char *)&count, 4))
+		return false;
+	count = ntohl(count);
+
+	// There is no skipping that many entries either
+	if (!allocTable(count) && count > MAX_MANIFEST_ENTRIES)
+		return false;
+
+	// Even without a table the entries are drained so the stream stays in sync
+
+	uint8_t batch[MANIFEST_BATCH * 16];
+	for (uint32_t done = 0; done < count;) {
+		uint32_t n = count - done;
+		if (n > MANIFEST_BATCH)
+			n = MANIFEST_BATCH;
+
+		if (!receiveFile((char *)batch, n * 16)) {
+			clearManifest();
+			return false;
+		}
+
+		for (uint32_t i = 0; table && i < n; i++) {
+			ManifestEntry entry;
+			entry.hash  = readU64(batch + i * 16);
+			entry.size  = ntohl(*(uint32_t *)(batch + i * 16 + 8));
+			entry.mtime = ntohl(*(uint32_t *)(batch + i * 16 + 12));
+			entry.removed = false;
+			if (entry.hash != 0)
+				insertEntry(&entry);
+		}
+		done += n;
+	}
+
+	loaded = table != NULL;
+	DEBUG_FUNCTION_LINE("Received manifest with %u files", count);
+	return true;
+}
+
+// For files that are known without a host, see overlay.cpp
+bool buildManifest(const ManifestEntry *entries, uint32_t count) {
+	if (!allocTable(count))
+		return false;
+
+	for (uint32_t i = 0; i < count; i++)
+		insertEntry(&entries[i]);
+
+	loaded = true;
+	return true;
+}
+
+const ManifestEntry *findManifestEntry(const char *path) {
+	return findManifestEntryByHash(hashPath(path));
+}
+
+const ManifestEntry *findManifestEntryByHash(uint64_t hash) {
+	if (!loaded)
+		return NULL;
+
+	uint32_t slot = (uint32_t)hash & tableMask;
+	while (table[slot].hash != 0) {
+		if (table[slot].hash == hash)
+			return table[slot].removed ? NULL : &table[slot];
+		slot = (slot + 1) & tableMask;
+	}
+
+	return NULL;
+}
+
+// Only called from the reader thread. A changed file's size and mtime are
+// updated in place, a new file is filled in before its hash is published so
+// a concurrent lookup never sees half of it. Returns false if the table is
+// too full to take another file, the game then only sees it after a relaunch.
+bool updateManifestEntry(const ManifestEntry *entry) {
+	if (!loaded || entry->hash == 0)
+		return false;
+
+	ManifestEntry *slot = findSlot(entry->hash);
+	if (slot->hash == 0) {
+		if ((entryCount + 1) * 4 > (tableMask + 1) * 3)
+			return false;
+
+		slot->size    = entry->size;
+		slot->mtime   = entry->mtime;
+		slot->removed = false;
+		__atomic_store_n(&slot->hash, entry->hash, __ATOMIC_RELEASE);
+		entryCount++;
+		return true;
+	}
+
+	slot->size    = entry->size;
+	slot->mtime   = entry->mtime;
+	slot->removed = false;
+	return true;
+}
+
+void removeManifestEntry(uint64_t hash) {
+	if (!loaded)
+		return;
+
+	ManifestEntry *slot = findSlot(hash);
+	if (slot->hash == hash)
+		slot->removed = true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// One overridden file as announced by the host during the handshake.
+// Paths are identified by the hash of their normalized form (see hashPath).
+typedef struct ManifestEntry {
+	uint64_t hash;
+	uint32_t size;
+	uint32_t mtime;
+	bool removed; // Deleted on the host since, lookups skip it
+} ManifestEntry;
+
+uint64_t hashPath(const char *path);
+
+bool receiveManifest();
+bool buildManifest(const ManifestEntry *entries, uint32_t count);
+void clearManifest();
+bool hasManifest();
+
+const ManifestEntry *findManifestEntry(const char *path);
+const ManifestEntry *findManifestEntryByHash(uint64_t hash);
+
+bool updateManifestEntry(const ManifestEntry *entry);
+void removeManifestEntry(uint64_t hash);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
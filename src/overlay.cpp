@@ -0,0 +1,185 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <coreinit/time.h>
+#include <utils/logger.h>
+
+#include "globals.h"
+#include "overlay.h"
+#include "protocol.h"
+
+// Replacement files can also be put on the SD card, for when no host is
+// around. The folder is only walked once at title start: what is found goes
+// into the manifest, so every hooked open is a single lookup in it, just
+// like with a host that sent one.
+
+#define OVERLAY_ROOT      "fs:/vol/external01/cafeloader"
+#define OVERLAY_DIR_SIZE  64
+#define OVERLAY_PATH_SIZE (OVERLAY_DIR_SIZE + MAX_PATH_LENGTH)
+
+// Files served from the overlay get handles from here on, clear of the
+// host's sequential ones and of the SD cache's
+#define OVERLAY_HANDLE_BASE 0xCB000000
+
+OverlayStats overlayStats;
+
+static char overlayDir[OVERLAY_DIR_SIZE];
+static uint32_t nextHandle = OVERLAY_HANDLE_BASE;
+
+// Collected during the walk, the manifest gets its own copy
+static ManifestEntry *found = NULL;
+static uint32_t foundCount = 0;
+static uint32_t foundCapacity = 0;
+
+static void addFound(const char *relative, const struct stat *st) {
+	if (foundCount == foundCapacity) {
+		uint32_t capacity = foundCapacity ? foundCapacity * 2 : 64;
+		ManifestEntry *grown = (ManifestEntry *)realloc(found, capacity * sizeof(ManifestEntry));
+		if (!grown)
+			return;
+		found = grown;
+		foundCapacity = capacity;
+	}
+
+	// Hashed like the game's path of the file it replaces
+	char gamePath[12 + MAX_PATH_LENGTH + 1];
+	snprintf(gamePath, sizeof(gamePath), "vol/content/%s", relative);
+
+	ManifestEntry *entry = &found[foundCount++];
+	entry->hash    = hashPath(gamePath);
+	entry->size    = st->st_size;
+	entry->mtime   = st->st_mtime;
+	entry->removed = false;
+}
+
+// `path` holds the folder to walk and has room to append to, its part below
+// content/ starts at `relative`
+static void walk(char *path, uint32_t length, uint32_t relative) {
+	DIR *dir = opendir(path);
+	if (!dir)
+		return;
+
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		// Skips . and .., as well as the ._ files macOS leaves on SD cards
+		if (ent->d_name[0] == '.')
+			continue;
+
+		uint32_t nameLength = strlen(ent->d_name);
+		if (length + 1 + nameLength >= OVERLAY_PATH_SIZE)
+			continue;
+
+		path[length] = '/';
+		memcpy(path + length + 1, ent->d_name, nameLength + 1);
+
+		struct stat st;
+		if (stat(path, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			walk(path, length + 1 + nameLength, relative);
+		else
+			addFound(path + relative, &st);
+	}
+
+	path[length] = '\0';
+	closedir(dir);
+}
+
+// Returns whether any replacement files were found
+bool openOverlay(const char *titleID) {
+	closeOverlay();
+	memset(&overlayStats, 0, sizeof(overlayStats));
+
+	char path[OVERLAY_PATH_SIZE];
+	uint32_t length = snprintf(path, OVERLAY_DIR_SIZE, OVERLAY_ROOT "/%s/content", titleID);
+	memcpy(overlayDir, path, length + 1);
+
+	OSTime start = OSGetTime();
+	walk(path, length, length + 1);
+
+	bool built = foundCount && buildManifest(found, foundCount);
+	overlayStats.files     = built ? foundCount : 0;
+	overlayStats.indexTime = (uint32_t)OSTicksToMicroseconds(OSGetTime() - start);
+
+	free(found);
+	found = NULL;
+	foundCount = foundCapacity = 0;
+
+	overlayEnabled = built;
+	if (built)
+		DEBUG_FUNCTION_LINE("SD overlay has %u files (indexed in %u us)", overlayStats.files, overlayStats.indexTime);
+	return built;
+}
+
+void closeOverlay() {
+	overlayEnabled = false;
+}
+
+// Only called with paths the manifest has, which are relative to content/
+// unless they start with vol/content/
+bool openOverlayFile(const char *path, const ManifestEntry *entry, const char *mode, FSFileHandle *fileHandle) {
+	// The overlay stands in for the content folder, which is read-only
+	if (mode[0] != 'r' || strchr(mode, '+'))
+		return false;
+
+	while (*path == '/')
+		path++;
+	if (strncmp(path, "vol/content/", 12) == 0)
+		path += 12;
+
+	char localPath[OVERLAY_PATH_SIZE];
+	snprintf(localPath, sizeof(localPath), "%s/%s", overlayDir, path);
+
+	int localFd = open(localPath, O_RDONLY);
+	if (localFd < 0) {
+		__atomic_fetch_add(&overlayStats.failures, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	FSFileHandle handle = __atomic_fetch_add(&nextHandle, 1, __ATOMIC_RELAXED);
+	while (findRedirectedFile(handle))
+		handle = __atomic_fetch_add(&nextHandle, 1, __ATOMIC_RELAXED);
+
+	RedirectedFile *file = addRedirectedFile(handle);
+	if (!file) {
+		close(localFd);
+		return false;
+	}
+
+	file->size    = entry->size;
+	file->hash    = entry->hash;
+	file->localFd = localFd;
+	file->overlay = true;
+	__atomic_fetch_add(&overlayStats.opens, 1, __ATOMIC_RELAXED);
+
+	*fileHandle = handle;
+	return true;
+}
+
+void closeOverlayFile(RedirectedFile *file) {
+	close(file->localFd);
+	file->localFd = -1;
+}
+
+uint32_t readOverlayFile(RedirectedFile *file, char *dest, uint32_t length) {
+	if (lseek(file->localFd, file->pos, SEEK_SET) < 0)
+		return 0;
+
+	uint32_t done = 0;
+	while (done < length) {
+		int num = read(file->localFd, dest + done, length - done);
+		if (num <= 0)
+			break;
+		done += num;
+	}
+
+	file->pos += done;
+	addCounter(&overlayStats.bytesServed, done);
+	return done;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <coreinit/filesystem.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "handles.h"
+#include "manifest.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct OverlayStats {
+	uint32_t files;     // Replacement files found under content/ at title start
+	uint32_t indexTime; // Microseconds it took to find them
+	uint32_t opens;
+	uint32_t failures;  // Indexed files that could not be opened any more
+	Counter64 bytesServed;
+} OverlayStats;
+
+extern OverlayStats overlayStats;
+
+bool openOverlay(const char *titleID);
+void closeOverlay();
+
+bool openOverlayFile(const char *path, const ManifestEntry *entry, const char *mode, FSFileHandle *fileHandle);
+void closeOverlayFile(RedirectedFile *file);
+uint32_t readOverlayFile(RedirectedFile *file, char *dest, uint32_t length);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -1,21 +1,41 @@
 #include <coreinit/filesystem.h>
 #include <wups.h>
 
+#include <string.h>
+
 #include "globals.h"
 #include "filesystem.h"
+#include "handles.h"
+#include "iothread.h"
+#include "manifest.h"
+#include "protocol.h"
+#include "reload.h"
+#include "stats.h"
+
+// Game files go to the host, or to the SD overlay when there is none.
+// Saves always need the host.
+static inline bool redirecting() {
+    return clientEnabled || overlayEnabled;
+}
 
 DECL_FUNCTION(bool, FSOpenFile, FSClient *client, FSCmdBlock *block,
               const char *path, const char *mode,
               FSFileHandle *fileHandle,
               int errHandling) {
 
-    if (clientEnabled == false)
+    if (!redirecting()) {
+        recordPassthrough(HOOK_OPEN_FILE);
         return real_FSOpenFile(client, block, path, mode, fileHandle, errHandling);
+    }
 
+    OSTime start = OSGetTime();
     bool result = 1;
-    if((result = openFile(client, block, path, mode, fileHandle, errHandling)) != 1)
+    if((result = openFile(client, block, path, mode, fileHandle, errHandling)) != 1) {
+        recordRedirected(HOOK_OPEN_FILE, start, 0);
         return result;
+    }
 
+    recordPassthrough(HOOK_OPEN_FILE);
     return real_FSOpenFile(client, block, path, mode, fileHandle, errHandling);
 }
 
@@ -23,13 +43,19 @@ DECL_FUNCTION(bool, FSCloseFile, FSClient *client, FSCmdBlock *block,
 			   FSFileHandle fileHandle,
 			   int errHandling) {
 
-    if (clientEnabled == false)
+    if (!redirecting()) {
+        recordPassthrough(HOOK_CLOSE_FILE);
         return real_FSCloseFile(client, block, fileHandle, errHandling);
+    }
 
+    OSTime start = OSGetTime();
     bool result = 1;
-    if((result = closeFile(client, block, fileHandle, errHandling)) != 1)
+    if((result = closeFile(client, block, fileHandle, errHandling)) != 1) {
+        recordRedirected(HOOK_CLOSE_FILE, start, 0);
         return result;
+    }
 
+    recordPassthrough(HOOK_CLOSE_FILE);
     return real_FSCloseFile(client, block, fileHandle, errHandling);
 }
 
@@ -38,28 +64,40 @@ DECL_FUNCTION(int, FSReadFile, FSClient *client, FSCmdBlock *block,
              FSFileHandle fileHandle, int flag,
              int errHandling) {
 
-    if (clientEnabled == false)
+    if (!redirecting()) {
+        recordPassthrough(HOOK_READ_FILE);
         return real_FSReadFile(client, block, dest, size, count, fileHandle, flag, errHandling);
+    }
 
+    OSTime start = OSGetTime();
     int result = -1;
-    if((result = readFile(client, block, dest, size, count, fileHandle, flag, errHandling)) != -1)
+    if((result = readFile(client, block, dest, size, count, fileHandle, flag, errHandling)) != -1) {
+        recordRedirected(HOOK_READ_FILE, start, result > 0 ? result * size : 0);
         return result;
+    }
 
+    recordPassthrough(HOOK_READ_FILE);
     return real_FSReadFile(client, block, dest, size, count, fileHandle, flag, errHandling);
 }
 
-DECL_FUNCTION(bool, FSWriteFile, FSClient *client, FSCmdBlock *block,
+DECL_FUNCTION(int, FSWriteFile, FSClient *client, FSCmdBlock *block,
 			   char *source, int size, int count,
 			   FSFileHandle fileHandle, int flag,
 			   int errHandling) {
 
-    if (clientEnabled == false)
+    if (!redirecting()) {
+        recordPassthrough(HOOK_WRITE_FILE);
         return real_FSWriteFile(client, block, source, size, count, fileHandle, flag, errHandling);
+    }
 
-    bool result = 1;
-    if((result = writeFile(client, block, source, size, count, fileHandle, flag, errHandling)) != 1)
+    OSTime start = OSGetTime();
+    int result = -1;
+    if((result = writeFile(client, block, source, size, count, fileHandle, flag, errHandling)) != -1) {
+        recordRedirected(HOOK_WRITE_FILE, start, result > 0 ? result * size : 0);
         return result;
+    }
 
+    recordPassthrough(HOOK_WRITE_FILE);
     return real_FSWriteFile(client, block, source, size, count, fileHandle, flag, errHandling);
 }
 
@@ -67,13 +105,19 @@ DECL_FUNCTION(bool, FSSetPosFile, FSClient *client, FSCmdBlock *block,
 				FSFileHandle fileHandle, uint32_t fpos,
 				int errHandling) {
 
-    if (clientEnabled == false)
+    if (!redirecting()) {
+        recordPassthrough(HOOK_SET_POS_FILE);
         return real_FSSetPosFile(client, block, fileHandle, fpos, errHandling);
+    }
 
+    OSTime start = OSGetTime();
     bool result = 1;
-    if((result = setPosFile(client, block, fileHandle, fpos, errHandling)) != 1)
+    if((result = setPosFile(client, block, fileHandle, fpos, errHandling)) != 1) {
+        recordRedirected(HOOK_SET_POS_FILE, start, 0);
         return result;
+    }
 
+    recordPassthrough(HOOK_SET_POS_FILE);
     return real_FSSetPosFile(client, block, fileHandle, fpos, errHandling);
 }
 
@@ -81,13 +125,19 @@ DECL_FUNCTION(bool, FSGetStatFile, FSClient *client, FSCmdBlock *block,
 				 FSFileHandle fileHandle, FSStat *returnedStat,
 				 int errHandling) {
 
-    if (clientEnabled == false)
+    if (!redirecting()) {
+        recordPassthrough(HOOK_GET_STAT_FILE);
         return real_FSGetStatFile(client, block, fileHandle, returnedStat, errHandling);
+    }
 
+    OSTime start = OSGetTime();
     bool result = 1;
-    if((result = getStatFile(client, block, fileHandle, returnedStat, errHandling)) != 1)
+    if((result = getStatFile(client, block, fileHandle, returnedStat, errHandling)) != 1) {
+        recordRedirected(HOOK_GET_STAT_FILE, start, 0);
         return result;
+    }
 
+    recordPassthrough(HOOK_GET_STAT_FILE);
     return real_FSGetStatFile(client, block, fileHandle, returnedStat, errHandling);
 }
 
@@ -95,16 +145,442 @@ DECL_FUNCTION(bool, FSGetStat, FSClient *client, FSCmdBlock *block,
              const char *path, FSStat *returnedStat,
              int errHandling) {
 
-    if (clientEnabled == false)
+    if (!redirecting()) {
+        recordPassthrough(HOOK_GET_STAT);
         return real_FSGetStat(client, block, path, returnedStat, errHandling);
+    }
 
+    OSTime start = OSGetTime();
     bool result = 1;
-    if((result = getStat(client, block, path, returnedStat, errHandling)) != 1)
+    if((result = getStat(client, block, path, returnedStat, errHandling)) != 1) {
+        recordRedirected(HOOK_GET_STAT, start, 0);
         return result;
+    }
 
+    recordPassthrough(HOOK_GET_STAT);
     return real_FSGetStat(client, block, path, returnedStat, errHandling);
 }
 
+// The asynchronous variants queue redirected calls to the I/O thread and
+// return right away, the result is delivered through the game's FSAsyncData.
+// Calls that turn out not to be ours are handed to the real function from
+// there with the game's FSAsyncData, so it still completes them.
+
+// Saves go through nn_save, which opens them under the account's folder
+DECL_FUNCTION(FSStatus, SAVEOpenFile, FSClient *client, FSCmdBlock *block,
+              uint8_t accountSlotNo, const char *path, const char *mode,
+              FSFileHandle *fileHandle,
+              FSErrorFlag errorMask) {
+
+    if (clientEnabled == false) {
+        recordPassthrough(HOOK_SAVE_OPEN_FILE);
+        return real_SAVEOpenFile(client, block, accountSlotNo, path, mode, fileHandle, errorMask);
+    }
+
+    OSTime start = OSGetTime();
+    if (openSave(client, block, accountSlotNo, path, mode, fileHandle, errorMask) != 1) {
+        recordRedirected(HOOK_SAVE_OPEN_FILE, start, 0);
+        return FS_STATUS_OK;
+    }
+
+    recordPassthrough(HOOK_SAVE_OPEN_FILE);
+    return real_SAVEOpenFile(client, block, accountSlotNo, path, mode, fileHandle, errorMask);
+}
+
+DECL_FUNCTION(FSStatus, FSOpenFileEx, FSClient *client, FSCmdBlock *block,
+              const char *path, const char *mode,
+              uint32_t createMode, uint32_t openFlag, uint32_t preallocSize,
+              FSFileHandle *fileHandle,
+              FSErrorFlag errorMask) {
+
+    if (!redirecting()) {
+        recordPassthrough(HOOK_OPEN_FILE_EX);
+        return real_FSOpenFileEx(client, block, path, mode, createMode, openFlag, preallocSize, fileHandle, errorMask);
+    }
+
+    // The permissions and preallocation only matter to files the console creates
+    OSTime start = OSGetTime();
+    if (openFile(client, block, path, mode, fileHandle, errorMask) != 1) {
+        recordRedirected(HOOK_OPEN_FILE_EX, start, 0);
+        return FS_STATUS_OK;
+    }
+
+    recordPassthrough(HOOK_OPEN_FILE_EX);
+    return real_FSOpenFileEx(client, block, path, mode, createMode, openFlag, preallocSize, fileHandle, errorMask);
+}
+
+DECL_FUNCTION(int, FSReadFileWithPos, FSClient *client, FSCmdBlock *block,
+              char *dest, int size, int count, uint32_t pos,
+              FSFileHandle fileHandle, int flag,
+              int errHandling) {
+
+    if (!redirecting()) {
+        recordPassthrough(HOOK_READ_FILE_WITH_POS);
+        return real_FSReadFileWithPos(client, block, dest, size, count, pos, fileHandle, flag, errHandling);
+    }
+
+    OSTime start = OSGetTime();
+    int result = -1;
+    if((result = readFileWithPos(client, block, dest, size, count, pos, fileHandle, flag, errHandling)) != -1) {
+        recordRedirected(HOOK_READ_FILE_WITH_POS, start, result > 0 ? result * size : 0);
+        return result;
+    }
+
+    recordPassthrough(HOOK_READ_FILE_WITH_POS);
+    return real_FSReadFileWithPos(client, block, dest, size, count, pos, fileHandle, flag, errHandling);
+}
+
+void RunOpenFile(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSOpenFileAsync, FSClient *client, FSCmdBlock *block,
+              const char *path, const char *mode,
+              FSFileHandle *fileHandle,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    // Without a manifest only the host can tell, so that is left to the I/O thread
+    if (!redirecting() || (hasManifest() && !findManifestEntry(path))) {
+        recordPassthrough(HOOK_OPEN_FILE_ASYNC);
+        return real_FSOpenFileAsync(client, block, path, mode, fileHandle, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunOpenFile, client, block, errorMask, asyncData);
+    strncpy(request->path, path, sizeof(request->path) - 1);
+    strncpy(request->mode, mode, sizeof(request->mode) - 1);
+    request->outHandle = fileHandle;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunOpenFile(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    if (openFile(request->client, request->block, request->path, request->mode, request->outHandle, request->errorMask) == 1) {
+        real_FSOpenFileAsync(request->client, request->block, request->path, request->mode, request->outHandle, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_OPEN_FILE_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_OPEN_FILE_ASYNC, start, 0);
+    completeAsyncRequest(request, FS_STATUS_OK);
+}
+
+void RunCloseFile(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSCloseFileAsync, FSClient *client, FSCmdBlock *block,
+              FSFileHandle fileHandle,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || !findRedirectedFile(fileHandle)) {
+        recordPassthrough(HOOK_CLOSE_FILE_ASYNC);
+        return real_FSCloseFileAsync(client, block, fileHandle, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunCloseFile, client, block, errorMask, asyncData);
+    request->handle = fileHandle;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunCloseFile(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    if (closeFile(request->client, request->block, request->handle, request->errorMask) == 1) {
+        real_FSCloseFileAsync(request->client, request->block, request->handle, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_CLOSE_FILE_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_CLOSE_FILE_ASYNC, start, 0);
+    completeAsyncRequest(request, FS_STATUS_OK);
+}
+
+void RunReadFile(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSReadFileAsync, FSClient *client, FSCmdBlock *block,
+              uint8_t *buffer, uint32_t size, uint32_t count,
+              FSFileHandle fileHandle, uint32_t flag,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || !findRedirectedFile(fileHandle)) {
+        recordPassthrough(HOOK_READ_FILE_ASYNC);
+        return real_FSReadFileAsync(client, block, buffer, size, count, fileHandle, flag, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunReadFile, client, block, errorMask, asyncData);
+    request->buffer = buffer;
+    request->size   = size;
+    request->count  = count;
+    request->handle = fileHandle;
+    request->flags  = flag;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunReadFile(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    int result = readFile(request->client, request->block, (char *)request->buffer, request->size, request->count,
+                          request->handle, request->flags, request->errorMask);
+    if (result == -1) {
+        real_FSReadFileAsync(request->client, request->block, request->buffer, request->size, request->count,
+                             request->handle, request->flags, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_READ_FILE_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_READ_FILE_ASYNC, start, result > 0 ? result * request->size : 0);
+    completeAsyncRequest(request, result);
+}
+
+void RunWriteFile(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSWriteFileAsync, FSClient *client, FSCmdBlock *block,
+              uint8_t *buffer, uint32_t size, uint32_t count,
+              FSFileHandle fileHandle, uint32_t flag,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || !findRedirectedFile(fileHandle)) {
+        recordPassthrough(HOOK_WRITE_FILE_ASYNC);
+        return real_FSWriteFileAsync(client, block, buffer, size, count, fileHandle, flag, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunWriteFile, client, block, errorMask, asyncData);
+    request->buffer = buffer;
+    request->size   = size;
+    request->count  = count;
+    request->handle = fileHandle;
+    request->flags  = flag;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunWriteFile(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    int result = writeFile(request->client, request->block, (char *)request->buffer, request->size, request->count,
+                           request->handle, request->flags, request->errorMask);
+    if (result == -1) {
+        real_FSWriteFileAsync(request->client, request->block, request->buffer, request->size, request->count,
+                              request->handle, request->flags, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_WRITE_FILE_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_WRITE_FILE_ASYNC, start, result > 0 ? result * request->size : 0);
+    completeAsyncRequest(request, result);
+}
+
+void RunSetPosFile(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSSetPosFileAsync, FSClient *client, FSCmdBlock *block,
+              FSFileHandle fileHandle, uint32_t fpos,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || !findRedirectedFile(fileHandle)) {
+        recordPassthrough(HOOK_SET_POS_FILE_ASYNC);
+        return real_FSSetPosFileAsync(client, block, fileHandle, fpos, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunSetPosFile, client, block, errorMask, asyncData);
+    request->handle = fileHandle;
+    request->pos    = fpos;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunSetPosFile(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    if (setPosFile(request->client, request->block, request->handle, request->pos, request->errorMask) == 1) {
+        real_FSSetPosFileAsync(request->client, request->block, request->handle, request->pos, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_SET_POS_FILE_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_SET_POS_FILE_ASYNC, start, 0);
+    completeAsyncRequest(request, FS_STATUS_OK);
+}
+
+void RunGetStatFile(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSGetStatFileAsync, FSClient *client, FSCmdBlock *block,
+              FSFileHandle fileHandle, FSStat *returnedStat,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || !findRedirectedFile(fileHandle)) {
+        recordPassthrough(HOOK_GET_STAT_FILE_ASYNC);
+        return real_FSGetStatFileAsync(client, block, fileHandle, returnedStat, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunGetStatFile, client, block, errorMask, asyncData);
+    request->handle = fileHandle;
+    request->stat   = returnedStat;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunGetStatFile(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    if (getStatFile(request->client, request->block, request->handle, request->stat, request->errorMask) == 1) {
+        real_FSGetStatFileAsync(request->client, request->block, request->handle, request->stat, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_GET_STAT_FILE_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_GET_STAT_FILE_ASYNC, start, 0);
+    completeAsyncRequest(request, FS_STATUS_OK);
+}
+
+void RunGetStat(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSGetStatAsync, FSClient *client, FSCmdBlock *block,
+              const char *path, FSStat *returnedStat,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || (hasManifest() && !findManifestEntry(path))) {
+        recordPassthrough(HOOK_GET_STAT_ASYNC);
+        return real_FSGetStatAsync(client, block, path, returnedStat, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunGetStat, client, block, errorMask, asyncData);
+    strncpy(request->path, path, sizeof(request->path) - 1);
+    request->stat = returnedStat;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunGetStat(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    if (getStat(request->client, request->block, request->path, request->stat, request->errorMask) == 1) {
+        real_FSGetStatAsync(request->client, request->block, request->path, request->stat, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_GET_STAT_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_GET_STAT_ASYNC, start, 0);
+    completeAsyncRequest(request, FS_STATUS_OK);
+}
+
+void RunSaveOpenFile(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, SAVEOpenFileAsync, FSClient *client, FSCmdBlock *block,
+              uint8_t accountSlotNo, const char *path, const char *mode,
+              FSFileHandle *fileHandle,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (clientEnabled == false || !(capabilities & CAP_SAVES)) {
+        recordPassthrough(HOOK_SAVE_OPEN_FILE_ASYNC);
+        return real_SAVEOpenFileAsync(client, block, accountSlotNo, path, mode, fileHandle, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunSaveOpenFile, client, block, errorMask, asyncData);
+    strncpy(request->path, path, sizeof(request->path) - 1);
+    strncpy(request->mode, mode, sizeof(request->mode) - 1);
+    request->outHandle = fileHandle;
+    request->flags     = accountSlotNo;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunSaveOpenFile(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    if (openSave(request->client, request->block, request->flags, request->path, request->mode, request->outHandle, request->errorMask) == 1) {
+        real_SAVEOpenFileAsync(request->client, request->block, request->flags, request->path, request->mode, request->outHandle, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_SAVE_OPEN_FILE_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_SAVE_OPEN_FILE_ASYNC, start, 0);
+    completeAsyncRequest(request, FS_STATUS_OK);
+}
+
+void RunOpenFileEx(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSOpenFileExAsync, FSClient *client, FSCmdBlock *block,
+              const char *path, const char *mode,
+              uint32_t createMode, uint32_t openFlag, uint32_t preallocSize,
+              FSFileHandle *fileHandle,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || (hasManifest() && !findManifestEntry(path))) {
+        recordPassthrough(HOOK_OPEN_FILE_EX_ASYNC);
+        return real_FSOpenFileExAsync(client, block, path, mode, createMode, openFlag, preallocSize, fileHandle, errorMask, asyncData);
+    }
+
+    // Only kept for passing the call on, in the fields an open has no use for
+    AsyncRequest *request = allocAsyncRequest(RunOpenFileEx, client, block, errorMask, asyncData);
+    strncpy(request->path, path, sizeof(request->path) - 1);
+    strncpy(request->mode, mode, sizeof(request->mode) - 1);
+    request->size      = createMode;
+    request->flags     = openFlag;
+    request->count     = preallocSize;
+    request->outHandle = fileHandle;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunOpenFileEx(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    if (openFile(request->client, request->block, request->path, request->mode, request->outHandle, request->errorMask) == 1) {
+        real_FSOpenFileExAsync(request->client, request->block, request->path, request->mode, request->size, request->flags,
+                               request->count, request->outHandle, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_OPEN_FILE_EX_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_OPEN_FILE_EX_ASYNC, start, 0);
+    completeAsyncRequest(request, FS_STATUS_OK);
+}
+
+void RunReadFileWithPos(AsyncRequest *request);
+
+DECL_FUNCTION(FSStatus, FSReadFileWithPosAsync, FSClient *client, FSCmdBlock *block,
+              uint8_t *buffer, uint32_t size, uint32_t count, uint32_t pos,
+              FSFileHandle fileHandle, uint32_t flag,
+              FSErrorFlag errorMask, FSAsyncData *asyncData) {
+
+    if (!redirecting() || !findRedirectedFile(fileHandle)) {
+        recordPassthrough(HOOK_READ_FILE_WITH_POS_ASYNC);
+        return real_FSReadFileWithPosAsync(client, block, buffer, size, count, pos, fileHandle, flag, errorMask, asyncData);
+    }
+
+    AsyncRequest *request = allocAsyncRequest(RunReadFileWithPos, client, block, errorMask, asyncData);
+    request->buffer = buffer;
+    request->size   = size;
+    request->count  = count;
+    request->pos    = pos;
+    request->handle = fileHandle;
+    request->flags  = flag;
+    queueAsyncRequest(request);
+    return FS_STATUS_OK;
+}
+
+void RunReadFileWithPos(AsyncRequest *request) {
+    OSTime start = OSGetTime();
+    int result = readFileWithPos(request->client, request->block, (char *)request->buffer, request->size, request->count,
+                                 request->pos, request->handle, request->flags, request->errorMask);
+    if (result == -1) {
+        real_FSReadFileWithPosAsync(request->client, request->block, request->buffer, request->size, request->count,
+                                    request->pos, request->handle, request->flags, request->errorMask, &request->asyncData);
+        freeAsyncRequest(request);
+        recordPassthrough(HOOK_READ_FILE_WITH_POS_ASYNC);
+        return;
+    }
+
+    recordRedirected(HOOK_READ_FILE_WITH_POS_ASYNC, start, result > 0 ? result * request->size : 0);
+    completeAsyncRequest(request, result);
+}
+
+// Once per frame on the render thread, the point a live reload is applied at
+DECL_FUNCTION(void, GX2SwapScanBuffers) {
+    applyStagedReload();
+    real_GX2SwapScanBuffers();
+}
+
 WUPS_MUST_REPLACE(FSOpenFile,                  WUPS_LOADER_LIBRARY_COREINIT,  FSOpenFile);
 WUPS_MUST_REPLACE(FSCloseFile,                 WUPS_LOADER_LIBRARY_COREINIT,  FSCloseFile);
 WUPS_MUST_REPLACE(FSReadFile,                  WUPS_LOADER_LIBRARY_COREINIT,  FSReadFile);
@@ -112,3 +588,19 @@ WUPS_MUST_REPLACE(FSWriteFile,                 WUPS_LOADER_LIBRARY_COREINIT,  FS
 WUPS_MUST_REPLACE(FSSetPosFile,                WUPS_LOADER_LIBRARY_COREINIT,  FSSetPosFile);
 WUPS_MUST_REPLACE(FSGetStatFile,               WUPS_LOADER_LIBRARY_COREINIT,  FSGetStatFile);
 WUPS_MUST_REPLACE(FSGetStat,                   WUPS_LOADER_LIBRARY_COREINIT,  FSGetStat);
+WUPS_MUST_REPLACE(SAVEOpenFile,                WUPS_LOADER_LIBRARY_NN_SAVE,   SAVEOpenFile);
+WUPS_MUST_REPLACE(FSOpenFileEx,                WUPS_LOADER_LIBRARY_COREINIT,  FSOpenFileEx);
+WUPS_MUST_REPLACE(FSReadFileWithPos,           WUPS_LOADER_LIBRARY_COREINIT,  FSReadFileWithPos);
+
+WUPS_MUST_REPLACE(FSOpenFileAsync,             WUPS_LOADER_LIBRARY_COREINIT,  FSOpenFileAsync);
+WUPS_MUST_REPLACE(FSCloseFileAsync,            WUPS_LOADER_LIBRARY_COREINIT,  FSCloseFileAsync);
+WUPS_MUST_REPLACE(FSReadFileAsync,             WUPS_LOADER_LIBRARY_COREINIT,  FSReadFileAsync);
+WUPS_MUST_REPLACE(FSWriteFileAsync,            WUPS_LOADER_LIBRARY_COREINIT,  FSWriteFileAsync);
+WUPS_MUST_REPLACE(FSSetPosFileAsync,           WUPS_LOADER_LIBRARY_COREINIT,  FSSetPosFileAsync);
+WUPS_MUST_REPLACE(FSGetStatFileAsync,          WUPS_LOADER_LIBRARY_COREINIT,  FSGetStatFileAsync);
+WUPS_MUST_REPLACE(FSGetStatAsync,              WUPS_LOADER_LIBRARY_COREINIT,  FSGetStatAsync);
+WUPS_MUST_REPLACE(SAVEOpenFileAsync,           WUPS_LOADER_LIBRARY_NN_SAVE,   SAVEOpenFileAsync);
+WUPS_MUST_REPLACE(FSOpenFileExAsync,           WUPS_LOADER_LIBRARY_COREINIT,  FSOpenFileExAsync);
+WUPS_MUST_REPLACE(FSReadFileWithPosAsync,      WUPS_LOADER_LIBRARY_COREINIT,  FSReadFileWithPosAsync);
+
+WUPS_MUST_REPLACE(GX2SwapScanBuffers,          WUPS_LOADER_LIBRARY_GX2,       GX2SwapScanBuffers);
@@ -0,0 +1,550 @@
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <coreinit/mutex.h>
+#include <netinet/in.h>
+#include <utils/logger.h>
+
+#include "bufferpool.h"
+#include "channel.h"
+#include "filesystem.h"
+#include "globals.h"
+#include "iothread.h"
+#include "manifest.h"
+#include "prefetch.h"
+#include "protocol.h"
+#include "sdcache.h"
+
+// A title opens and reads the same files in the same order every time it
+// boots. The redirected reads of each run are recorded as a trace, saved
+// next to the SD cache, and on the next run the I/O thread fetches those
+// ranges in that order into a bounded set of buffers. Reads the game then
+// makes are served from memory instead of waiting on the host.
+//
+// The I/O thread stays at most prefetchBudget bytes ahead of the game, a
+// slab of POOL_PREFETCH per range: buffers are freed once read, and skipped
+// over once the game has read something further along the trace.
+
+#define TRACE_ROOT  "fs:/vol/external01/cafeloader"
+#define TRACE_MAGIC 0x434C5431 // "CLT1"
+
+#define MAX_TRACE_FILES  256
+#define MAX_TRACE_RANGES 1024
+#define TRACE_PATHS_SIZE 0x4000
+
+#define MAX_PREFETCH_BUFFERS 64
+
+typedef struct TraceFile {
+	uint64_t hash; // Cleared while prefetching if the host could not open it
+	uint32_t path; // Offset of the path in the trace's paths
+	uint32_t reserved;
+} TraceFile;
+
+typedef struct TraceRange {
+	uint16_t file;
+	uint16_t reserved;
+	uint32_t offset;
+	uint32_t length;
+} TraceRange;
+
+// The trace file holds the header followed by the three arrays
+typedef struct TraceHeader {
+	uint32_t magic;
+	uint32_t fileCount;
+	uint32_t rangeCount;
+	uint32_t pathsLength;
+} TraceHeader;
+
+typedef struct Trace {
+	TraceFile *files;
+	TraceRange *ranges;
+	char *paths;
+	uint32_t fileCount;
+	uint32_t rangeCount;
+	uint32_t pathsLength;
+	uint32_t lastFile; // Index the last read was recorded for
+} Trace;
+
+typedef enum BufferState {
+	BUFFER_FREE,
+	BUFFER_FETCHING,
+	BUFFER_READY,
+} BufferState;
+
+typedef struct PrefetchBuffer {
+	BufferState state;
+	bool stale;     // The host changed the file while it was being fetched
+	uint32_t index; // Of its range in the trace
+	uint64_t hash;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t served;
+	char *data;
+} PrefetchBuffer;
+
+PrefetchStats prefetchStats;
+
+// What the last run recorded, fetched ahead, and what this run records
+static Trace plan;
+static Trace trace;
+static uint32_t nextRange = 0;
+
+static PrefetchBuffer buffers[MAX_PREFETCH_BUFFERS];
+static uint32_t consumedIndex = 0; // Highest range the game read from
+
+// The host file the I/O thread is reading from
+static FSFileHandle hostHandle = 0;
+static uint32_t hostFile = 0;
+static uint32_t hostPos = 0;
+
+static char tracePath[64];
+
+// Not from the I/O thread's pool, a game thread that frees a buffer must
+// never wait for one
+static AsyncRequest prefetchRequest;
+static bool parked = false;
+static volatile bool stopping = false;
+
+// Held briefly by the game's threads, the reader and the I/O thread, never
+// across a round trip
+static OSMutex mutex;
+
+static bool allocTrace(Trace *t) {
+	char *memory = (char *)malloc(MAX_TRACE_FILES * sizeof(TraceFile) + MAX_TRACE_RANGES * sizeof(TraceRange) + TRACE_PATHS_SIZE);
+	if (!memory)
+		return false;
+
+	t->files       = (TraceFile *)memory;
+	t->ranges      = (TraceRange *)(memory + MAX_TRACE_FILES * sizeof(TraceFile));
+	t->paths       = memory + MAX_TRACE_FILES * sizeof(TraceFile) + MAX_TRACE_RANGES * sizeof(TraceRange);
+	t->fileCount   = 0;
+	t->rangeCount  = 0;
+	t->pathsLength = 0;
+	t->lastFile    = 0;
+	return true;
+}
+
+static void freeTrace(Trace *t) {
+	free(t->files);
+	memset(t, 0, sizeof(Trace));
+}
+
+static bool loadTrace(Trace *t) {
+	int traceFd = open(tracePath, O_RDONLY);
+	if (traceFd < 0)
+		return false;
+
+	TraceHeader header;
+	bool ok = read(traceFd, &header, sizeof(header)) == sizeof(header) && header.magic == TRACE_MAGIC &&
+	          header.fileCount <= MAX_TRACE_FILES && header.rangeCount <= MAX_TRACE_RANGES &&
+	          header.pathsLength <= TRACE_PATHS_SIZE && allocTrace(t);
+
+	if (ok) {
+		int filesLength  = header.fileCount * sizeof(TraceFile);
+		int rangesLength = header.rangeCount * sizeof(TraceRange);
+		ok = read(traceFd, t->files, filesLength) == filesLength &&
+		     read(traceFd, t->ranges, rangesLength) == rangesLength &&
+		     read(traceFd, t->paths, header.pathsLength) == (int)header.pathsLength;
+
+		t->fileCount   = header.fileCount;
+		t->rangeCount  = header.rangeCount;
+		t->pathsLength = header.pathsLength;
+	}
+
+	close(traceFd);
+
+	// Everything that points into the arrays has to stay inside them
+	for (uint32_t i = 0; ok && i < t->fileCount; i++)
+		ok = t->files[i].path < t->pathsLength && memchr(t->paths + t->files[i].path, 0, t->pathsLength - t->files[i].path);
+	for (uint32_t i = 0; ok && i < t->rangeCount; i++)
+		ok = t->ranges[i].file < t->fileCount;
+
+	if (!ok)
+		freeTrace(t);
+	return ok;
+}
+
+// Written next to the old trace and renamed over it, so a title that ends
+// midway through leaves the last complete one
+static void saveTrace(const Trace *t) {
+	char tempPath[sizeof(tracePath)];
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", tracePath);
+
+	int traceFd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (traceFd < 0) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to write the prefetch trace");
+		return;
+	}
+
+	TraceHeader header = { TRACE_MAGIC, t->fileCount, t->rangeCount, t->pathsLength };
+	int filesLength  = t->fileCount * sizeof(TraceFile);
+	int rangesLength = t->rangeCount * sizeof(TraceRange);
+	bool written = write(traceFd, &header, sizeof(header)) == sizeof(header) &&
+	               write(traceFd, t->files, filesLength) == filesLength &&
+	               write(traceFd, t->ranges, rangesLength) == rangesLength &&
+	               write(traceFd, t->paths, t->pathsLength) == (int)t->pathsLength;
+	if (close(traceFd) != 0 || !written) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to write the prefetch trace");
+		unlink(tempPath);
+		return;
+	}
+
+	// The SD card's filesystem does not rename over an existing file
+	unlink(tracePath);
+	if (rename(tempPath, tracePath) != 0)
+		DEBUG_FUNCTION_LINE_ERR("Failed to replace the prefetch trace");
+}
+
+// Caller holds the mutex
+static void freeBuffer(PrefetchBuffer *buffer) {
+	if (buffer->state == BUFFER_READY && buffer->served < buffer->length)
+		addCounter(&prefetchStats.bytesWasted, buffer->length - buffer->served);
+
+	__atomic_fetch_sub(&prefetchStats.bytesAllocated, buffer->length, __ATOMIC_RELAXED);
+	freePoolBuffer(buffer->data);
+	memset(buffer, 0, sizeof(PrefetchBuffer));
+}
+
+// Caller holds the mutex. Makes room by dropping what the game went past
+// without reading, returns NULL if every slab is still taken.
+static PrefetchBuffer *claimBuffer(uint32_t length) {
+	PrefetchBuffer *buffer = NULL;
+	for (uint32_t i = 0; i < MAX_PREFETCH_BUFFERS; i++) {
+		if (buffers[i].state == BUFFER_READY && buffers[i].index < consumedIndex)
+			freeBuffer(&buffers[i]);
+
+		if (buffers[i].state == BUFFER_FREE && !buffer)
+			buffer = &buffers[i];
+	}
+
+	if (!buffer)
+		return NULL;
+
+	buffer->data = (char *)allocPoolSlab(POOL_PREFETCH);
+	if (!buffer->data)
+		return NULL;
+
+	buffer->state  = BUFFER_FETCHING;
+	buffer->length = length;
+	__atomic_fetch_add(&prefetchStats.bytesAllocated, length, __ATOMIC_RELAXED);
+	return buffer;
+}
+
+static void closeHostFile() {
+	if (!hostHandle)
+		return;
+
+	uint32_t args = htonl(hostHandle);
+	sendRequest(OP_CLOSE, &args, 4, NULL, 0);
+	hostHandle = 0;
+}
+
+static bool openHostFile(uint32_t fileIndex) {
+	if (hostHandle && hostFile == fileIndex)
+		return true;
+
+	closeHostFile();
+
+	uint32_t handle = 0;
+	pathRequest(OP_OPEN, plan.paths + plan.files[fileIndex].path, &handle, 4);
+	hostHandle = ntohl(handle);
+	hostFile   = fileIndex;
+	hostPos    = 0;
+	return hostHandle != 0;
+}
+
+// How much of the range is worth fetching, 0 for files the game will not
+// get from the host
+static uint32_t prefetchLength(const TraceRange *range) {
+	const TraceFile *traced = &plan.files[range->file];
+	if (!traced->hash || isCachedFile(traced->hash))
+		return 0;
+
+	const ManifestEntry *entry = findManifestEntryByHash(traced->hash);
+	if (!entry || range->offset >= entry->size)
+		return 0;
+
+	// A trace from an older run may hold longer ranges than fit in a slab
+	uint32_t length = range->length;
+	if (length > PREFETCH_RANGE_MAX)
+		length = PREFETCH_RANGE_MAX;
+	if (length > entry->size - range->offset)
+		length = entry->size - range->offset;
+	return length;
+}
+
+// Runs on the I/O thread, one range per turn so requests the game queues in
+// the meantime are not held up for long
+static void runPrefetch(AsyncRequest *request) {
+	while (!stopping && clientEnabled && nextRange < plan.rangeCount) {
+		const TraceRange *range = &plan.ranges[nextRange];
+		uint32_t length = prefetchLength(range);
+		if (!length) {
+			nextRange++;
+			continue;
+		}
+
+		OSLockMutex(&mutex);
+		PrefetchBuffer *buffer = claimBuffer(length);
+		if (buffer) {
+			buffer->index  = nextRange;
+			buffer->hash   = plan.files[range->file].hash;
+			buffer->offset = range->offset;
+		} else {
+			// Woken up by copyFromPrefetch() once the game made room
+			parked = true;
+		}
+		OSUnlockMutex(&mutex);
+
+		if (!buffer)
+			return;
+
+		uint32_t received = 0;
+		if (openHostFile(range->file)) {
+			if (hostPos != range->offset) {
+				uint32_t args[2] = { htonl(hostHandle), htonl(range->offset) };
+				sendRequest(OP_SET_POS, args, sizeof(args), NULL, 0);
+				hostPos = range->offset;
+			}
+
+			uint32_t args[3] = { htonl(hostHandle), htonl(1), htonl(length) };
+			uint32_t reply[2];
+			received = requestReply(OP_READ, args, sizeof(args), reply, sizeof(reply), buffer->data, length);
+			hostPos += ntohl(reply[1]); // Even if a chunk failed to decode and less arrived
+		} else {
+			plan.files[range->file].hash = 0;
+		}
+
+		OSLockMutex(&mutex);
+		if (buffer->stale || received == 0) {
+			freeBuffer(buffer);
+		} else {
+			buffer->state  = BUFFER_READY;
+			buffer->length = received;
+			__atomic_fetch_sub(&prefetchStats.bytesAllocated, length - received, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&prefetchStats.ranges, 1, __ATOMIC_RELAXED);
+			addCounter(&prefetchStats.bytesFetched, received);
+		}
+		OSUnlockMutex(&mutex);
+
+		nextRange++;
+		queueAsyncRequest(request);
+		return;
+	}
+
+	closeHostFile();
+}
+
+void initPrefetch() {
+	OSInitMutex(&mutex);
+}
+
+// Loads the trace the title's last run left and starts fetching it, and
+// starts recording a new one. Needs the manifest, files are traced by hash.
+void startPrefetch(const char *titleID) {
+	closePrefetch();
+	if (!prefetchBudget || !hasManifest())
+		return;
+
+	snprintf(tracePath, sizeof(tracePath), TRACE_ROOT "/%s", titleID);
+	mkdir(TRACE_ROOT, 0777);
+	mkdir(tracePath, 0777);
+	snprintf(tracePath, sizeof(tracePath), TRACE_ROOT "/%s/.trace", titleID);
+
+	OSLockMutex(&mutex);
+	if (!allocTrace(&trace))
+		DEBUG_FUNCTION_LINE_ERR("Failed to allocate the prefetch trace");
+	stopping = false;
+	OSUnlockMutex(&mutex);
+
+	if (!loadTrace(&plan))
+		return;
+
+	DEBUG_FUNCTION_LINE("Prefetching %u ranges of %u files", plan.rangeCount, plan.fileCount);
+	if (!isIoThreadRunning())
+		return;
+
+	memset(&prefetchRequest, 0, sizeof(prefetchRequest));
+	prefetchRequest.run = runPrefetch;
+	queueAsyncRequest(&prefetchRequest);
+}
+
+// Keeps prefetching from holding up the end of the application
+void stopPrefetch() {
+	stopping = true;
+}
+
+// Called once the I/O thread is stopped, saves what this run recorded
+void closePrefetch() {
+	OSLockMutex(&mutex);
+	if (trace.rangeCount)
+		saveTrace(&trace);
+
+	for (uint32_t i = 0; i < MAX_PREFETCH_BUFFERS; i++) {
+		if (buffers[i].state != BUFFER_FREE)
+			freeBuffer(&buffers[i]);
+	}
+
+	freeTrace(&trace);
+	freeTrace(&plan);
+	nextRange = 0;
+	consumedIndex = 0;
+	parked = false;
+	OSUnlockMutex(&mutex);
+
+	// Parked halfway through a file
+	if (clientEnabled)
+		closeHostFile();
+	hostHandle = 0;
+}
+
+static bool isReadOnlyMode(const char *mode) {
+	return mode[0] == 'r' && !strchr(mode, '+');
+}
+
+// Caller holds the mutex
+static int32_t findTracedFile(uint64_t hash) {
+	if (trace.lastFile < trace.fileCount && trace.files[trace.lastFile].hash == hash)
+		return trace.lastFile;
+
+	for (uint32_t i = 0; i < trace.fileCount; i++) {
+		if (trace.files[i].hash == hash)
+			return i;
+	}
+	return -1;
+}
+
+// Only files opened read-only from the host are traced, the ones the SD
+// cache serves are local already
+void recordTraceOpen(const char *path, uint64_t hash, const char *mode) {
+	if (!trace.files || !isReadOnlyMode(mode))
+		return;
+
+	OSLockMutex(&mutex);
+	uint32_t pathLength = strlen(path) + 1;
+	if (trace.files && findTracedFile(hash) < 0 && trace.fileCount < MAX_TRACE_FILES &&
+	    trace.pathsLength + pathLength <= TRACE_PATHS_SIZE) {
+		TraceFile *traced = &trace.files[trace.fileCount++];
+		traced->hash     = hash;
+		traced->path     = trace.pathsLength;
+		traced->reserved = 0;
+		memcpy(trace.paths + trace.pathsLength, path, pathLength);
+		trace.pathsLength += pathLength;
+	}
+	OSUnlockMutex(&mutex);
+}
+
+// Records a read of `length` bytes at the file's position, continuing the
+// last range if it picks up where that one ended
+void recordTraceRead(RedirectedFile *file, uint32_t length) {
+	if (!trace.files || !file->hash)
+		return;
+
+	OSLockMutex(&mutex);
+	int32_t index = trace.files ? findTracedFile(file->hash) : -1;
+	uint32_t offset = file->pos;
+
+	while (index >= 0 && length) {
+		TraceRange *last = trace.rangeCount ? &trace.ranges[trace.rangeCount - 1] : NULL;
+		if (last && last->file == index && last->offset + last->length == offset && last->length < PREFETCH_RANGE_MAX) {
+			uint32_t added = PREFETCH_RANGE_MAX - last->length;
+			if (added > length)
+				added = length;
+
+			last->length += added;
+			offset += added;
+			length -= added;
+			continue;
+		}
+
+		if (trace.rangeCount == MAX_TRACE_RANGES)
+			break;
+
+		TraceRange *range = &trace.ranges[trace.rangeCount++];
+		range->file     = index;
+		range->reserved = 0;
+		range->offset   = offset;
+		range->length   = 0;
+		__atomic_fetch_add(&prefetchStats.recorded, 1, __ATOMIC_RELAXED);
+	}
+
+	if (index >= 0)
+		trace.lastFile = index;
+	OSUnlockMutex(&mutex);
+}
+
+// Copies whatever part of [pos, pos + length) the prefetched ranges hold,
+// only ever from the start of that range
+uint32_t copyFromPrefetch(RedirectedFile *file, char *dest, uint32_t length) {
+	if (!plan.files || !file->hash)
+		return 0;
+
+	uint32_t done = 0;
+	bool wake = false;
+
+	OSLockMutex(&mutex);
+	for (uint32_t i = 0; i < MAX_PREFETCH_BUFFERS && done < length;) {
+		PrefetchBuffer *buffer = &buffers[i];
+		uint32_t pos = file->pos + done;
+		if (buffer->state != BUFFER_READY || buffer->hash != file->hash ||
+		    pos < buffer->offset || pos >= buffer->offset + buffer->length) {
+			i++;
+			continue;
+		}
+
+		uint32_t available = buffer->offset + buffer->length - pos;
+		uint32_t copied = length - done < available ? length - done : available;
+		memcpy(dest + done, buffer->data + (pos - buffer->offset), copied);
+		done += copied;
+		buffer->served += copied;
+
+		if (buffer->index > consumedIndex)
+			consumedIndex = buffer->index;
+
+		if (buffer->served >= buffer->length) {
+			freeBuffer(buffer);
+			wake = parked;
+			parked = false;
+		}
+
+		// The next part may be in any buffer
+		i = 0;
+	}
+	OSUnlockMutex(&mutex);
+
+	if (wake && isIoThreadRunning())
+		queueAsyncRequest(&prefetchRequest);
+
+	if (done) {
+		addCounter(&prefetchStats.bytesServed, done);
+		if (done == length)
+			__atomic_fetch_add(&prefetchStats.hits, 1, __ATOMIC_RELAXED);
+		writeCacheFill(file, file->pos, dest, done);
+		file->pos += done;
+	}
+	return done;
+}
+
+// The host changed the file or the game writes to it. What is being
+// fetched is dropped once it arrives.
+void dropPrefetched(uint64_t hash) {
+	if (!plan.files)
+		return;
+
+	OSLockMutex(&mutex);
+	for (uint32_t i = 0; i < MAX_PREFETCH_BUFFERS; i++) {
+		if (buffers[i].hash != hash)
+			continue;
+
+		if (buffers[i].state == BUFFER_READY)
+			freeBuffer(&buffers[i]);
+		else if (buffers[i].state == BUFFER_FETCHING)
+			buffers[i].stale = true;
+	}
+	OSUnlockMutex(&mutex);
+}
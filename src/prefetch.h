@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "handles.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Sequential reads are merged into ranges of up to this size, each is
+// fetched into a slab of POOL_PREFETCH
+#define PREFETCH_RANGE_MAX 0x20000
+
+typedef struct PrefetchStats {
+	uint32_t ranges;      // Ranges of the last run's trace fetched ahead of the game
+	uint32_t hits;        // Reads served entirely from them
+	Counter64 bytesFetched;
+	Counter64 bytesServed;
+	Counter64 bytesWasted; // Fetched but dropped before the game read them
+	uint32_t bytesAllocated;
+	uint32_t recorded;    // Ranges in the trace of this run
+} PrefetchStats;
+
+extern PrefetchStats prefetchStats;
+
+void initPrefetch();
+void startPrefetch(const char *titleID);
+void stopPrefetch();
+void closePrefetch();
+
+void recordTraceOpen(const char *path, uint64_t hash, const char *mode);
+void recordTraceRead(RedirectedFile *file, uint32_t length);
+
+uint32_t copyFromPrefetch(RedirectedFile *file, char *dest, uint32_t length);
+void dropPrefetched(uint64_t hash);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
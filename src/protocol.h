@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#define PROTOCOL_VERSION 2
+
+#define OP_HELLO      0x01
+#define OP_OPEN       0x02
+#define OP_READ       0x03
+#define OP_WRITE      0x04
+#define OP_CLOSE      0x05
+#define OP_OPEN_SAVE  0x06
+#define OP_DEBUG      0x07
+#define OP_STAT_FILE  0x08
+#define OP_SET_POS    0x09
+#define OP_CRASH      0x0A
+#define OP_DEBUG_FILE 0x0B
+#define OP_FILE_CHECK 0x0C
+#define OP_DELTA      0x0D
+#define OP_INVALIDATE 0x0E // Host to console only, see receiveInvalidation()
+#define OP_RELOAD     0x0F // See reload.cpp
+#define OP_READ_AT    0x10 // OP_READ at an offset given with it, see requestRead()
+
+// Capabilities negotiated in the v2 handshake, the host replies with
+// the subset of the ones we asked for that it supports
+#define CAP_MANIFEST    (1 << 0)
+#define CAP_COMPRESSION (1 << 1) // Read replies may be compressed, see compression.h
+#define CAP_DELTA       (1 << 2) // OP_DELTA, see delta.cpp
+#define CAP_INVALIDATE  (1 << 3) // The host sends OP_INVALIDATE when its files change
+#define CAP_RELOAD      (1 << 4) // The host may push new code with OP_RELOAD
+#define CAP_SAVES       (1 << 5) // OP_OPEN_SAVE, and OP_CLOSE of a written file is acknowledged
+#define CAP_READ_AT     (1 << 6) // OP_READ_AT
+
+#define HELLO_MAGIC   "CLv2"
+#define REPLY_V1      0xCAFE
+#define REPLY_V1_MANIFEST 0xCAF1
+#define REPLY_V2      0xCAF2
+
+// Every v2 request and reply starts with this header, followed by
+// `length` bytes of payload. All fields are big endian.
+typedef struct __attribute__((__packed__)) MessageHeader {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t id;
+	uint32_t length;
+} MessageHeader;
+
+// MessageHeader::flags
+#define MSG_FLAG_COMPRESSED (1 << 0) // The body after the fixed reply fields is chunked
+#define MSG_FLAG_REMOVED    (1 << 1) // OP_INVALIDATE: the files are gone, not changed
+
+// Same as FS_MAX_LOCALPATH_SIZE + FS_MAX_MOUNTPATH_SIZE
+#define MAX_PATH_LENGTH 0x27F
+
+// Largest request that is assembled on the stack and written at once
+#define MAX_REQUEST_SIZE (sizeof(MessageHeader) + 4 + MAX_PATH_LENGTH)
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,56 @@
+#include <string.h>
+
+#include "bufferpool.h"
+#include "globals.h"
+#include "readahead.h"
+
+ReadAheadStats readAheadStats;
+
+// Gives the file a block buffer if a slab is left, there are as many as
+// readAheadBudget allows. Files without one are simply read straight from
+// the host.
+bool allocReadAhead(RedirectedFile *file) {
+	file->blockStart = 0;
+	file->blockLength = 0;
+
+	file->block = (char *)allocPoolSlab(POOL_READ_AHEAD);
+	if (!file->block)
+		return false;
+
+	__atomic_fetch_add(&readAheadStats.bytesAllocated, readAheadBlockSize, __ATOMIC_RELAXED);
+	return true;
+}
+
+void freeReadAhead(RedirectedFile *file) {
+	if (!file->block)
+		return;
+
+	freePoolBuffer(file->block);
+	file->block = NULL;
+	__atomic_fetch_sub(&readAheadStats.bytesAllocated, readAheadBlockSize, __ATOMIC_RELAXED);
+}
+
+void invalidateReadAhead(RedirectedFile *file) {
+	file->blockStart = 0;
+	file->blockLength = 0;
+}
+
+// Copies whatever part of [pos, pos + length) the cached block holds,
+// only ever from the start of that range
+uint32_t copyFromReadAhead(RedirectedFile *file, char *dest, uint32_t length) {
+	if (!file->block || file->pos < file->blockStart)
+		return 0;
+
+	uint32_t offset = file->pos - file->blockStart;
+	if (offset >= file->blockLength)
+		return 0;
+
+	uint32_t available = file->blockLength - offset;
+	if (length > available)
+		length = available;
+
+	memcpy(dest, file->block + offset, length);
+	file->pos += length;
+	addCounter(&readAheadStats.bytesServed, length);
+	return length;
+}
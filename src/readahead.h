@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "handles.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct ReadAheadStats {
+	uint32_t hits;   // Reads served entirely from a cached block
+	uint32_t misses; // Blocks fetched from the host
+	Counter64 bytesServed;
+	Counter64 bytesFetched;
+	uint32_t bytesAllocated;
+} ReadAheadStats;
+
+extern ReadAheadStats readAheadStats;
+
+bool allocReadAhead(RedirectedFile *file);
+void freeReadAhead(RedirectedFile *file);
+void invalidateReadAhead(RedirectedFile *file);
+
+uint32_t copyFromReadAhead(RedirectedFile *file, char *dest, uint32_t length);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <coreinit/time.h>
+
+#include "recorder.h"
+
+// The last file system calls the game made, kept so a crash report can say
+// what the game was doing. It is always on, so recording must stay cheap:
+// taking a slot is a single atomic add and nothing ever waits. A slot may
+// be rewritten while the crash handler reads it, the sequence number tells
+// when that happened.
+
+// A power of two, so the slot is the low bits of the sequence number
+#define FLIGHT_EVENTS 128
+
+static const char *eventNames[] = {"?", "open", "save", "read", "write", "seek", "stat", "close"};
+
+static FlightEvent events[FLIGHT_EVENTS];
+static uint32_t lastEvent = 0;
+
+// Returns the event's sequence number, for finishEvent()
+uint32_t recordEvent(EventOp op, uint64_t hash, uint32_t offset, uint32_t size) {
+	uint32_t sequence = __atomic_add_fetch(&lastEvent, 1, __ATOMIC_RELAXED);
+	if (!sequence) // 0 marks a slot being written, after 4G events
+		sequence = __atomic_add_fetch(&lastEvent, 1, __ATOMIC_RELAXED);
+
+	FlightEvent *event = &events[sequence & (FLIGHT_EVENTS - 1)];
+	__atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+	event->op       = op;
+	event->hash     = hash;
+	event->offset   = offset;
+	event->size     = size;
+	event->start    = (uint32_t)OSGetTime();
+	event->duration = 0;
+	__atomic_store_n(&event->sequence, sequence, __ATOMIC_RELEASE);
+
+	return sequence;
+}
+
+void finishEvent(uint32_t sequence) {
+	FlightEvent *event = &events[sequence & (FLIGHT_EVENTS - 1)];
+
+	// Unless the ring went round since, and the slot is another event's now
+	if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != sequence)
+		return;
+
+	uint32_t duration = (uint32_t)OSGetTime() - event->start;
+	event->duration = duration ? duration : 1;
+}
+
+// One line per event, oldest first, with how long ago it started. Returns
+// the length written, which always leaves `buffer` terminated.
+uint32_t formatEvents(char *buffer, uint32_t size) {
+	if (!size)
+		return 0;
+	buffer[0] = '\0';
+
+	uint32_t last  = __atomic_load_n(&lastEvent, __ATOMIC_ACQUIRE);
+	uint32_t count = last < FLIGHT_EVENTS ? last : FLIGHT_EVENTS;
+	uint32_t now   = (uint32_t)OSGetTime();
+	uint32_t length = 0;
+
+	for (uint32_t sequence = last - count + 1; count; sequence++, count--) {
+		FlightEvent *slot = &events[sequence & (FLIGHT_EVENTS - 1)];
+		uint32_t seen = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		FlightEvent event = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		// Being written, or replaced by a newer event while it was copied
+		if (seen != sequence || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+			continue;
+		if (event.op >= sizeof(eventNames) / sizeof(eventNames[0]))
+			continue;
+
+		char duration[16];
+		if (event.duration)
+			snprintf(duration, sizeof(duration), "%u us", (uint32_t)OSTicksToMicroseconds(event.duration));
+		else
+			strcpy(duration, "running");
+
+		int num = snprintf(buffer + length, size - length, "%8u %9u us ago %-5s %016llX @%08X %8u %s\n",
+		                   sequence, (uint32_t)OSTicksToMicroseconds(now - event.start), eventNames[event.op],
+		                   (unsigned long long)event.hash, event.offset, event.size, duration);
+		if (num < 0 || (uint32_t)num >= size - length) {
+			buffer[length] = '\0';
+			break;
+		}
+		length += num;
+	}
+
+	return length;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// What a recorded event did, see recordEvent()
+typedef enum EventOp {
+	EVENT_OPEN = 1,
+	EVENT_OPEN_SAVE,
+	EVENT_READ,
+	EVENT_WRITE,
+	EVENT_SEEK,
+	EVENT_STAT,
+	EVENT_CLOSE,
+} EventOp;
+
+typedef struct FlightEvent {
+	uint32_t sequence; // Counts from 1, 0 while the slot is being written
+	uint8_t op;
+	uint8_t reserved[3];
+	uint64_t hash;     // Manifest hash of the file's path, 0 if unknown
+	uint32_t offset;
+	uint32_t size;
+	uint32_t start;    // Low word of OSGetTime()
+	uint32_t duration; // Ticks, 0 while the call has not returned
+} FlightEvent;
+
+uint32_t recordEvent(EventOp op, uint64_t hash, uint32_t offset, uint32_t size);
+void finishEvent(uint32_t sequence);
+
+uint32_t formatEvents(char *buffer, uint32_t size);
+
+#ifdef __cplusplus
+}
+
+// Records the event for as long as it is in scope
+struct RecordedEvent {
+	uint32_t sequence;
+	RecordedEvent(EventOp op, uint64_t hash, uint32_t offset, uint32_t size) : sequence(recordEvent(op, hash, offset, size)) {}
+	~RecordedEvent() { finishEvent(sequence); }
+};
+#endif // __cplusplus
@@ -0,0 +1,329 @@
+#include <string.h>
+
+#include <coreinit/event.h>
+#include <coreinit/time.h>
+#include <netinet/in.h>
+#include <utils/logger.h>
+
+#include "channel.h"
+#include "bufferpool.h"
+#include "checksum.h"
+#include "filesocket.h"
+#include "globals.h"
+#include "iothread.h"
+#include "loader.h"
+#include "protocol.h"
+#include "reload.h"
+
+// A live reload replaces the code, data and patches of a running title
+// with a new build the host pushed, without relaunching it:
+//
+// 1. The host sends OP_RELOAD with ID 0 and the section table of the new
+//    build, u32 count followed by count of u32 type, address, size, crc.
+// 2. The I/O thread asks for each code and data section a window of blocks
+//    at a time, with the CRC-32 of every block of what was loaded before:
+//    u32 type, first block, block count, then the CRCs. The reply is u32
+//    changed count, and as the body the indices of the changed blocks
+//    followed by IMAGE_BLOCK_SIZE bytes for each of them.
+// 3. The patches are asked for with type SECTION_PATCHES and no blocks, the
+//    reply body is the whole Patches.hax.
+// 4. Once everything was fetched and checked, the render thread writes the
+//    changed blocks and then the patches in one pass between two frames,
+//    see applyStagedReload(). A reload that fails before leaves memory
+//    as it was.
+// 5. The result goes back to the host as OP_RELOAD with ID 0: u32 1 if
+//    everything was applied, 0 otherwise, and u32 bytes written.
+//
+// Data is written over the running title's state, variables in blocks that
+// changed are reset to their new initial values. Constructors are not run
+// again.
+//
+// Only the render thread is held at its safe point. The title's threads on
+// the other cores, audio or streaming for instance, are not suspended and
+// keep running while the blocks are written, so code they execute or data
+// they use may be seen half old and half new. Reloads are meant for changes
+// to what runs on the render thread.
+
+#define MAX_RELOAD_SECTIONS 8
+
+// Blocks asked for per round trip, bounds the receive buffer
+#define RELOAD_WINDOW_BLOCKS 0x100
+
+typedef struct ReloadSection {
+	uint32_t type;
+	uint32_t address;
+	uint32_t size;
+	uint32_t crc;
+} ReloadSection;
+
+ReloadStats reloadStats;
+
+static ReloadSection sections[MAX_RELOAD_SECTIONS];
+static uint32_t sectionCount = 0;
+
+// Not from the I/O thread's pool, the reader must never wait for one
+static AsyncRequest reloadRequest;
+static volatile bool busy = false;
+static volatile bool ready = false;
+
+// Signalled by the render thread once it applied a staged reload
+static OSEvent appliedEvent;
+
+void initReload() {
+	OSInitEvent(&appliedEvent, FALSE, OS_EVENT_MODE_AUTO);
+}
+
+// Reloads are only accepted once the images were loaded, and not while the
+// title shuts down
+void setReloadReady(bool value) {
+	ready = value;
+}
+
+static const ReloadSection *findReloadSection(uint32_t type) {
+	for (uint32_t i = 0; i < sectionCount; i++) {
+		if (sections[i].type == type)
+			return &sections[i];
+	}
+	return NULL;
+}
+
+// Changed blocks of one window, fetched and waiting to be applied. The
+// indices follow the header, then IMAGE_BLOCK_SIZE bytes for each of them.
+typedef struct StagedWindow {
+	struct StagedWindow *next;
+	LoadedImage *image;
+	uint32_t changed;
+} StagedWindow;
+
+// Everything a reload writes, complete before any of it is
+typedef struct StagedReload {
+	StagedWindow *windows;
+	StagedWindow **last;
+	char *patches;
+	uint32_t patchesLength;
+
+	// Filled in by the safe point
+	uint32_t written;
+	bool ok;
+} StagedReload;
+
+typedef enum ApplyState {
+	APPLY_IDLE,
+	APPLY_STAGED,  // Waiting for the next frame
+	APPLY_RUNNING, // Taken by the render thread
+	APPLY_DONE,
+} ApplyState;
+
+// How long the I/O thread waits for the title to reach the end of a frame
+#define APPLY_WAIT_MS 2000
+
+static StagedReload staged;
+static uint32_t applyState = APPLY_IDLE;
+
+// Fetches the blocks of the section's image that differ from what was
+// loaded, returns false if it can not be reloaded in place. Nothing is
+// written yet, the blocks are queued on `staged`.
+static bool fetchImage(const ReloadSection *section, char *buffer) {
+	LoadedImage *image = findLoadedImage(section->type);
+	if (!image || image->address != section->address) {
+		DEBUG_FUNCTION_LINE_ERR("Section %u moved or was not loaded, relaunch the title", section->type);
+		return false;
+	}
+
+	if (!resizeLoadedImage(image, section->size))
+		return false;
+
+	uint32_t args[3 + RELOAD_WINDOW_BLOCKS];
+	for (uint32_t first = 0; first < image->blockCount; first += RELOAD_WINDOW_BLOCKS) {
+		uint32_t count = image->blockCount - first;
+		if (count > RELOAD_WINDOW_BLOCKS)
+			count = RELOAD_WINDOW_BLOCKS;
+
+		args[0] = htonl(section->type);
+		args[1] = htonl(first);
+		args[2] = htonl(count);
+		for (uint32_t i = 0; i < count; i++)
+			args[3 + i] = htonl(image->blockCrcs[first + i]);
+
+		uint32_t changed = 0;
+		uint32_t received = requestReply(OP_RELOAD, args, (3 + count) * 4, &changed, 4,
+		                                 buffer, count * (4 + IMAGE_BLOCK_SIZE));
+		changed = ntohl(changed);
+		if (!clientEnabled || changed > count || received != changed * (4 + IMAGE_BLOCK_SIZE))
+			return false;
+		if (changed == 0)
+			continue;
+
+		StagedWindow *window = (StagedWindow *)allocPoolBuffer(POOL_LOADER, sizeof(StagedWindow) + received);
+		if (!window)
+			return false;
+
+		window->next    = NULL;
+		window->image   = image;
+		window->changed = changed;
+		*staged.last = window;
+		staged.last  = &window->next;
+
+		uint32_t *indices = (uint32_t *)(window + 1);
+		memcpy(indices, buffer, received);
+		for (uint32_t i = 0; i < changed; i++) {
+			indices[i] = ntohl(indices[i]);
+			if (indices[i] < first || indices[i] >= first + count)
+				return false;
+		}
+
+		reloadStats.bytesFetched += changed * IMAGE_BLOCK_SIZE;
+	}
+
+	return true;
+}
+
+static bool fetchPatches(const ReloadSection *section) {
+	staged.patches = (char *)allocPoolBuffer(POOL_LOADER, section->size);
+	if (!staged.patches)
+		return false;
+
+	uint32_t args[3] = { htonl(SECTION_PATCHES), 0, 0 };
+	uint32_t length = 0;
+	uint32_t received = requestReply(OP_RELOAD, args, sizeof(args), &length, 4, staged.patches, section->size);
+
+	staged.patchesLength = section->size;
+	return received == section->size && ntohl(length) == section->size &&
+	       crc32(0, staged.patches, section->size) == section->crc;
+}
+
+// Called by the render thread once per frame, before the frame is shown.
+// The render thread's own code is between frames there, and a staged
+// reload is nothing but copies from memory by then, so the new build goes
+// in as a whole rather than window by window while the game runs on. The
+// other cores are not stopped meanwhile, see the top of this file.
+void applyStagedReload() {
+	if (__atomic_load_n(&applyState, __ATOMIC_RELAXED) != APPLY_STAGED)
+		return;
+
+	// The I/O thread may have given up waiting just now
+	uint32_t expected = APPLY_STAGED;
+	if (!__atomic_compare_exchange_n(&applyState, &expected, APPLY_RUNNING, false,
+	                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	for (StagedWindow *window = staged.windows; window; window = window->next) {
+		const uint32_t *indices = (const uint32_t *)(window + 1);
+		staged.written += updateImageBlocks(window->image, indices, (const char *)(indices + window->changed),
+		                                    window->changed);
+	}
+
+	staged.ok = !staged.patches || applyPatches(staged.patches, staged.patchesLength);
+	__atomic_store_n(&applyState, APPLY_DONE, __ATOMIC_RELEASE);
+	OSSignalEvent(&appliedEvent);
+}
+
+// Hands the staged reload to the render thread and waits for it to be
+// applied. Returns false if the title drew no frame in time, nothing was
+// written then.
+static bool applyAtSafePoint() {
+	__atomic_store_n(&applyState, APPLY_STAGED, __ATOMIC_RELEASE);
+
+	// The timeout is in nanoseconds
+	if (!OSWaitEventWithTimeout(&appliedEvent, APPLY_WAIT_MS * 1000000ULL)) {
+		uint32_t expected = APPLY_STAGED;
+		if (__atomic_compare_exchange_n(&applyState, &expected, APPLY_IDLE, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			DEBUG_FUNCTION_LINE_ERR("The title drew no frame in %u ms, not applying the reload", APPLY_WAIT_MS);
+			return false;
+		}
+
+		// Taken by the render thread just now, which is bound to finish it
+		OSWaitEvent(&appliedEvent);
+	}
+
+	__atomic_store_n(&applyState, APPLY_IDLE, __ATOMIC_RELAXED);
+	return staged.ok;
+}
+
+static void freeStagedReload() {
+	while (staged.windows) {
+		StagedWindow *next = staged.windows->next;
+		freePoolBuffer(staged.windows);
+		staged.windows = next;
+	}
+
+	freePoolBuffer(staged.patches);
+	memset(&staged, 0, sizeof(staged));
+	staged.last = &staged.windows;
+}
+
+// Runs on the I/O thread, so it is serialized with the game's asynchronous
+// requests. Every section is fetched and checked first, then the render
+// thread applies them in the order they are loaded at boot.
+static void runReload(AsyncRequest *request) {
+	char *buffer = (char *)allocPoolBuffer(POOL_LOADER, RELOAD_WINDOW_BLOCKS * (4 + IMAGE_BLOCK_SIZE));
+	bool ok = buffer != NULL;
+
+	freeStagedReload();
+	static const uint32_t imageTypes[] = { SECTION_CODE, SECTION_DATA };
+	for (uint32_t type : imageTypes) {
+		const ReloadSection *section = findReloadSection(type);
+		if (ok && section)
+			ok = fetchImage(section, buffer);
+	}
+
+	const ReloadSection *patches = findReloadSection(SECTION_PATCHES);
+	if (ok && patches)
+		ok = fetchPatches(patches);
+
+	freePoolBuffer(buffer);
+
+	if (ok)
+		ok = applyAtSafePoint();
+	uint32_t written = staged.written;
+	freeStagedReload();
+
+	if (ok)
+		reloadStats.reloads++;
+	else
+		reloadStats.failures++;
+	reloadStats.bytesWritten += written;
+
+	DEBUG_FUNCTION_LINE("Reload %s, %u bytes written", ok ? "applied" : "failed", written);
+	uint32_t result[2] = { htonl(ok ? 1 : 0), htonl(written) };
+	sendRequest(OP_RELOAD, result, sizeof(result), NULL, 0);
+	busy = false;
+}
+
+// Called on the reader thread with the section table of an OP_RELOAD from
+// the host. Returns the number of payload bytes consumed.
+uint32_t receiveReload(uint32_t length) {
+	uint32_t count;
+	if (length < 4 || !receiveFile((char *)&count, 4))
+		return 0;
+
+	count = ntohl(count);
+	if (count > MAX_RELOAD_SECTIONS || length < 4 + count * sizeof(ReloadSection))
+		return 4;
+
+	// The table is only touched again once the previous reload is done
+	if (busy || !ready || !isIoThreadRunning()) {
+		DEBUG_FUNCTION_LINE_WARN("Not ready for a reload, ignoring it");
+		uint32_t result[2] = { 0, 0 };
+		sendRequest(OP_RELOAD, result, sizeof(result), NULL, 0);
+		return 4;
+	}
+
+	if (!receiveFile((char *)sections, count * sizeof(ReloadSection)))
+		return 4;
+
+	for (uint32_t i = 0; i < count; i++) {
+		sections[i].type    = ntohl(sections[i].type);
+		sections[i].address = ntohl(sections[i].address);
+		sections[i].size    = ntohl(sections[i].size);
+		sections[i].crc     = ntohl(sections[i].crc);
+	}
+	sectionCount = count;
+
+	busy = true;
+	memset(&reloadRequest, 0, sizeof(reloadRequest));
+	reloadRequest.run = runReload;
+	queueAsyncRequest(&reloadRequest);
+	return 4 + count * sizeof(ReloadSection);
+}
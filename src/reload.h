@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct ReloadStats {
+	uint32_t reloads;  // Applied completely
+	uint32_t failures;
+	uint64_t bytesFetched; // Changed blocks sent by the host
+	uint64_t bytesWritten; // The part of them that differed from memory
+} ReloadStats;
+
+extern ReloadStats reloadStats;
+
+void initReload();
+void setReloadReady(bool ready);
+uint32_t receiveReload(uint32_t length);
+void applyStagedReload();
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,704 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <coreinit/mutex.h>
+#include <coreinit/time.h>
+#include <netinet/in.h>
+#include <utils/logger.h>
+
+#include "channel.h"
+#include "delta.h"
+#include "globals.h"
+#include "iothread.h"
+#include "protocol.h"
+#include "sdcache.h"
+
+#define CACHE_ROOT      "fs:/vol/external01/cafeloader"
+#define CACHE_PATH_SIZE 96
+#define INDEX_MAGIC     0x434C4331 // "CLC1"
+
+// Far more files than any title has, anything above is a corrupt index
+#define MAX_INDEX_ENTRIES 0x10000
+
+// Each fill in progress keeps a file open on the SD card
+#define MAX_CACHE_FILLS 4
+
+// Tail fills fetch this much per turn of the I/O thread, so asynchronous
+// requests the game queues in the meantime are not held up for long
+#define TAIL_FILL_CHUNK 0x10000
+
+// Fills mark the index dirty, the I/O thread writes it at most this often
+// while the title runs and what is left once it ends
+#define INDEX_WRITE_INTERVAL_MS 30000
+
+// Files served from the SD card get handles from here on, well away from
+// the sequential ones the host hands out
+#define LOCAL_HANDLE_BASE 0xCA000000
+
+typedef struct CacheEntry {
+	uint64_t hash;
+	uint32_t size;
+	uint32_t mtime;
+	uint32_t lastUse;
+	uint32_t users; // Files open from this entry, it is not evicted meanwhile
+} CacheEntry;
+
+typedef struct CacheIndexHeader {
+	uint32_t magic;
+	uint32_t count;
+} CacheIndexHeader;
+
+// A copy of a host file being written to the cache as the game reads it.
+// Only data that continues the copy is written, gaps are left to the tail
+// fill the I/O thread runs once the game closes the file.
+struct CacheFill {
+	bool used;
+	bool failed;
+	int fd;
+
+	uint64_t hash;
+	uint32_t size;
+	uint32_t mtime;
+	uint32_t filled;
+
+	// Taken over from the file when the I/O thread finishes the copy
+	FSFileHandle handle;
+	uint32_t serverPos;
+
+	// Not from the I/O thread's pool: files are also closed on the I/O
+	// thread, which is the only one to return requests to it
+	AsyncRequest request;
+};
+
+SdCacheStats sdCacheStats;
+
+// Sorted by hash, the index file holds the same array
+static CacheEntry *entries = NULL;
+static uint32_t entryCount = 0;
+static uint32_t entryCapacity = 0;
+static uint32_t nextUse = 1;
+static bool dirty = false;
+
+static CacheFill fills[MAX_CACHE_FILLS];
+static char tailBuffer[TAIL_FILL_CHUNK] __attribute__((aligned(0x40)));
+
+static char cacheDir[64];
+static bool cacheOpen = false;
+static volatile bool stopping = false;
+static FSFileHandle nextLocalHandle = LOCAL_HANDLE_BASE;
+static OSMutex mutex;
+
+// Not from the I/O thread's pool, see CacheFill
+static AsyncRequest indexRequest;
+static bool indexQueued = false;
+static OSTime lastIndexWrite = 0;
+
+static bool isReadOnlyMode(const char *mode) {
+	return mode[0] == 'r' && !strchr(mode, '+');
+}
+
+static void entryPath(char *path, uint64_t hash, const char *suffix) {
+	snprintf(path, CACHE_PATH_SIZE, "%s/%016llX%s", cacheDir, (unsigned long long)hash, suffix);
+}
+
+static uint32_t lowerBound(uint64_t hash) {
+	uint32_t low = 0, high = entryCount;
+	while (low < high) {
+		uint32_t mid = (low + high) / 2;
+		if (entries[mid].hash < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static CacheEntry *findEntry(uint64_t hash) {
+	uint32_t index = lowerBound(hash);
+	if (index < entryCount && entries[index].hash == hash)
+		return &entries[index];
+	return NULL;
+}
+
+static bool insertEntry(const CacheEntry *entry) {
+	if (entryCount == entryCapacity) {
+		uint32_t capacity = entryCapacity ? entryCapacity * 2 : 64;
+		CacheEntry *grown = (CacheEntry *)realloc(entries, capacity * sizeof(CacheEntry));
+		if (!grown)
+			return false;
+		entries = grown;
+		entryCapacity = capacity;
+	}
+
+	uint32_t index = lowerBound(entry->hash);
+	memmove(&entries[index + 1], &entries[index], (entryCount - index) * sizeof(CacheEntry));
+	entries[index] = *entry;
+	entryCount++;
+	sdCacheStats.bytesCached += entry->size;
+	dirty = true;
+	return true;
+}
+
+static void removeEntry(CacheEntry *entry) {
+	char path[CACHE_PATH_SIZE];
+	entryPath(path, entry->hash, "");
+	unlink(path);
+
+	sdCacheStats.bytesCached -= entry->size;
+	uint32_t index = entry - entries;
+	memmove(&entries[index], &entries[index + 1], (entryCount - index - 1) * sizeof(CacheEntry));
+	entryCount--;
+	dirty = true;
+}
+
+// Evicts the least recently used entries until `needed` more bytes fit
+static bool makeRoom(uint32_t needed) {
+	while (sdCacheStats.bytesCached + needed > sdCacheLimit) {
+		CacheEntry *oldest = NULL;
+		for (uint32_t i = 0; i < entryCount; i++) {
+			if (entries[i].users == 0 && (!oldest || entries[i].lastUse < oldest->lastUse))
+				oldest = &entries[i];
+		}
+
+		if (!oldest)
+			return false;
+
+		removeEntry(oldest);
+		sdCacheStats.evictions++;
+	}
+
+	return true;
+}
+
+// The index is replaced by renaming a complete new one over it, see
+// writeIndex(). Power lost in between leaves only the new one.
+static void loadIndex() {
+	char path[CACHE_PATH_SIZE];
+	snprintf(path, sizeof(path), "%s/index.bin", cacheDir);
+
+	int index = open(path, O_RDONLY);
+	if (index < 0) {
+		snprintf(path, sizeof(path), "%s/index.tmp", cacheDir);
+		index = open(path, O_RDONLY);
+		if (index < 0)
+			return;
+	}
+
+	CacheIndexHeader header;
+	if (read(index, &header, sizeof(header)) == sizeof(header) && header.magic == INDEX_MAGIC &&
+	    header.count <= MAX_INDEX_ENTRIES) {
+		entries = (CacheEntry *)malloc(header.count * sizeof(CacheEntry));
+		if (entries && read(index, entries, header.count * sizeof(CacheEntry)) == (int)(header.count * sizeof(CacheEntry))) {
+			entryCount = entryCapacity = header.count;
+		} else {
+			free(entries);
+			entries = NULL;
+		}
+	}
+
+	close(index);
+
+	for (uint32_t i = 0; i < entryCount; i++) {
+		entries[i].users = 0;
+		sdCacheStats.bytesCached += entries[i].size;
+		if (entries[i].lastUse >= nextUse)
+			nextUse = entries[i].lastUse + 1;
+	}
+}
+
+// Written next to the old index first, so losing power while writing never
+// costs the whole cache
+static bool writeIndex(const CacheEntry *list, uint32_t count) {
+	char path[CACHE_PATH_SIZE], tempPath[CACHE_PATH_SIZE];
+	snprintf(path, sizeof(path), "%s/index.bin", cacheDir);
+	snprintf(tempPath, sizeof(tempPath), "%s/index.tmp", cacheDir);
+
+	int index = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (index < 0) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to write the SD cache index");
+		return false;
+	}
+
+	CacheIndexHeader header = { INDEX_MAGIC, count };
+	uint32_t length = count * sizeof(CacheEntry);
+	bool written = write(index, &header, sizeof(header)) == sizeof(header) &&
+	               write(index, list, length) == (int)length;
+	if (close(index) != 0 || !written) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to write the SD cache index");
+		unlink(tempPath);
+		return false;
+	}
+
+	// The SD card's filesystem does not rename over an existing file
+	unlink(path);
+	if (rename(tempPath, path) != 0) {
+		DEBUG_FUNCTION_LINE_ERR("Failed to replace the SD cache index");
+		return false;
+	}
+	return true;
+}
+
+// Runs on the I/O thread. It writes a copy of the entries, so opens and
+// fills don't wait for the SD card meanwhile.
+static void runIndexWrite(AsyncRequest *request) {
+	OSLockMutex(&mutex);
+	indexQueued = false;
+	uint32_t count = entryCount;
+	CacheEntry *copy = NULL;
+	if (cacheOpen && dirty)
+		copy = (CacheEntry *)malloc(count ? count * sizeof(CacheEntry) : 1);
+	if (copy) {
+		memcpy(copy, entries, count * sizeof(CacheEntry));
+		dirty = false;
+		lastIndexWrite = OSGetTime();
+	}
+	OSUnlockMutex(&mutex);
+
+	if (!copy)
+		return;
+
+	if (!writeIndex(copy, count)) {
+		OSLockMutex(&mutex);
+		dirty = true;
+		OSUnlockMutex(&mutex);
+	}
+	free(copy);
+}
+
+// Caller holds the mutex
+static void scheduleIndexWrite() {
+	if (indexQueued || stopping || !isIoThreadRunning())
+		return;
+
+	if (lastIndexWrite && OSGetTime() - lastIndexWrite < (OSTime)OSMillisecondsToTicks(INDEX_WRITE_INTERVAL_MS))
+		return;
+
+	indexQueued = true;
+	memset(&indexRequest, 0, sizeof(indexRequest));
+	indexRequest.run = runIndexWrite;
+	queueAsyncRequest(&indexRequest);
+}
+
+static bool isCurrent(const CacheEntry *cached, const ManifestEntry *entry) {
+	return cached->size == entry->size && cached->mtime == entry->mtime;
+}
+
+static bool canUpdate(const CacheEntry *cached) {
+	return (capabilities & CAP_DELTA) && cached->size >= DELTA_MIN_SIZE;
+}
+
+void initSdCache() {
+	OSInitMutex(&mutex);
+}
+
+// Loads the index of the title's cache and drops every entry the manifest
+// the host just sent no longer agrees with, so only changed files are
+// fetched over the network. Large ones are kept if the host can send
+// deltas, they are brought up to date when the game opens them.
+void openSdCache(const char *titleID) {
+	closeSdCache();
+	if (!sdCacheLimit || !hasManifest())
+		return;
+
+	char path[CACHE_PATH_SIZE];
+	snprintf(path, sizeof(path), CACHE_ROOT "/%s", titleID);
+	mkdir(CACHE_ROOT, 0777);
+	mkdir(path, 0777);
+
+	snprintf(cacheDir, sizeof(cacheDir), CACHE_ROOT "/%s/.cache", titleID);
+	mkdir(cacheDir, 0777);
+
+	OSLockMutex(&mutex);
+	loadIndex();
+
+	for (uint32_t i = 0; i < entryCount;) {
+		const ManifestEntry *entry = findManifestEntryByHash(entries[i].hash);
+		if (!entry || (!isCurrent(&entries[i], entry) && !canUpdate(&entries[i]))) {
+			removeEntry(&entries[i]);
+			continue;
+		}
+		i++;
+	}
+
+	// The limit may have been lowered since
+	makeRoom(0);
+	if (dirty && writeIndex(entries, entryCount))
+		dirty = false;
+
+	lastIndexWrite = 0;
+	stopping = false;
+	cacheOpen = true;
+	DEBUG_FUNCTION_LINE("SD cache holds %u files (%llu bytes)", entryCount, sdCacheStats.bytesCached);
+	OSUnlockMutex(&mutex);
+}
+
+static void abandonFill(CacheFill *fill) {
+	char path[CACHE_PATH_SIZE];
+	entryPath(path, fill->hash, ".tmp");
+
+	close(fill->fd);
+	unlink(path);
+
+	OSLockMutex(&mutex);
+	fill->used = false;
+	OSUnlockMutex(&mutex);
+}
+
+// Keeps tail fills from holding up the end of the application
+void stopSdCache() {
+	stopping = true;
+}
+
+void closeSdCache() {
+	for (uint32_t i = 0; i < MAX_CACHE_FILLS; i++) {
+		if (fills[i].used)
+			abandonFill(&fills[i]);
+	}
+
+	OSLockMutex(&mutex);
+	if (cacheOpen && dirty && writeIndex(entries, entryCount))
+		dirty = false;
+
+	free(entries);
+	entries = NULL;
+	entryCount = entryCapacity = 0;
+	sdCacheStats.bytesCached = 0;
+	cacheOpen = false;
+	OSUnlockMutex(&mutex);
+}
+
+// Caller holds the mutex. Returns NULL if no fill is free or the same file
+// is already being written, two copies would end up in the same place.
+static CacheFill *claimFill(const ManifestEntry *entry) {
+	CacheFill *fill = NULL;
+	for (uint32_t i = 0; i < MAX_CACHE_FILLS; i++) {
+		if (fills[i].used && fills[i].hash == entry->hash)
+			return NULL;
+
+		if (!fills[i].used && !fill)
+			fill = &fills[i];
+	}
+
+	if (!fill)
+		return NULL;
+
+	char path[CACHE_PATH_SIZE];
+	entryPath(path, entry->hash, ".tmp");
+	fill->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fill->fd < 0)
+		return NULL;
+
+	fill->used   = true;
+	fill->failed = false;
+	fill->hash   = entry->hash;
+	fill->size   = entry->size;
+	fill->mtime  = entry->mtime;
+	fill->filled = 0;
+	return fill;
+}
+
+static void commitFill(CacheFill *fill);
+
+// Caller holds the mutex, which is released while the new version is put
+// together from the stale copy and the host's delta
+static void updateEntry(CacheEntry *cached, const char *path, const ManifestEntry *entry) {
+	CacheFill *fill = claimFill(entry);
+	if (!fill)
+		return;
+
+	char oldPath[CACHE_PATH_SIZE];
+	entryPath(oldPath, entry->hash, "");
+	uint32_t oldSize = cached->size;
+
+	// Keeps the stale copy from being evicted meanwhile
+	cached->users++;
+	OSUnlockMutex(&mutex);
+
+	int oldFd = open(oldPath, O_RDONLY);
+	bool ok = oldFd >= 0 && rebuildFromDelta(path, oldFd, oldSize, fill->fd, entry->size);
+	if (oldFd >= 0)
+		close(oldFd);
+
+	OSLockMutex(&mutex);
+	cached = findEntry(entry->hash);
+	if (cached)
+		cached->users--;
+	OSUnlockMutex(&mutex);
+
+	if (ok) {
+		fill->filled = entry->size;
+		commitFill(fill);
+	} else {
+		abandonFill(fill);
+	}
+
+	OSLockMutex(&mutex);
+}
+
+bool openCachedFile(const char *filePath, const ManifestEntry *entry, const char *mode, FSFileHandle *fileHandle) {
+	if (!cacheOpen || !isReadOnlyMode(mode))
+		return false;
+
+	OSLockMutex(&mutex);
+	CacheEntry *cached = findEntry(entry->hash);
+	if (cached && !isCurrent(cached, entry) && canUpdate(cached)) {
+		updateEntry(cached, filePath, entry);
+		cached = findEntry(entry->hash);
+	}
+
+	if (!cached || !isCurrent(cached, entry)) {
+		__atomic_fetch_add(&sdCacheStats.misses, 1, __ATOMIC_RELAXED);
+		OSUnlockMutex(&mutex);
+		return false;
+	}
+
+	char path[CACHE_PATH_SIZE];
+	entryPath(path, entry->hash, "");
+	int localFd = open(path, O_RDONLY);
+	if (localFd < 0) {
+		// Deleted behind our back
+		removeEntry(cached);
+		__atomic_fetch_add(&sdCacheStats.misses, 1, __ATOMIC_RELAXED);
+		OSUnlockMutex(&mutex);
+		return false;
+	}
+
+	FSFileHandle handle = nextLocalHandle++;
+	while (findRedirectedFile(handle))
+		handle = nextLocalHandle++;
+
+	RedirectedFile *file = addRedirectedFile(handle);
+	if (!file) {
+		close(localFd);
+		OSUnlockMutex(&mutex);
+		return false;
+	}
+
+	cached->users++;
+	cached->lastUse = nextUse++;
+	dirty = true;
+	__atomic_fetch_add(&sdCacheStats.hits, 1, __ATOMIC_RELAXED);
+	OSUnlockMutex(&mutex);
+
+	file->size    = entry->size;
+	file->hash    = entry->hash;
+	file->localFd = localFd;
+
+	*fileHandle = handle;
+	return true;
+}
+
+void closeCachedFile(RedirectedFile *file) {
+	close(file->localFd);
+	file->localFd = -1;
+
+	OSLockMutex(&mutex);
+	CacheEntry *cached = findEntry(file->hash);
+	if (cached && cached->users)
+		cached->users--;
+	OSUnlockMutex(&mutex);
+}
+
+uint32_t readCachedFile(RedirectedFile *file, char *dest, uint32_t length) {
+	if (lseek(file->localFd, file->pos, SEEK_SET) < 0)
+		return 0;
+
+	uint32_t done = 0;
+	while (done < length) {
+		int num = read(file->localFd, dest + done, length - done);
+		if (num <= 0)
+			break;
+		done += num;
+	}
+
+	file->pos += done;
+	addCounter(&sdCacheStats.bytesServed, done);
+	return done;
+}
+
+void beginCacheFill(RedirectedFile *file, const ManifestEntry *entry, const char *mode) {
+	if (!cacheOpen || stopping || !isReadOnlyMode(mode))
+		return;
+
+	if (entry->size == 0 || entry->size > sdCacheLimit)
+		return;
+
+	OSLockMutex(&mutex);
+	file->fill = claimFill(entry);
+	OSUnlockMutex(&mutex);
+}
+
+static void appendFill(CacheFill *fill, uint32_t offset, const char *data, uint32_t length) {
+	if (fill->failed || offset > fill->filled || offset + length <= fill->filled)
+		return;
+
+	uint32_t skip = fill->filled - offset;
+	data += skip;
+	length -= skip;
+
+	// The host's file grew, the copy would not match the manifest
+	if (fill->filled + length > fill->size) {
+		fill->failed = true;
+		return;
+	}
+
+	while (length) {
+		int num = write(fill->fd, data, length);
+		if (num <= 0) {
+			fill->failed = true;
+			return;
+		}
+
+		data += num;
+		length -= num;
+		fill->filled += num;
+		addCounter(&sdCacheStats.bytesWritten, num);
+	}
+}
+
+// Called with whatever the host sent for [offset, offset + length)
+void writeCacheFill(RedirectedFile *file, uint32_t offset, const char *data, uint32_t length) {
+	if (file->fill)
+		appendFill(file->fill, offset, data, length);
+}
+
+static void commitFill(CacheFill *fill) {
+	char tempPath[CACHE_PATH_SIZE], path[CACHE_PATH_SIZE];
+	entryPath(tempPath, fill->hash, ".tmp");
+	entryPath(path, fill->hash, "");
+
+	close(fill->fd);
+
+	OSLockMutex(&mutex);
+	CacheEntry *stale = findEntry(fill->hash);
+	bool ok = cacheOpen && (!stale || stale->users == 0);
+	if (ok && stale)
+		removeEntry(stale);
+
+	ok = ok && makeRoom(fill->size);
+	if (ok) {
+		unlink(path);
+		ok = rename(tempPath, path) == 0;
+	}
+
+	CacheEntry entry = { fill->hash, fill->size, fill->mtime, nextUse++, 0 };
+	if (ok && insertEntry(&entry)) {
+		__atomic_fetch_add(&sdCacheStats.fills, 1, __ATOMIC_RELAXED);
+		dirty = true;
+		scheduleIndexWrite();
+	} else {
+		unlink(ok ? path : tempPath);
+	}
+
+	fill->used = false;
+	OSUnlockMutex(&mutex);
+}
+
+// The host changed or deleted the file while the game runs, called after
+// the manifest was updated. The copy is dropped unless it is open or can be
+// brought up to date from a delta, and a copy being written is given up on
+// as it would mix both versions.
+void invalidateCachedFile(uint64_t hash) {
+	if (!cacheOpen)
+		return;
+
+	OSLockMutex(&mutex);
+
+	for (uint32_t i = 0; i < MAX_CACHE_FILLS; i++) {
+		if (fills[i].used && fills[i].hash == hash)
+			fills[i].failed = true;
+	}
+
+	CacheEntry *cached = findEntry(hash);
+	if (cached && cached->users == 0 && (!findManifestEntryByHash(hash) || !canUpdate(cached)))
+		removeEntry(cached);
+
+	OSUnlockMutex(&mutex);
+}
+
+// Whether opening the file will not need the host to send all of it
+bool isCachedFile(uint64_t hash) {
+	if (!cacheOpen)
+		return false;
+
+	OSLockMutex(&mutex);
+	const CacheEntry *cached = findEntry(hash);
+	const ManifestEntry *entry = findManifestEntryByHash(hash);
+	bool usable = cached && entry && (isCurrent(cached, entry) || canUpdate(cached));
+	OSUnlockMutex(&mutex);
+	return usable;
+}
+
+// Runs on the I/O thread, one chunk per turn
+static void runTailFill(AsyncRequest *request) {
+	CacheFill *fill = (CacheFill *)request->context;
+
+	if (!stopping && clientEnabled && !fill->failed) {
+		if (fill->serverPos != fill->filled) {
+			uint32_t args[2] = { htonl(fill->handle), htonl(fill->filled) };
+			sendRequest(OP_SET_POS, args, sizeof(args), NULL, 0);
+			fill->serverPos = fill->filled;
+		}
+
+		uint32_t length = fill->size - fill->filled;
+		if (length > TAIL_FILL_CHUNK)
+			length = TAIL_FILL_CHUNK;
+
+		uint32_t args[3] = { htonl(fill->handle), htonl(1), htonl(length) };
+		uint32_t reply[2];
+		uint32_t received = requestReply(OP_READ, args, sizeof(args), reply, sizeof(reply), tailBuffer, length);
+		uint32_t start = fill->serverPos;
+		fill->serverPos += ntohl(reply[1]);
+
+		// Nothing came, or a chunk failed to decode and left a gap
+		if (received == 0 || received < ntohl(reply[1]))
+			fill->failed = true;
+		appendFill(fill, start, tailBuffer, received);
+
+		if (!stopping && !fill->failed && fill->filled < fill->size) {
+			queueAsyncRequest(request);
+			return;
+		}
+	}
+
+	uint32_t args = htonl(fill->handle);
+	sendRequest(OP_CLOSE, &args, 4, NULL, 0);
+
+	if (!fill->failed && fill->filled == fill->size)
+		commitFill(fill);
+	else
+		abandonFill(fill);
+}
+
+// Completes the file's fill as it is closed. Returns true if the host file
+// was handed to the I/O thread to fetch the rest, it closes it when done.
+bool finishCacheFill(RedirectedFile *file) {
+	CacheFill *fill = file->fill;
+	if (!fill)
+		return false;
+
+	file->fill = NULL;
+	if (!fill->failed && fill->filled == fill->size) {
+		commitFill(fill);
+		return false;
+	}
+
+	if (fill->failed || stopping || !isIoThreadRunning()) {
+		abandonFill(fill);
+		return false;
+	}
+
+	fill->handle    = file->handle;
+	fill->serverPos = file->serverPos;
+
+	AsyncRequest *request = &fill->request;
+	memset(request, 0, sizeof(AsyncRequest));
+	request->run     = runTailFill;
+	request->context = fill;
+	queueAsyncRequest(request);
+	return true;
+}
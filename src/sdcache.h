@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "handles.h"
+#include "manifest.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct SdCacheStats {
+	uint32_t hits;      // Opens served from the SD card
+	uint32_t misses;    // Opens that had to go to the host
+	uint32_t fills;     // Files written to the cache
+	uint32_t evictions;
+	Counter64 bytesServed;
+	Counter64 bytesWritten;
+	uint64_t bytesCached;
+} SdCacheStats;
+
+extern SdCacheStats sdCacheStats;
+
+void initSdCache();
+void openSdCache(const char *titleID);
+void stopSdCache();
+void closeSdCache();
+
+bool openCachedFile(const char *path, const ManifestEntry *entry, const char *mode, FSFileHandle *fileHandle);
+void closeCachedFile(RedirectedFile *file);
+uint32_t readCachedFile(RedirectedFile *file, char *dest, uint32_t length);
+
+void beginCacheFill(RedirectedFile *file, const ManifestEntry *entry, const char *mode);
+void writeCacheFill(RedirectedFile *file, uint32_t offset, const char *data, uint32_t length);
+bool finishCacheFill(RedirectedFile *file);
+
+void invalidateCachedFile(uint64_t hash);
+bool isCachedFile(uint64_t hash);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
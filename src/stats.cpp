@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <coreinit/mutex.h>
+#include <coreinit/title.h>
+#include <netinet/in.h>
+
+#include "bufferpool.h"
+#include "channel.h"
+#include "compression.h"
+#include "delta.h"
+#include "globals.h"
+#include "loader.h"
+#include "prefetch.h"
+#include "protocol.h"
+#include "overlay.h"
+#include "readahead.h"
+#include "reload.h"
+#include "sdcache.h"
+#include "stats.h"
+#include "writebehind.h"
+
+// Everything recorded from the hooks is a relaxed atomic add to a static
+// counter, so any thread can record without allocating or taking a lock.
+// The module statistics are counted the same way with addCounter and
+// __atomic_fetch_add, apart from the loader's and reload's, which are never
+// updated from two threads at once.
+
+#define MAX_OPCODES 0x20
+
+static HookStats hookStats[HOOK_COUNT];
+static RequestStats requestStats[MAX_OPCODES];
+static OSTime phaseTimes[PHASE_COUNT];
+
+// Only for building the report, which is never done from a hook
+static OSMutex reportMutex;
+static char report[0x2000];
+
+static const char *hookNames[HOOK_COUNT] = {
+	"FSOpenFile",
+	"FSCloseFile",
+	"FSReadFile",
+	"FSWriteFile",
+	"FSSetPosFile",
+	"FSGetStatFile",
+	"FSGetStat",
+	"SAVEOpenFile",
+	"FSOpenFileEx",
+	"FSReadFileWithPos",
+	"FSOpenFileAsync",
+	"FSCloseFileAsync",
+	"FSReadFileAsync",
+	"FSWriteFileAsync",
+	"FSSetPosFileAsync",
+	"FSGetStatFileAsync",
+	"FSGetStatAsync",
+	"SAVEOpenFileAsync",
+	"FSOpenFileExAsync",
+	"FSReadFileWithPosAsync",
+};
+
+static const char *poolNames[POOL_CLASS_COUNT] = {
+	"loader", "read-ahead", "write-behind", "prefetch",
+};
+
+static const char *phaseNames[PHASE_COUNT] = {
+	"start", "connect", "overlay", "package", "patches", "addr", "code", "data", "done",
+};
+
+void addCounter(Counter64 *counter, uint32_t value) {
+	uint32_t old = __atomic_fetch_add(&counter->low, value, __ATOMIC_RELAXED);
+	if (old + value < old)
+		__atomic_fetch_add(&counter->high, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t readCounter(const Counter64 *counter) {
+	return ((uint64_t)counter->high << 32) | counter->low;
+}
+
+void initStats() {
+	OSInitMutex(&reportMutex);
+}
+
+void resetStats() {
+	memset(hookStats, 0, sizeof(hookStats));
+	memset(requestStats, 0, sizeof(requestStats));
+	memset(phaseTimes, 0, sizeof(phaseTimes));
+}
+
+void recordPassthrough(StatsHook hook) {
+	__atomic_fetch_add(&hookStats[hook].passthrough, 1, __ATOMIC_RELAXED);
+}
+
+void recordRedirected(StatsHook hook, OSTime start, uint32_t bytes) {
+	HookStats *stats = &hookStats[hook];
+	OSTime ticks = OSGetTime() - start;
+
+	uint32_t micros = (uint32_t)OSTicksToMicroseconds(ticks);
+	uint32_t bucket = micros ? 31 - __builtin_clz(micros) : 0;
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+
+	__atomic_fetch_add(&stats->redirected, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+	addCounter(&stats->ticks, (uint32_t)ticks);
+	if (bytes)
+		addCounter(&stats->bytes, bytes);
+}
+
+void recordRequest(uint8_t opcode, bool roundTrip) {
+	RequestStats *stats = &requestStats[opcode & (MAX_OPCODES - 1)];
+	__atomic_fetch_add(roundTrip ? &stats->roundTrips : &stats->oneWay, 1, __ATOMIC_RELAXED);
+}
+
+// Only called from ON_APPLICATION_START
+void markPhase(BootPhase phase) {
+	phaseTimes[phase] = OSGetTime();
+}
+
+static uint32_t phaseMillis(BootPhase phase) {
+	return phaseTimes[phase] ? (uint32_t)OSTicksToMilliseconds(phaseTimes[phase] - phaseTimes[PHASE_START]) : 0;
+}
+
+// Fills `lines` with a short summary for the config menu, one line per
+// hook that was called, and returns the number of lines written
+uint32_t summarizeStats(char (*lines)[STATS_LINE_LENGTH], uint32_t maxLines) {
+	uint32_t count = 0;
+
+	if (count < maxLines && phaseTimes[PHASE_DONE])
+		snprintf(lines[count++], STATS_LINE_LENGTH, "Boot: connected %u ms, patched %u ms, done %u ms",
+		         phaseMillis(PHASE_CONNECTED), phaseMillis(PHASE_PATCHES), phaseMillis(PHASE_DONE));
+
+	uint32_t roundTrips = 0, oneWay = 0;
+	for (uint32_t i = 0; i < MAX_OPCODES; i++) {
+		roundTrips += requestStats[i].roundTrips;
+		oneWay += requestStats[i].oneWay;
+	}
+	if (count < maxLines)
+		snprintf(lines[count++], STATS_LINE_LENGTH, "Host requests: %u round trips, %u one-way", roundTrips, oneWay);
+
+	for (uint32_t i = 0; i < HOOK_COUNT && count < maxLines; i++) {
+		const HookStats *stats = &hookStats[i];
+		if (!stats->redirected && !stats->passthrough)
+			continue;
+
+		uint32_t average = stats->redirected ? (uint32_t)(OSTicksToMicroseconds(readCounter(&stats->ticks)) / stats->redirected) : 0;
+		snprintf(lines[count++], STATS_LINE_LENGTH, "%s: %u ours, %u passed, %u KiB, avg %u us", hookNames[i],
+		         stats->redirected, stats->passthrough, (uint32_t)(readCounter(&stats->bytes) >> 10), average);
+	}
+
+	if (count < maxLines)
+		snprintf(lines[count++], STATS_LINE_LENGTH, "SD cache: %u hits, %u misses, read-ahead: %u hits, %u misses",
+		         sdCacheStats.hits, sdCacheStats.misses, readAheadStats.hits, readAheadStats.misses);
+
+	uint32_t reserved = 0, highWater = 0;
+	for (uint32_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		reserved += poolStats[i].slabs * poolStats[i].slabSize;
+		highWater += poolStats[i].highWater * poolStats[i].slabSize;
+	}
+	if (count < maxLines)
+		snprintf(lines[count++], STATS_LINE_LENGTH, "Buffers: %u KiB reserved, at most %u KiB used",
+		         reserved >> 10, highWater >> 10);
+
+	if (count < maxLines && overlayStats.files)
+		snprintf(lines[count++], STATS_LINE_LENGTH, "SD overlay: %u files, %u opens, %u KiB",
+		         overlayStats.files, overlayStats.opens, (uint32_t)(readCounter(&overlayStats.bytesServed) >> 10));
+
+	if (count < maxLines && (prefetchStats.ranges || prefetchStats.recorded))
+		snprintf(lines[count++], STATS_LINE_LENGTH, "Prefetch: %u ranges, %u hits, %u KiB wasted",
+		         prefetchStats.ranges, prefetchStats.hits, (uint32_t)(readCounter(&prefetchStats.bytesWasted) >> 10));
+
+	return count;
+}
+
+// Everything, including the latency histograms, as text
+static uint32_t formatStats(char *buffer, uint32_t size) {
+	uint32_t length = 0;
+#define APPEND(...) \
+	if (length < size) length += snprintf(buffer + length, size - length, __VA_ARGS__)
+
+	APPEND("CafeLoader statistics for %016llX\n\nBoot phases (ms since start):", OSGetTitleID());
+	for (uint32_t i = 1; i < PHASE_COUNT; i++)
+		APPEND(" %s %u", phaseNames[i], phaseMillis((BootPhase)i));
+
+	APPEND("\n\n%-22s %9s %9s %12s %9s  latency histogram (calls per 2^n us)\n",
+	       "hook", "ours", "passed", "bytes", "avg us");
+	for (uint32_t i = 0; i < HOOK_COUNT; i++) {
+		const HookStats *stats = &hookStats[i];
+		uint32_t average = stats->redirected ? (uint32_t)(OSTicksToMicroseconds(readCounter(&stats->ticks)) / stats->redirected) : 0;
+
+		APPEND("%-22s %9u %9u %12llu %9u ", hookNames[i], stats->redirected, stats->passthrough,
+		       readCounter(&stats->bytes), average);
+		for (uint32_t j = 0; j < LATENCY_BUCKETS; j++)
+			APPEND(" %u", stats->latency[j]);
+		APPEND("\n");
+	}
+
+	APPEND("\nRequests per opcode (round trips / one-way):");
+	for (uint32_t i = 1; i < MAX_OPCODES; i++) {
+		if (requestStats[i].roundTrips || requestStats[i].oneWay)
+			APPEND(" 0x%02X %u/%u", i, requestStats[i].roundTrips, requestStats[i].oneWay);
+	}
+
+	APPEND("\n\nRead-ahead: %u hits, %u misses, %llu bytes served, %llu fetched\n",
+	       readAheadStats.hits, readAheadStats.misses, readCounter(&readAheadStats.bytesServed),
+	       readCounter(&readAheadStats.bytesFetched));
+	APPEND("SD cache: %u hits, %u misses, %u fills, %u evictions, %llu bytes served\n",
+	       sdCacheStats.hits, sdCacheStats.misses, sdCacheStats.fills, sdCacheStats.evictions,
+	       readCounter(&sdCacheStats.bytesServed));
+	APPEND("Prefetch: %u ranges, %u hits, %llu bytes fetched, %llu served, %llu wasted, %u recorded\n",
+	       prefetchStats.ranges, prefetchStats.hits, readCounter(&prefetchStats.bytesFetched),
+	       readCounter(&prefetchStats.bytesServed), readCounter(&prefetchStats.bytesWasted), prefetchStats.recorded);
+	// Ratio in hundredths, bytes per microsecond are MB/s
+	uint64_t received = readCounter(&compressionStats.bytesReceived);
+	uint64_t decoded = readCounter(&compressionStats.bytesDecoded);
+	uint64_t unpacked = readCounter(&compressionStats.bytesUnpacked);
+	uint64_t decodeMicros = OSTicksToMicroseconds(readCounter(&compressionStats.decodeTime));
+	uint32_t ratio = received ? (uint32_t)(decoded * 100 / received) : 0;
+	APPEND("Compression: %u chunks, %u stored, %u errors, %llu bytes received, %llu decoded, ratio %u.%02u, "
+	       "%llu decompressed in %llu us (%llu MB/s)\n",
+	       compressionStats.chunksCompressed, compressionStats.chunksStored, compressionStats.errors,
+	       received, decoded, ratio / 100, ratio % 100, unpacked, decodeMicros,
+	       decodeMicros ? unpacked / decodeMicros : 0ULL);
+	APPEND("SD overlay: %u files indexed in %u us, %u opens, %u failed, %llu bytes served\n",
+	       overlayStats.files, overlayStats.indexTime, overlayStats.opens, overlayStats.failures,
+	       readCounter(&overlayStats.bytesServed));
+	for (uint32_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		const PoolStats *stats = &poolStats[i];
+		APPEND("Pool %s: %u of %u slabs of %u bytes used, at most %u, %u failed, %u from the heap\n", poolNames[i],
+		       stats->used, stats->slabs, stats->slabSize, stats->highWater, stats->failures, stats->overflows);
+	}
+	APPEND("Write-behind: %u writes, %u flushes, %llu bytes, %u closes confirmed, %u failed\n",
+	       writeBehindStats.writes, writeBehindStats.flushes, readCounter(&writeBehindStats.bytesWritten),
+	       writeBehindStats.acks, writeBehindStats.failures);
+	APPEND("Delta: %u updates, %u failures, %llu bytes copied, %llu fetched\n",
+	       deltaStats.updates, deltaStats.failures, readCounter(&deltaStats.bytesCopied),
+	       readCounter(&deltaStats.bytesFetched));
+	APPEND("Loader: %u bytes compared, %u written\n", loaderStats.bytesCompared, loaderStats.bytesWritten);
+	APPEND("Reload: %u applied, %u failed, %llu bytes fetched, %llu written\n", reloadStats.reloads,
+	       reloadStats.failures, reloadStats.bytesFetched, reloadStats.bytesWritten);
+
+#undef APPEND
+	return length < size ? length : size - 1;
+}
+
+// Sends the report to client.py as a debug file, which saves it under
+// DebugFiles/<title ID>-stats.txt
+void sendStats() {
+	if (!clientEnabled)
+		return;
+
+	OSLockMutex(&reportMutex);
+
+	char name[32];
+	int nameLength = snprintf(name, sizeof(name), "%016llX-stats.txt", OSGetTitleID());
+	uint32_t length = formatStats(report, sizeof(report));
+
+	char args[8 + sizeof(name)];
+	*(uint32_t *)(args + 0) = htonl(nameLength);
+	*(uint32_t *)(args + 4) = htonl(length);
+	memcpy(args + 8, name, nameLength);
+	sendRequest(OP_DEBUG_FILE, args, 8 + nameLength, report, length);
+
+	OSUnlockMutex(&reportMutex);
+}
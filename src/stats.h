@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <coreinit/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// The hooks in patches.cpp, async ones are timed on the I/O thread
+typedef enum StatsHook {
+	HOOK_OPEN_FILE,
+	HOOK_CLOSE_FILE,
+	HOOK_READ_FILE,
+	HOOK_WRITE_FILE,
+	HOOK_SET_POS_FILE,
+	HOOK_GET_STAT_FILE,
+	HOOK_GET_STAT,
+	HOOK_SAVE_OPEN_FILE,
+	HOOK_OPEN_FILE_EX,
+	HOOK_READ_FILE_WITH_POS,
+	HOOK_OPEN_FILE_ASYNC,
+	HOOK_CLOSE_FILE_ASYNC,
+	HOOK_READ_FILE_ASYNC,
+	HOOK_WRITE_FILE_ASYNC,
+	HOOK_SET_POS_FILE_ASYNC,
+	HOOK_GET_STAT_FILE_ASYNC,
+	HOOK_GET_STAT_ASYNC,
+	HOOK_SAVE_OPEN_FILE_ASYNC,
+	HOOK_OPEN_FILE_EX_ASYNC,
+	HOOK_READ_FILE_WITH_POS_ASYNC,
+	HOOK_COUNT,
+} StatsHook;
+
+// Points of ON_APPLICATION_START, in the order they are reached
+typedef enum BootPhase {
+	PHASE_START,
+	PHASE_CONNECTED,
+	PHASE_OVERLAY,
+	PHASE_PACKAGE,
+	PHASE_PATCHES,
+	PHASE_ADDR,
+	PHASE_CODE,
+	PHASE_DATA,
+	PHASE_DONE,
+	PHASE_COUNT,
+} BootPhase;
+
+// Bucket N counts redirected calls that took [2^N, 2^(N+1)) microseconds,
+// the last one everything slower
+#define LATENCY_BUCKETS 16
+
+// A 64-bit total that can be added to atomically with 32-bit operations
+typedef struct Counter64 {
+	uint32_t high;
+	uint32_t low;
+} Counter64;
+
+typedef struct HookStats {
+	uint32_t redirected;
+	uint32_t passthrough;
+	Counter64 bytes; // Read or written by redirected calls
+	Counter64 ticks; // Spent in redirected calls
+	uint32_t latency[LATENCY_BUCKETS];
+} HookStats;
+
+typedef struct RequestStats {
+	uint32_t roundTrips; // Requests that waited for a reply
+	uint32_t oneWay;
+} RequestStats;
+
+#define STATS_LINE_LENGTH 80
+
+void initStats();
+void resetStats();
+
+void recordPassthrough(StatsHook hook);
+void recordRedirected(StatsHook hook, OSTime start, uint32_t bytes);
+void recordRequest(uint8_t opcode, bool roundTrip);
+void markPhase(BootPhase phase);
+
+// For the modules' own 64-bit totals
+void addCounter(Counter64 *counter, uint32_t value);
+uint64_t readCounter(const Counter64 *counter);
+
+uint32_t summarizeStats(char (*lines)[STATS_LINE_LENGTH], uint32_t maxLines);
+void sendStats();
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -0,0 +1,48 @@
+#include <string.h>
+
+#include "bufferpool.h"
+#include "writebehind.h"
+
+// Small writes the game makes to a redirected file are collected here and
+// sent to the host as one OP_WRITE once the buffer is full, the game writes
+// somewhere else, or it reads, stats or closes the file. See flushWrites().
+
+WriteBehindStats writeBehindStats;
+
+// Appends a write at the file's position if it continues what the buffer
+// holds and fits. Returns false if the buffer has to be flushed first, or
+// the write is too large to gain anything from it.
+bool appendWriteBehind(RedirectedFile *file, const char *data, uint32_t length) {
+	if (length >= WRITE_BEHIND_SIZE)
+		return false;
+
+	if (file->writeLength && (file->pos != file->writeStart + file->writeLength ||
+	                          file->writeLength + length > WRITE_BEHIND_SIZE))
+		return false;
+
+	if (!file->writeBuffer) {
+		file->writeBuffer = (char *)allocPoolSlab(POOL_WRITE_BEHIND);
+		if (!file->writeBuffer)
+			return false;
+		__atomic_fetch_add(&writeBehindStats.bytesAllocated, WRITE_BEHIND_SIZE, __ATOMIC_RELAXED);
+	}
+
+	if (!file->writeLength)
+		file->writeStart = file->pos;
+
+	memcpy(file->writeBuffer + file->writeLength, data, length);
+	file->writeLength += length;
+	__atomic_fetch_add(&writeBehindStats.writes, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// The caller flushed it before
+void freeWriteBehind(RedirectedFile *file) {
+	if (!file->writeBuffer)
+		return;
+
+	freePoolBuffer(file->writeBuffer);
+	file->writeBuffer = NULL;
+	file->writeLength = 0;
+	__atomic_fetch_sub(&writeBehindStats.bytesAllocated, WRITE_BEHIND_SIZE, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "handles.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Size of a file's buffer, and of all of them together
+#define WRITE_BEHIND_SIZE   0x10000
+#define WRITE_BEHIND_BUDGET 0x80000
+
+typedef struct WriteBehindStats {
+	uint32_t writes;   // Writes that went into a buffer
+	uint32_t flushes;  // OP_WRITE messages sent for them
+	uint32_t acks;     // Closes the host confirmed
+	uint32_t failures; // Closes the host could not write everything for
+	Counter64 bytesWritten;
+	uint32_t bytesAllocated;
+} WriteBehindStats;
+
+extern WriteBehindStats writeBehindStats;
+
+bool appendWriteBehind(RedirectedFile *file, const char *data, uint32_t length);
+void freeWriteBehind(RedirectedFile *file);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus